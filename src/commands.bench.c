@@ -0,0 +1,251 @@
+#include "commands.c"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+/*
+Usage:
+    ./text-editor-bench <benchmark> [params...]
+
+Example:
+    ./text-editor-bench concurrent-edit 8 200
+    ./text-editor-bench rewrite 4096 /mnt/big/bench.txt   # 4G, more than RAM to see the disk overlap
+    ./text-editor-bench find 256
+*/
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void remove_with_changelog(const char *filename)
+{
+    remove(filename);
+    char changelog_filename[PATH_MAX];
+    get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
+    remove(changelog_filename);
+}
+
+//N processes doing insert-line/append-line on the same file as fast as they can
+static int bench_concurrent_edit(int argc, const char *nonnull argv[static argc])
+{
+    size_t writers = argc > 0 ? (size_t)atoi(argv[0]) : 4,
+           edits = argc > 1 ? (size_t)atoi(argv[1]) : 100,
+           initial_lines = argc > 2 ? (size_t)atoi(argv[2]) : 10000;
+    const char *filename = "bench_concurrent_edit.txt";
+
+    auto file = $fopen(filename, "w");
+    for (size_t i = 0; i < initial_lines; i++) {
+        fprintf(file, "initial line %zu\n", i);
+    }
+    fclose(file);
+    defer { remove_with_changelog(filename); };
+
+    fflush(stdout);
+    double start = now();
+    pid_t children[writers];
+    for (size_t i = 0; i < writers; i++) {
+        children[i] = fork();
+        if (children[i] < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (children[i] == 0) {
+            freopen("/dev/null", "w", stdout);
+            for (size_t edit = 0; edit < edits; edit++) {
+                char line_number[32];
+                snprintf(line_number, sizeof(line_number), "%zu", (edit * 7919) % initial_lines + 1);
+                const char *params_append[] = { filename, "appended by a benchmark writer" };
+                const char *params_insert[] = { filename, line_number, "inserted by a benchmark writer" };
+                if (edit % 2 ? insert_line(3, params_insert) : append_line(2, params_append)) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < writers; i++) {
+        int status;
+        waitpid(children[i], &status, 0);
+        failed |= not WIFEXITED(status) or WEXITSTATUS(status) != 0;
+    }
+    double elapsed = now() - start;
+
+    int fd = open(filename, O_RDONLY);
+    ssize_t lines = count_lines(fd);
+    close(fd);
+    size_t expected = initial_lines + writers * edits;
+
+    printf("%zu writer(s) x %zu edit(s) on %zu lines: %.3fs, %.1f edits/s, %zd/%zu lines%s\n",
+           writers, edits, initial_lines, elapsed, (double)(writers * edits) / elapsed,
+           lines, expected, failed or lines != (ssize_t)expected ? " (CORRUPTED)" : "");
+    return failed or lines != (ssize_t)expected;
+}
+
+//Out of the page cache, so every run reads from the disk like it would for a file bigger than RAM
+static void drop_cache(const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+//Rewriting a file the old way (read all of it, process all of it, write all of it, on one thread) against the three
+//stage pipeline `trim`, `insert-line` and `delete-line` use now. Both do `trim`'s work and write through to the disk
+//before the clock stops
+static int bench_rewrite(int argc, const char *nonnull argv[static argc])
+{
+    size_t megabytes = argc > 0 ? (size_t)atoi(argv[0]) : 512;
+    const char *filename = argc > 1 ? argv[1] : "bench_rewrite.txt",
+               *output_filename = "bench_rewrite.out";
+
+    auto file = $fopen(filename, "w");
+    for (size_t size = 0, i = 0; size < megabytes << 20; i++) {
+        size += (size_t)fprintf(file, "line %zu of the rewrite benchmark, with some trailing whitespace %s\n", i, i % 3 ? "  " : "\t");
+    }
+    fclose(file);
+    defer {
+        remove(filename);
+        remove(output_filename);
+    };
+
+    for (int pipelined = 0; pipelined < 2; pipelined++) {
+        drop_cache(filename);
+        int in = open(filename, O_RDONLY), out = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (in < 0 or out < 0) {
+            perror("Error opening benchmark files");
+            return 1;
+        }
+
+        double start = now();
+        int result;
+        if (pipelined) {
+            result = pipeline_run(in, out, ^(const char *data, size_t len, struct PipelineBuffer *output) { trim_lines(data, len, output); });
+        } else {
+            struct stat st;
+            result = fstat(in, &st);
+            size_t size = result == 0 ? (size_t)st.st_size : 0;
+            char *data = $malloc(size + 1);
+            struct PipelineBuffer buffer = {0};
+            if (result == 0)
+                result = read_all(in, data, size);
+            if (result == 0)
+                trim_lines(data, size, &buffer);
+            if (result == 0 and buffer.len > 0) {
+                char *processed = $assert_nonnull(buffer.data);
+                result = write_all(out, processed, buffer.len);
+            }
+            free(data);
+            free(buffer.data);
+        }
+        result |= fsync(out);
+        double elapsed = now() - start;
+        close(in);
+        close(out);
+
+        printf("%-10s %zuM: %.3fs, %.1f MB/s%s\n", pipelined ? "pipelined" : "serial", megabytes, elapsed,
+               (double)megabytes / elapsed, result != 0 ? " (FAILED)" : "");
+        if (result != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//`find`'s searcher over text with some accented words in it: case sensitive, ASCII `-i`, and `-i` with a non-ASCII
+//needle (which has to fold code points). The last one is meant to stay within 2x of the first
+static int bench_find(int argc, const char *nonnull argv[static argc])
+{
+    size_t megabytes = argc > 0 ? (size_t)atoi(argv[0]) : 256;
+    size_t size = megabytes << 20;
+    char *text = $malloc(size);
+    defer { free(text); };
+    static const char *words[] = { "lorem", "ipsum", "dolor", "café", "sit", "amet", "naïve", "elit", "über", "sed" };
+    for (size_t pos = 0, i = 0; pos < size; i++) {
+        const char *word = i % 4099 == 0 ? "Zürich" : words[(i * 7919) % (sizeof(words) / sizeof(*words))];
+        for (size_t j = 0; word[j] != '\0' and pos < size; j++) {
+            text[pos++] = word[j];
+        }
+        if (pos < size)
+            text[pos++] = i % 12 == 11 ? '\n' : ' ';
+    }
+
+    static const struct {
+        const char *name, *needle;
+        bool ignore_case;
+    } cases[] = {
+        { "plain", "Zürich", false },
+        { "ascii -i", "ZURICH", true },
+        { "unicode -i", "ZÜRICH", true },
+    };
+    double plain = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(*cases); i++) {
+        struct Searcher searcher;
+        searcher_init(&searcher, cases[i].needle, cases[i].ignore_case);
+        // best of a few, one pass is over too quickly to not be mostly noise
+        size_t matches = 0;
+        double elapsed = 0;
+        for (int run = 0; run < 5; run++) {
+            matches = 0;
+            double start = now();
+            for (const char *pos = text, *end = text + size, *match; (match = searcher_find(&searcher, pos, (size_t)(end - pos))) != nullptr;) {
+                matches++;
+                pos = match + 1;
+            }
+            double run_time = now() - start;
+            elapsed = run == 0 or run_time < elapsed ? run_time : elapsed;
+        }
+        searcher_free(&searcher);
+
+        plain = i == 0 ? elapsed : plain;
+        printf("%-12s %zuM: %.3fs, %.1f MB/s, %zu match(es), %.2fx the plain search\n", cases[i].name, megabytes, elapsed,
+               (double)megabytes / elapsed, matches, elapsed / plain);
+    }
+    return 0;
+}
+
+static struct {
+    const char *name;
+    int (*run)(int argc, const char *nonnull argv[static argc]);
+} benchmarks[] = {
+    { "concurrent-edit", &bench_concurrent_edit },
+    { "rewrite", &bench_rewrite },
+    { "find", &bench_find },
+};
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Available benchmarks:\n");
+        for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+            fprintf(stderr, "  %s\n", benchmarks[i].name);
+        }
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        if (strcmp(benchmarks[i].name, argv[1]) == 0) {
+            return benchmarks[i].run(argc - 2, &argv[2]);
+        }
+    }
+
+    fprintf(stderr, "Benchmark '%s' not found.\n", argv[1]);
+    return 1;
+}
+
+#pragma clang assume_nonnull end
@@ -1,16 +1,84 @@
 #include "commands.h"
-
+#include "cut.h"
+#include "dedupe.h"
+#include "delta.h"
+#include "diff.h"
+#include "fileio.h"
+#include "lineindex.h"
+#include "normalize.h"
+#include "parallel.h"
+#include "pipeline.h"
+#include "search.h"
+#include "sort.h"
+#include "stats.h"
+#include "transaction.h"
+#include "trigram.h"
+#include "utf8.h"
+
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #pragma clang assume_nonnull begin
 
 static struct Command commands[MAX_COMMANDS];
 static size_t command_count = 0;
 
-static inline void get_changelog_filename(const char *filename, char *changelog_filename, size_t size)
-{ snprintf(changelog_filename, size, "%s.changelog", filename); }
+//Goes between the positional parameters and the flags and options in what `arrange_params` hands to actions. It's
+//found by address, so a "--" that was passed as a positional parameter is never taken for it
+static const char options_start[] = "--";
+
+//Where the flags and options start in `params`. Without `options_start` (actions called directly) it's all looked through
+static size_t options_index(size_t param_len, const char *nonnull params[static param_len])
+{
+    for (size_t i = 0; i < param_len; i++) {
+        if (params[i] == options_start) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+//How many of `params` are positional, `arrange_params` puts all the flags and options after them
+static size_t count_positional(size_t param_len, const char *nonnull params[static param_len], const char *command_name)
+{
+    size_t options = options_index(param_len, params);
+    if (options > 0)
+        return options - 1;
+
+    auto cmd = $assert_nonnull(find_command(command_name));
+    for (size_t i = 0; i < param_len; i++) {
+        if (find_option(cmd, params[i]) != nullptr) {
+            return i;
+        }
+    }
+    return param_len;
+}
+
+//"12" and the like, 0 if it isn't a whole number above 0
+static size_t parse_count(const char *text)
+{
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    return isdigit((unsigned char)text[0]) and *end == '\0' ? (size_t)value : 0;
+}
+
+//`--threads`, or one per CPU without it. More than a few per CPU only get in each other's way, so that's where it's
+//capped. 0 (after saying why) if it isn't a count at all
+static size_t thread_count(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *threads = option_value(param_len, params, "--threads");
+    if (threads == nullptr)
+        return default_thread_count();
+
+    size_t count = parse_count(threads), cap = 4 * default_thread_count();
+    if (count == 0)
+        fprintf(stderr, "Invalid thread count '%s'.\n", threads);
+    return count < cap ? count : cap;
+}
 
 static int parse_changelog(const char *filename, struct Changelog **changelog)
 {
@@ -54,54 +122,158 @@ static int parse_changelog(const char *filename, struct Changelog **changelog)
     return 0;
 }
 
-static void log_change(const char *operation, const char *filename, size_t line_number, size_t total_lines)
+static int create_file(size_t param_len, const char *nonnull params[static param_len])
 {
-    char changelog_filename[PATH_MAX];
-    get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
-
-    auto changelog_file = $fopen(changelog_filename, "ab");
+    const char *filename = params[0];
 
-    struct ChangelogEntry entry = {0};
-    strncpy(entry.operation, operation, sizeof(entry.operation) - 1);
-    entry.operation[sizeof(entry.operation) - 1] = '\0';
-    entry.timestamp = time(nullptr);
-    entry.line_number = line_number;
-    entry.total_lines = total_lines;
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, true) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
 
-    if (fwrite(&entry, sizeof(entry), 1, changelog_file) != 1) {
-        perror("Error writing to changelog file");
+    // an empty replacement, so creating over an existing file empties it like it always has
+    if (transaction_output(&tx) == nullptr) {
+        return 1;
     }
 
-    fclose(changelog_file);
+    log_change(&tx, "Create File", 0, 0);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+    printf("File '%s' created successfully.\n", filename);
+    return 0;
 }
 
-static int create_file(size_t param_len, const char *nonnull params[static param_len])
+//Only writes the blocks of `destination` that aren't the same as in `source` already. If the ".blocks" hashes the
+//last delta copy left are still good, those stand in for the destination, and it isn't read at all. With `append`
+//the source is expected to be the destination with more on the end, and only that is copied
+static int copy_file_delta(const char *source, const char *destination, bool append)
 {
-    const char *filename = params[0];
-    auto file = $fopen(filename, "wb");
-    defer { fclose(file); };
+    struct MappedFile src;
+    if (map_file(source, &src) != 0) {
+        return 1;
+    }
+    defer { unmap_file(&src); };
 
-    log_change("Create File", filename, 0, 0);
-    printf("File '%s' created successfully.\n", filename);
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, destination, true) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    struct FileStamp stamp;
+    if (file_stamp(tx.fd, &stamp) != 0) {
+        return 1;
+    }
+    size_t dest_size = (size_t)stamp.size;
+
+    __block struct BlockHashes known, hashes = {0};
+    bool have_known = block_hashes_load(destination, tx.fd, &known) == 0;
+    defer {
+        block_hashes_free(&known);
+        block_hashes_free(&hashes);
+    };
+
+    if (append and dest_size <= src.size) {
+        // the last block the destination has is enough to tell it's the start of the source
+        size_t check_from = dest_size > 0 ? (dest_size - 1) / DELTA_BLOCK_SIZE * DELTA_BLOCK_SIZE : 0;
+        char *check = $malloc(DELTA_BLOCK_SIZE);
+        defer { free(check); };
+        if (pread(tx.fd, check, dest_size - check_from, (off_t)check_from) == (ssize_t)(dest_size - check_from)
+            and memcmp(check, &src.data[check_from], dest_size - check_from) == 0) {
+            if (pwrite_all(tx.fd, &src.data[dest_size], src.size - dest_size, (off_t)dest_size) != 0 or fsync(tx.fd) != 0) {
+                perror("Error writing file");
+                return 1;
+            }
+            // only the blocks from the one that was cut short on need hashing again, or all of them (from the source,
+            // which the destination now is) if there weren't any hashes yet
+            block_hashes_update(&known, &src, have_known ? check_from / DELTA_BLOCK_SIZE : 0, default_thread_count());
+            block_hashes_save(destination, tx.fd, &known);
+            log_change(&tx, "Copy File", 0, 0);
+            if (transaction_commit(&tx) != 0) {
+                return 1;
+            }
+            printf("Appended %zu byte(s) from '%s' to '%s'.\n", src.size - dest_size, source, destination);
+            return 0;
+        }
+        fprintf(stderr, "'%s' doesn't start with what's in '%s', comparing every block instead.\n", source, destination);
+    }
+
+    block_hashes_update(&hashes, &src, 0, default_thread_count());
+    if (have_known and dest_size == src.size and known.digest == hashes.digest) {
+        printf("'%s' is already the same as '%s'.\n", destination, source);
+        return 0;
+    }
+
+    __block struct MappedFile dest = { .data = "" };
+    if (not have_known and map_fd(tx.fd, &dest) != 0) {
+        return 1;
+    }
+    defer { unmap_file(&dest); };
+
+    // without hashes to go by it's the same amount of reading either way, so the bytes are just compared
+    struct DeltaInfo info;
+    const uint64_t *source_hashes = $assert_nonnull(hashes.hashes);
+    int result = delta_apply(tx.fd, dest_size, &src, ^bool(size_t block) {
+        if (have_known) {
+            const uint64_t *known_hashes = $assert_nonnull(known.hashes);
+            return block < known.count and known_hashes[block] == source_hashes[block];
+        }
+        size_t offset = block * DELTA_BLOCK_SIZE;
+        size_t len = src.size - offset < DELTA_BLOCK_SIZE ? src.size - offset : DELTA_BLOCK_SIZE;
+        return offset + len <= dest.size and memcmp(&src.data[offset], &dest.data[offset], len) == 0;
+    }, &info);
+    if (result != 0 or fsync(tx.fd) != 0) {
+        return 1;
+    }
+    block_hashes_save(destination, tx.fd, &hashes);
+
+    if (info.changed_blocks == 0 and dest_size == src.size) {
+        printf("'%s' is already the same as '%s'.\n", destination, source);
+        return 0;
+    }
+    log_change(&tx, "Copy File", 0, 0);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+    printf("File copied from '%s' to '%s', %zu of %zu block(s) written (%llu byte(s)).\n", source, destination,
+           info.changed_blocks, info.blocks, (unsigned long long)info.written);
     return 0;
 }
 
 static int copy_file(size_t param_len, const char *nonnull params[static param_len])
 {
     const char *source = params[0], *destination = params[1];
+    if (has_flag(param_len, params, "--delta")) {
+        return copy_file_delta(source, destination, has_flag(param_len, params, "--append"));
+    }
+
     auto src = $fopen(source, "r");
     defer { fclose(src); };
 
-    auto dest = $fopen(destination, "w");
-    defer { fclose(dest); };
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, destination, true) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    auto dest = transaction_output(&tx);
+    if (dest == nullptr) {
+        return 1;
+    }
     
-    char buffer[1024] = {0};
+    char *buffer = $malloc(READ_BUFFER_SIZE);
+    defer { free(buffer); };
     size_t bytes;
-    while ((bytes = fread(buffer, 1, sizeof(buffer), src)) > 0) {
+    while ((bytes = fread(buffer, 1, READ_BUFFER_SIZE, src)) > 0) {
         fwrite(buffer, 1, bytes, dest);
     }
     
-    log_change("Copy File", destination, 0, 0);
+    log_change(&tx, "Copy File", 0, 0);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
     printf("File copied from '%s' to '%s'.\n", source, destination);
     return 0;
 }
@@ -121,44 +293,91 @@ static int delete_file(size_t param_len, const char *nonnull params[static param
 static int show_file(size_t param_len, const char *nonnull params[static param_len])
 {
     const char *filename = params[0];
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
 
-    char line[1024];
-    while (fgets(line, sizeof(line), file)) {
-        fputs(line, stdout);
+    // stdin is already as followed as it gets, it only ends when whatever's writing to it is done
+    if (has_flag(param_len, params, "--follow") and not is_stdin(filename)) {
+        return follow_file(filename, false, (struct FollowHandlers) {
+            .on_data = ^(const char *data, size_t len) { fwrite(data, 1, len, stdout); },
+            .on_idle = ^{ fflush(stdout); },
+            .on_restart = ^{ fprintf(stderr, "'%s' was truncated or replaced, starting over.\n", filename); },
+        }) == 0 ? 0 : 1;
+    }
+
+    int fd = open_input(filename);
+    if (fd < 0) {
+        return 1;
+    }
+    defer { close_input(fd); };
+
+    // anything already printf'd has to come out first, the rest bypasses stdio entirely
+    fflush(stdout);
+    if (copy_fd(fd, STDOUT_FILENO) != 0) {
+        perror("Error showing file");
+        return 1;
     }
-    
     return 0;
 }
 
 
+//Counts lines the way `line-count` does, from the start of `fd`
+static ssize_t count_lines(int fd)
+{
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        perror("Error seeking file");
+        return -1;
+    }
+
+    __block size_t line_count = 0;
+    __block char last = '\n';
+    if (scan_fd(fd, ^(const char *data, size_t len) {
+        line_count += count_newlines(data, len);
+        last = data[len - 1];
+    }) != 0) {
+        return -1;
+    }
+    return (ssize_t)(line_count + (last != '\n'));
+}
+
 static int append_line(size_t param_len, const char *nonnull params[static param_len])
 {
     const char *filename = params[0], *line_content = params[1];
 
-    auto file = $fopen(filename, "a");
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, true) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    // appending in place is safe under the lock, readers just see one line fewer until the write is done
+    size_t content_len = strlen(line_content);
+    char line[content_len + 1];
+    memcpy(line, line_content, content_len);
+    line[content_len] = '\n';
 
-    if (fprintf(file, "%s\n", line_content) < 0) {
+    struct FileStamp before;
+    if (file_stamp(tx.fd, &before) != 0) {
+        return 1;
+    }
+    if (lseek(tx.fd, 0, SEEK_END) < 0 or write_all(tx.fd, line, sizeof(line)) != 0) {
         perror("Error writing to file");
         return 1;
     }
-
-    fclose(file); //have to do it early to save changes
+    // still under the lock, so nothing else can have changed the file in between. The append already happened either way
+    if (trigram_index_extend(filename, tx.fd, before) != 0) {
+        fprintf(stderr, "Couldn't update the index of '%s', it's out of date now.\n", filename);
+    }
 
     // Get the number of lines after appending
-    size_t total_lines = 0;
-    auto read_file = fopen(filename, "r");
-    if (read_file != nullptr) {
-        char buffer[1024];
-        while (fgets(buffer, sizeof(buffer), read_file)) {
-            total_lines++;
-        }
-        fclose(read_file);
+    ssize_t total_lines = count_lines(tx.fd);
+    if (total_lines < 0) {
+        return 1;
     }
 
+    log_change(&tx, "Append Line", (size_t)total_lines, (size_t)total_lines);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
     printf("Appended line to '%s' successfully.\n", filename);
-    log_change("Append Line", filename, total_lines, total_lines);
     return 0;
 }
 
@@ -167,52 +386,53 @@ static int delete_line(size_t param_len, const char *nonnull params[static param
     const char *filename = params[0];
     int line_number = atoi(params[1]);
 
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
 
-    // Read all lines into memory except the one to delete
-    char *nonnull *nullable lines = NULL;
-    size_t lines_allocated = 0, lines_count = 0;
-    char buffer[1024];
-    size_t current_line = 1;
-    int line_found = 0;
-
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (current_line != (size_t)line_number) {
-            // Store the line
-            if (lines_count >= lines_allocated) {
-                lines_allocated = lines_allocated ? lines_allocated * 2 : 10;
-                lines = $realloc(lines, lines_allocated * sizeof(char *));
-            }
-            lines[lines_count] = $strdup(buffer);
-            lines_count++;
-        } else {
-            line_found = 1;
-        }
-        current_line++;
+    auto out = transaction_output(&tx);
+    if (out == nullptr) {
+        return 1;
     }
-    defer {
-        for (size_t i = 0; i < lines_count; i++) {
-            free(lines[i]);
+
+    // Copy every line except the one to delete
+    __block size_t current_line = 1, lines_count = 0;
+    __block bool line_found = false;
+    int result = pipeline_run(tx.fd, fileno(out), ^(const char *data, size_t len, struct PipelineBuffer *output) {
+        // only the run with the line in it has to be split up, the rest go through whole
+        size_t lines = count_newlines(data, len) + (data[len - 1] != '\n');
+        if (line_found or current_line + lines <= (size_t)line_number) {
+            pipeline_emit(output, data, len);
+            current_line += lines;
+            lines_count += lines;
+            return;
         }
-        free(lines);
-    };
+        for_each_line(data, len, ^(const char *line, size_t line_len) {
+            if (current_line == (size_t)line_number) {
+                line_found = true;
+            } else {
+                pipeline_emit(output, line, line_len);
+                lines_count++;
+            }
+            current_line++;
+        });
+    });
+    if (result != 0) {
+        return 1;
+    }
 
     if (!line_found) {
         fprintf(stderr, "Invalid line number.\n");
         return 1;
     }
 
-    // Write back the lines to the file
-    file = $fopen(filename, "w");
-    defer { fclose(file); };
-
-    for (size_t i = 0; i < lines_count; i++) {
-        fputs(lines[i], file);
+    log_change(&tx, "Delete Line", (size_t)line_number, lines_count);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
     }
-
     printf("Deleted line %d from '%s' successfully.\n", line_number, filename);
-    log_change("Delete Line", filename, (size_t)line_number, lines_count);
     return 0;
 }
 
@@ -222,65 +442,109 @@ static int insert_line(size_t param_len, const char *nonnull params[static param
     int line_number = atoi(params[1]);
     const char *line_content_raw = params[2];
     //we need a newline!
-    char line_content[strlen(line_content_raw) + 2]; //I love VLAs :)
-    snprintf(line_content, sizeof(line_content), "%s\n", line_content_raw);
+    size_t line_len = strlen(line_content_raw) + 1;
+    char line_content_buffer[line_len + 1]; //I love VLAs :)
+    snprintf(line_content_buffer, sizeof(line_content_buffer), "%s\n", line_content_raw);
+    const char *line_content = line_content_buffer; //...blocks don't though
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
 
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
+    auto out = transaction_output(&tx);
+    if (out == nullptr) {
+        return 1;
+    }
 
-    // Read all lines into memory
-    char *nonnull *nullable lines = nullptr;
-    size_t lines_allocated = 0, lines_count = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (lines_count >= lines_allocated) {
-            lines_allocated = lines_allocated ? lines_allocated * 2 : 10;
-            lines = $realloc(lines, lines_allocated * sizeof(char *));
+    // Copy the file over, slipping the new line in front of the one currently at `line_number`
+    __block size_t current_line = 1;
+    int result = pipeline_run(tx.fd, fileno(out), ^(const char *data, size_t len, struct PipelineBuffer *output) {
+        // only the run with the line in it has to be split up, the rest go through whole
+        size_t lines = count_newlines(data, len) + (data[len - 1] != '\n');
+        if (current_line > (size_t)line_number or current_line + lines <= (size_t)line_number) {
+            pipeline_emit(output, data, len);
+            current_line += lines;
+            return;
         }
-        lines[lines_count] = $strdup(buffer);
-        lines_count++;
+        for_each_line(data, len, ^(const char *line, size_t len) {
+            if (current_line == (size_t)line_number) {
+                pipeline_emit(output, line_content, line_len);
+            }
+            pipeline_emit(output, line, len);
+            current_line++;
+        });
+    });
+    if (result != 0) {
+        return 1;
     }
 
-    //we cant defer because the C standard mandates that `realloc` can return the same pointer
-    //therefore having a defer here and another defer after the realloc would cause 2 possible states, both are invalid:
-    //1. the pointer remains the same, and the first defer would free the memory, causing the second defer to free invalid memory
-    //2. the pointer changes, and the first defer would free a pointer that is invalidated (if `realloc` succeeds then the pointer passsed into it could be invalidated), causing UB
+    size_t lines_count = current_line - 1;
     if (line_number < 1 or (size_t)line_number > lines_count + 1) {
         fprintf(stderr, "Invalid line number.\n");
-        for (size_t i = 0; i < lines_count; i++) {
-            free(lines[i]);
-        }
-        free(lines);
+        return 1;
+    }
+    if ((size_t)line_number == lines_count + 1 and write_all(fileno(out), line_content, line_len) != 0) {
+        perror("Error writing file");
         return 1;
     }
 
-    lines = $realloc(lines, (lines_count + 1) * sizeof(char *));
-    defer {
-        for (size_t i = 0; i < lines_count + 1; i++) { //we add 1 because we add the new line content in next bit of code
-            free(lines[i]);
-        }
-        free(lines);
-    };
-    for (size_t i = lines_count; i >= (size_t)(line_number); i--) {
-        lines[i] = lines[i - 1];
+    // Get the number of lines after insertion
+    size_t total_lines = lines_count + 1;
+
+    log_change(&tx, "Insert Line", (size_t)line_number, total_lines);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
     }
-    lines[line_number - 1] = $strdup(line_content);
-    lines_count++;
+    printf("Inserted line at %d in '%s' successfully.\n", line_number, filename);
+    return 0;
+}
 
-    // Write back to the file
-    file = $fopen(filename, "w");
-    defer { fclose(file); };
+//Big files skip the serial read: either the ".lines" index already has how many newlines come before each chunk, or
+//every chunk gets counted in parallel, and then only the chunk with the line in it is looked at. 1 if the file is
+//too small for that to be worth it, the caller reads it through instead
+static int show_line_indexed(const char *filename, int fd, int line_number, bool save_index, size_t threads)
+{
+    __block struct LineIndex index;
+    bool loaded = line_index_load(filename, fd, &index) == 0;
+    defer { line_index_free(&index); };
 
-    for (size_t i = 0; i < lines_count; i++) {
-        fputs(lines[i], file);
+    struct FileStamp stamp;
+    if (file_stamp(fd, &stamp) != 0) {
+        return -1;
+    }
+    if (not loaded and not save_index and stamp.size < 2 * LINE_INDEX_CHUNK_SIZE) {
+        return 1;
     }
 
-    printf("Inserted line at %d in '%s' successfully.\n", line_number, filename);
+    __block struct MappedFile file;
+    if (map_fd(fd, &file) != 0) {
+        return -1;
+    }
+    defer { unmap_file(&file); };
 
-    // Get the number of lines after insertion
-    size_t total_lines = lines_count;
+    // changed between the two looks, the counts can't be trusted
+    if (loaded and file.size != index.stamp.size) {
+        line_index_free(&index);
+        loaded = false;
+    }
+    if (not loaded) {
+        if (line_index_build(fd, &file, threads, &index) != 0) {
+            return -1;
+        }
+        if (save_index and line_index_save(filename, &index) != 0) {
+            return -1;
+        }
+    }
 
-    log_change("Insert Line", filename, (size_t)line_number, total_lines);
+    size_t offset, len;
+    if (line_number <= 0 or line_index_find(&index, &file, (size_t)line_number, &offset, &len) != 0) {
+        fprintf(stderr, "Line number %d does not exist in '%s'.\n", line_number, filename);
+        return -1;
+    }
+    printf("Line %d: ", line_number);
+    fwrite(&file.data[offset], 1, len, stdout);
     return 0;
 }
 
@@ -288,18 +552,55 @@ static int show_line(size_t param_len, const char *nonnull params[static param_l
 {
     const char *filename = params[0];
     int line_number = atoi(params[1]);
+    size_t threads = thread_count(param_len, params);
+    if (threads == 0) {
+        return 1;
+    }
+
+    int fd = open_input(filename);
+    if (fd < 0) {
+        return 1;
+    }
+    defer { close_input(fd); };
+
+    if (not is_stdin(filename)) {
+        int result = show_line_indexed(filename, fd, line_number, has_flag(param_len, params, "--index"), threads);
+        if (result <= 0) {
+            return result == 0 ? 0 : 1;
+        }
+    }
 
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
+    __block struct LineReader reader;
+    line_reader_init(&reader, fd);
+    defer { line_reader_free(&reader); };
 
-    char buffer[1024];
+    // whole runs of lines at a time, only the run with the line in it gets looked at line by line
+    const char *data;
+    ssize_t len = 0;
     size_t current_line = 1;
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (current_line == (size_t)line_number) {
-            printf("Line %d: %s", line_number, buffer);
-            return 0;
+    while (line_number > 0 and (len = line_reader_next(&reader, &data)) > 0) {
+        size_t lines = count_newlines(data, (size_t)len);
+        // an unterminated last line only shows up at EOF, and is still a line
+        if (data[len - 1] != '\n')
+            lines++;
+        if (current_line + lines <= (size_t)line_number) {
+            current_line += lines;
+            continue;
+        }
+
+        const char *line = data, *end = data + len;
+        for (; current_line < (size_t)line_number; current_line++) {
+            line = (const char *)memchr(line, '\n', (size_t)(end - line)) + 1;
         }
-        current_line++;
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        size_t line_len = newline ? (size_t)(newline - line) + 1 : (size_t)(end - line);
+        printf("Line %d: ", line_number);
+        fwrite(line, 1, line_len, stdout);
+        return 0;
+    }
+    if (len < 0) {
+        perror("Error reading file");
+        return 1;
     }
 
     fprintf(stderr, "Line number %d does not exist in '%s'.\n", line_number, filename);
@@ -327,7 +628,8 @@ static int show_change_log(size_t param_len, const char *nonnull params[static p
 
         if (strcmp(entry->operation, "Append Line") == 0 ||
             strcmp(entry->operation, "Insert Line") == 0 ||
-            strcmp(entry->operation, "Delete Line") == 0) {
+            strcmp(entry->operation, "Delete Line") == 0 ||
+            strcmp(entry->operation, "Replace Line") == 0) {
             printf("%zu. %s at %s on line %zu. Total lines: %zu.\n",
                    idx + 1, entry->operation, timestamp,
                    entry->line_number, entry->total_lines);
@@ -345,14 +647,39 @@ static int show_change_log(size_t param_len, const char *nonnull params[static p
 static int show_number_of_lines(size_t param_len, const char *nonnull params[static param_len])
 {
     const char *filename = params[0];
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
 
-    size_t line_count = 0;
-    char buffer[1024];
+    __block size_t line_count = 0;
+    __block char last = '\n';
+    auto on_data = ^(const char *data, size_t len) {
+        line_count += count_newlines(data, len);
+        last = data[len - 1];
+    };
+
+    if (has_flag(param_len, params, "--follow") and not is_stdin(filename)) {
+        __block size_t reported = SIZE_MAX;
+        return follow_file(filename, true, (struct FollowHandlers) {
+            .on_data = on_data,
+            .on_idle = ^{
+                if (line_count != reported) {
+                    printf("File '%s' has %zu line(s).\n", filename, line_count);
+                    fflush(stdout);
+                    reported = line_count;
+                }
+            },
+            .on_restart = ^{
+                fprintf(stderr, "'%s' was truncated or replaced, starting over.\n", filename);
+                line_count = 0;
+                reported = SIZE_MAX;
+            },
+        }) == 0 ? 0 : 1;
+    }
+
+    if (scan_file(filename, on_data) != 0) {
+        return 1;
+    }
 
-    //fgets reads until end of the line
-    while (fgets(buffer, sizeof(buffer), file)) {
+    // an unterminated last line is still a line
+    if (last != '\n') {
         line_count++;
     }
 
@@ -360,31 +687,178 @@ static int show_number_of_lines(size_t param_len, const char *nonnull params[sta
     return 0;
 }
 
+//As a stage of `pipe` it counts whatever made it that far, and doesn't pass anything on
+static int count_lines_stream(size_t, const char *nonnull params[], int (^run)(StreamLine_b on_line))
+{
+    __block size_t line_count = 0;
+    int result = run(^(const char *, size_t, Emit_b) { line_count++; });
+    if (result == 0) {
+        printf("%zu line(s) out of '%s'.\n", line_count, params[0]);
+    }
+    return result;
+}
+
 static int help(size_t, const char *nonnull[])
 {
     printf("Available commands:\n");
     for (size_t i = 0; i < command_count; ++i) {
-        printf("  %s\n", commands[i].name);
+        printf("  %s", commands[i].name);
+        for (struct Parameter *param = commands[i].parameters; param->name; param++) {
+            switch (param->type) {
+            case ParameterType_FLAG:
+                printf(" [%s]", param->name);
+                break;
+            case ParameterType_OPTION:
+                printf(" [%s <value>]", param->name);
+                break;
+            default:
+                printf(param->optional ? " [%s]" : " <%s>", param->name);
+                break;
+            }
+        }
+        printf("\n");
     }
     return 0;
 }
 
-static int find(size_t param_len, const char *nonnull params[static param_len])
+//Only searches the blocks the ".trigrams" index says a match could start in. Each run of them is widened out to whole
+//lines (and past its end by enough for a match that starts in it to finish) and handed to `on_lines` along with the
+//number of its first line. 1 if there's no index to go by, so the whole file has to be searched
+static int find_indexed(const char *filename, const char *needle, void (^on_lines)(size_t first_line, const char *data, size_t len))
 {
-    const char *filename = params[0], *search_string = params[1];
+    int fd = open_input(filename);
+    if (fd < 0) {
+        return -1;
+    }
+    defer { close_input(fd); };
+
+    __block struct TrigramIndex index;
+    int status = trigram_index_open(filename, fd, &index);
+    if (status != 0) {
+        if (status > 0)
+            fprintf(stderr, "The index of '%s' is out of date, searching all of it. Run `index` again to fix that.\n", filename);
+        return 1;
+    }
+    defer { trigram_index_close(&index); };
+
+    size_t needle_len = strlen(needle);
+    uint64_t *nullable candidates = trigram_index_candidates(&index, needle, needle_len);
+    if (candidates == nullptr) {
+        return 1;
+    }
+    defer { free(candidates); };
+    uint64_t *candidate_bits = candidates;
+
+    __block struct MappedFile file;
+    if (map_fd(fd, &file) != 0) {
+        return -1;
+    }
+    defer { unmap_file(&file); };
+
+    size_t block_count = trigram_index_block_count(&index), done = 0;
+    for (size_t block = 0; block < block_count; block++) {
+        if (not (candidate_bits[block / 64] >> (block % 64) & 1))
+            continue;
+        size_t last = block;
+        while (last + 1 < block_count and candidate_bits[(last + 1) / 64] >> ((last + 1) % 64) & 1) {
+            last++;
+        }
+
+        size_t start = block * TRIGRAM_BLOCK_SIZE, end = (last + 1) * TRIGRAM_BLOCK_SIZE + needle_len - 1;
+        end = end < file.size ? end : file.size;
+        while (start > done and file.data[start - 1] != '\n') {
+            start--;
+        }
+        start = start > done ? start : done; // a long line can already have been searched with the run before
+        if (end > 0 and file.data[end - 1] != '\n') {
+            const char *newline = memchr(&file.data[end], '\n', file.size - end);
+            end = newline ? (size_t)(newline - file.data) + 1 : file.size;
+        }
 
-    auto file = $fopen(filename, "r");
-    defer { fclose(file); };
+        if (start < end) {
+            size_t start_block = start / TRIGRAM_BLOCK_SIZE, block_start = start_block * TRIGRAM_BLOCK_SIZE;
+            size_t first_line = index.newlines_before[start_block] + count_newlines(&file.data[block_start], start - block_start) + 1;
+            on_lines(first_line, &file.data[start], end - start);
+            done = end;
+        }
+        block = last;
+    }
+    return 0;
+}
 
-    char buffer[1024];
-    size_t line_number = 1, matches = 0;
+static int find(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0], *search_string = params[1];
+    bool utf8 = has_flag(param_len, params, "--utf8");
+
+    __block struct Searcher searcher;
+    searcher_init(&searcher, search_string, has_flag(param_len, params, "-i"));
+    defer { searcher_free(&searcher); };
+
+    __block size_t line_number = 1, matches = 0;
+    __block bool invalid = false;
+    auto on_data = ^(const char *data, size_t len) {
+        const char *end = data + len;
+
+        if (utf8) {
+            for (const char *pos = data, *bad; (bad = utf8_validate(pos, (size_t)(end - pos))) != nullptr;) {
+                fprintf(stderr, "Invalid UTF-8 on line %zu of '%s'.\n", line_number + count_newlines(data, (size_t)(bad - data)), filename);
+                invalid = true;
+                const char *newline = memchr(bad, '\n', (size_t)(end - bad));
+                if (newline == nullptr)
+                    break;
+                pos = newline + 1;
+            }
+        }
 
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (strstr(buffer, search_string) != NULL) {
-            printf("Line %zu: %s", line_number, buffer);
+        // search the whole run at once and only work out which line a match is on afterwards
+        const char *pos = data, *match;
+        while (pos < end and (match = searcher_find(&searcher, pos, (size_t)(end - pos))) != nullptr) {
+            const char *line = match;
+            while (line > pos and line[-1] != '\n') {
+                line--;
+            }
+            line_number += count_newlines(pos, (size_t)(line - pos));
+
+            const char *newline = memchr(match, '\n', (size_t)(end - match));
+            const char *line_end = newline ? newline + 1 : end;
+            if (utf8) {
+                printf("Line %zu, column %zu: ", line_number, utf8_length(line, (size_t)(match - line)) + 1);
+            } else {
+                printf("Line %zu: ", line_number);
+            }
+            fwrite(line, 1, (size_t)(line_end - line), stdout);
             matches++;
+
+            line_number++;
+            pos = line_end;
         }
-        line_number++;
+        line_number += count_newlines(pos, (size_t)(end - pos));
+    };
+
+    if (has_flag(param_len, params, "--follow") and not is_stdin(filename)) {
+        return follow_file(filename, true, (struct FollowHandlers) {
+            .on_data = on_data,
+            .on_idle = ^{ fflush(stdout); },
+            .on_restart = ^{
+                fprintf(stderr, "'%s' was truncated or replaced, starting over.\n", filename);
+                line_number = 1;
+                matches = 0;
+            },
+        }) == 0 ? 0 : 1;
+    }
+
+    // the index only rules out blocks, so it's no use when every byte has to be looked at (--utf8) or a match could be
+    // spelled with different bytes than the needle (Unicode case folding)
+    int indexed = 1;
+    if (not is_stdin(filename) and not utf8 and not searcher.unicode) {
+        indexed = find_indexed(filename, search_string, ^(size_t first_line, const char *data, size_t len) {
+            line_number = first_line;
+            on_data(data, len);
+        });
+    }
+    if (indexed < 0 or (indexed > 0 and scan_file(filename, on_data) != 0)) {
+        return 1;
     }
 
     if (matches == 0) {
@@ -393,64 +867,874 @@ static int find(size_t param_len, const char *nonnull params[static param_len])
         printf("Found %zu matching line(s) for '%s' in '%s'.\n", matches, search_string, filename);
     }
 
-    return 0;
+    return invalid ? 1 : 0;
 }
 
-static int trim(size_t param_len, const char *nonnull params[static param_len])
+//As a stage of `pipe` only the matching lines go on, as they are. `--utf8` still complains about invalid lines, counted
+//as they reach this stage. There's nothing to `--follow` when the file is only read through once
+static int find_stream(size_t param_len, const char *nonnull params[static param_len], int (^run)(StreamLine_b on_line))
 {
-    const char *filename = params[0];
+    if (has_flag(param_len, params, "--follow")) {
+        fprintf(stderr, "find can't --follow as a stage of a pipe.\n");
+        return 1;
+    }
+    bool utf8 = has_flag(param_len, params, "--utf8");
+
+    __block struct Searcher searcher;
+    searcher_init(&searcher, params[1], has_flag(param_len, params, "-i"));
+    defer { searcher_free(&searcher); };
+
+    __block size_t line_number = 0;
+    __block bool invalid = false;
+    int result = run(^(const char *line, size_t len, Emit_b emit) {
+        line_number++;
+        if (utf8 and utf8_validate(line, len) != nullptr) {
+            fprintf(stderr, "Invalid UTF-8 on line %zu of what reached find.\n", line_number);
+            invalid = true;
+        }
+        if (searcher_find(&searcher, line, len) != nullptr)
+            emit(line, len);
+    });
+    return result != 0 or invalid ? 1 : 0;
+}
+
+static void print_json_string(const char *string)
+{
+    putchar('"');
+    for (const char *c = string; *c; c++) {
+        if (*c == '"' or *c == '\\') {
+            printf("\\%c", *c);
+        } else if ((uint8_t)*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
 
-    auto file = $fopen(filename, "r");
+static void print_stats(const char *nullable filename, const struct TextStats *stats, bool json)
+{
+    if (json) {
+        printf("{\"file\": ");
+        if (filename == nullptr) {
+            printf("null");
+        } else {
+            const char *name = $assert_nonnull(filename);
+            print_json_string(name);
+        }
+        printf(", \"lines\": %zu, \"words\": %zu, \"bytes\": %zu, \"chars\": %zu, \"longest_line\": %zu, \"histogram\": [",
+               stats->lines, stats->words, stats->bytes, stats->chars, stats->longest_line);
+        bool first = true;
+        for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            if (stats->histogram[i] == 0)
+                continue;
+            printf("%s{\"min\": %zu, \"max\": ", first ? "" : ", ", text_stats_bucket_min(i));
+            if (i + 1 < STATS_HISTOGRAM_BUCKETS) {
+                printf("%zu", text_stats_bucket_min(i + 1) - 1);
+            } else {
+                printf("null");
+            }
+            printf(", \"count\": %zu}", stats->histogram[i]);
+            first = false;
+        }
+        printf("]}\n");
+        return;
+    }
 
-    // Read all lines into memory
-    char *nonnull *nullable lines = nullptr;
-    size_t lines_allocated = 0, lines_count = 0;
-    char buffer[1024];
-    while (fgets(buffer, sizeof(buffer), file)) {
-        if (lines_count >= lines_allocated) {
-            lines_allocated = lines_allocated ? lines_allocated * 2 : 10;
-            lines = $realloc(lines, lines_allocated * sizeof(char *));
+    if (filename) {
+        printf("Statistics for '%s':\n", filename);
+    } else {
+        printf("Total:\n");
+    }
+    printf("  Lines: %zu\n  Words: %zu\n  Bytes: %zu\n  Characters: %zu\n  Longest line: %zu byte(s)\n",
+           stats->lines, stats->words, stats->bytes, stats->chars, stats->longest_line);
+    printf("  Line lengths:\n");
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        if (stats->histogram[i] == 0)
+            continue;
+        size_t min = text_stats_bucket_min(i);
+        if (i + 1 == STATS_HISTOGRAM_BUCKETS) {
+            printf("    %zu+: %zu\n", min, stats->histogram[i]);
+        } else if (min == text_stats_bucket_min(i + 1) - 1) {
+            printf("    %zu: %zu\n", min, stats->histogram[i]);
+        } else {
+            printf("    %zu-%zu: %zu\n", min, text_stats_bucket_min(i + 1) - 1, stats->histogram[i]);
         }
-        char *tmpbuf = $calloc(sizeof(buffer) + 1, sizeof(char)); //we need teh whole size of the buffer for when we add a newline later
-        strcpy(tmpbuf, buffer);
-        lines[lines_count] = tmpbuf;
-        lines_count++;
     }
-    fclose(file); // just in case its auto-locked, we don't want it to mess up our writes
+}
+
+static int stats(size_t param_len, const char *nonnull params[static param_len])
+{
+    bool json = has_flag(param_len, params, "--json");
+    size_t threads = thread_count(param_len, params),
+           file_count = count_positional(param_len, params, "stats");
+    if (threads == 0) {
+        return 1;
+    }
+
+    struct MappedFile *files = $calloc(file_count, sizeof(struct MappedFile));
+    size_t *first_chunk = $calloc(file_count + 1, sizeof(size_t));
+    __block size_t mapped = 0;
     defer {
-        for (size_t i = 0; i < lines_count; i++) {
-            free(lines[i]);
+        for (size_t i = 0; i < mapped; i++) {
+            unmap_file(&files[i]);
         }
-        free(lines);
+        free(files);
+        free(first_chunk);
     };
 
-    for (size_t i = 0; i < lines_count; i++) {
-        char *line = lines[i];
-        size_t len = strlen(line);
-        //removing all trailing whitespace
-        while (len > 0 and (line[len - 1] == ' ' or line[len - 1] == '\t' or line[len - 1] == '\n' or line[len - 1] == '\r')) {
-            line[len - 1] = '\0';
-            len--;
+    // every file is cut into chunks and all of them go in one queue, so one huge file and thousands of small ones
+    // both keep every thread busy
+    for (; mapped < file_count; mapped++) {
+        if (map_file(params[mapped], &files[mapped]) != 0) {
+            fprintf(stderr, "Failed to read '%s'.\n", params[mapped]);
+            return 1;
         }
-
-        // we need the newline (fuck u DOS line endings :))
-        strcat(line, "\n");
+        size_t chunks = (files[mapped].size + STATS_CHUNK_SIZE - 1) / STATS_CHUNK_SIZE;
+        first_chunk[mapped + 1] = first_chunk[mapped] + (chunks ? chunks : 1);
     }
 
-    file = $fopen(filename, "wb");
-    defer { fclose(file); };
+    struct ChunkStats *chunks = $calloc(first_chunk[file_count], sizeof(struct ChunkStats));
+    defer { free(chunks); };
+
+    parallel_for(first_chunk[file_count], threads, ^(size_t chunk) {
+        // find which file this chunk belongs to
+        size_t low = 0, high = file_count;
+        while (high - low > 1) {
+            size_t mid = (low + high) / 2;
+            if (first_chunk[mid] <= chunk) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+
+        const struct MappedFile *file = &files[low];
+        size_t offset = (chunk - first_chunk[low]) * STATS_CHUNK_SIZE;
+        size_t len = file->size - offset < STATS_CHUNK_SIZE ? file->size - offset : STATS_CHUNK_SIZE;
+        text_stats_chunk(&file->data[offset], len, offset == 0 or is_space((uint8_t)file->data[offset - 1]), &chunks[chunk]);
+    });
 
-    for (size_t i = 0; i < lines_count; i++) {
-        fputs(lines[i], file);
+    struct TextStats total = {0};
+    for (size_t i = 0; i < file_count; i++) {
+        struct TextStats file_stats;
+        text_stats_merge(&file_stats, &chunks[first_chunk[i]], first_chunk[i + 1] - first_chunk[i]);
+        print_stats(params[i], &file_stats, json);
+        text_stats_add(&total, &file_stats);
+    }
+    if (file_count > 1) {
+        print_stats(nullptr, &total, json);
     }
 
-    printf("Trimmed trailing whitespace from '%s' successfully.\n", filename);
     return 0;
 }
 
+//How long `line` is without its trailing whitespace (line ending included)
+static size_t trimmed_length(const char *line, size_t len)
+{
+    while (len > 0 and (line[len - 1] == ' ' or line[len - 1] == '\t' or line[len - 1] == '\n' or line[len - 1] == '\r')) {
+        len--;
+    }
+    return len;
+}
 
-[[gnu::constructor(101)]]
-void init_commands()
+//What `trim` does to a run of whole lines: each loses its trailing whitespace and ends in a plain \n, the last one too
+static void trim_lines(const char *data, size_t len, struct PipelineBuffer *output)
+{
+    for_each_line(data, len, ^(const char *line, size_t len) {
+        // we need the newline (fuck u DOS line endings :))
+        pipeline_emit(output, line, trimmed_length(line, len));
+        pipeline_emit(output, "\n", 1);
+    });
+}
+
+static int trim(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0];
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    auto out = transaction_output(&tx);
+    if (out == nullptr) {
+        return 1;
+    }
+
+    int result = pipeline_run(tx.fd, fileno(out), ^(const char *data, size_t len, struct PipelineBuffer *output) {
+        trim_lines(data, len, output);
+    });
+    if (result != 0 or transaction_commit(&tx) != 0) {
+        return 1;
+    }
+
+    printf("Trimmed trailing whitespace from '%s' successfully.\n", filename);
+    return 0;
+}
+
+static int trim_stream(size_t, const char *nonnull[], int (^run)(StreamLine_b on_line))
+{
+    return run(^(const char *line, size_t len, Emit_b emit) {
+        emit(line, trimmed_length(line, len));
+    });
+}
+
+//"64M", "2G", "4096"... in bytes, 0 if it doesn't make sense (fractions and anything that doesn't fit included)
+static size_t parse_size(const char *text)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (not isdigit((unsigned char)text[0]) or errno == ERANGE or value > SIZE_MAX)
+        return 0;
+    // going over turns it into 0, which stays 0 the rest of the way down
+    switch (toupper((unsigned char)*end)) {
+    case 'G': value = value <= SIZE_MAX / 1024 ? value * 1024 : 0;          [[fallthrough]];
+    case 'M': value = value <= SIZE_MAX / 1024 ? value * 1024 : 0;          [[fallthrough]];
+    case 'K': value = value <= SIZE_MAX / 1024 ? value * 1024 : 0; end++;   break;
+    }
+    return *end == '\0' ? (size_t)value : 0;
+}
+
+static int sort(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0],
+               *key = option_value(param_len, params, "--key"),
+               *memory_text = option_value(param_len, params, "--memory");
+    struct SortOptions options = {
+        .key = key ? parse_count(key) : 0,
+        .numeric = has_flag(param_len, params, "--numeric"),
+        .reverse = has_flag(param_len, params, "--reverse"),
+        .stable = has_flag(param_len, params, "--stable"),
+    };
+    if (key and options.key == 0) {
+        fprintf(stderr, "Invalid key field '%s'.\n", key);
+        return 1;
+    }
+    size_t memory = SORT_DEFAULT_MEMORY;
+    if (memory_text) {
+        const char *text = $assert_nonnull(memory_text);
+        if ((memory = parse_size(text)) == 0) {
+            fprintf(stderr, "Invalid memory budget '%s'.\n", text);
+            return 1;
+        }
+    }
+    size_t threads = thread_count(param_len, params);
+    if (threads == 0) {
+        return 1;
+    }
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    auto out = transaction_output(&tx);
+    if (out == nullptr) {
+        return 1;
+    }
+
+    size_t lines = 0;
+    if (sort_file(tx.fd, out, filename, memory, &options, threads, &lines) != 0) {
+        return 1;
+    }
+    log_change(&tx, "Sort", 0, lines);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+
+    printf("Sorted %zu lines in '%s' successfully.\n", lines, filename);
+    return 0;
+}
+
+
+static int dedupe(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0],
+               *memory_text = option_value(param_len, params, "--memory");
+    size_t memory = DEDUPE_DEFAULT_MEMORY;
+    if (memory_text) {
+        const char *text = $assert_nonnull(memory_text);
+        if ((memory = parse_size(text)) == 0) {
+            fprintf(stderr, "Invalid memory budget '%s'.\n", text);
+            return 1;
+        }
+    }
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    auto out = transaction_output(&tx);
+    if (out == nullptr) {
+        return 1;
+    }
+
+    size_t kept = 0, removed = 0;
+    if (dedupe_file(tx.fd, out, filename, memory, &kept, &removed) != 0) {
+        return 1;
+    }
+    log_change(&tx, "Dedupe", 0, kept);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+
+    printf("Removed %zu duplicate line(s) from '%s'.\n", removed, filename);
+    return 0;
+}
+
+
+static int show_diff(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *a_name = params[0], *b_name = params[1];
+
+    struct MappedFile a, b;
+    if (map_file(a_name, &a) != 0) {
+        fprintf(stderr, "Failed to read '%s'.\n", a_name);
+        return 2;
+    }
+    defer { unmap_file(&a); };
+    if (map_file(b_name, &b) != 0) {
+        fprintf(stderr, "Failed to read '%s'.\n", b_name);
+        return 2;
+    }
+    defer { unmap_file(&b); };
+
+    struct Diff diff;
+    diff_files(&a, &b, &diff);
+    defer { diff_free(&diff); };
+
+    print_unified_diff(stdout, a_name, &a, b_name, &b, &diff, DIFF_CONTEXT);
+    // like `diff`, 1 means the files are different
+    return diff.count > 0 ? 1 : 0;
+}
+
+
+enum {
+    PATCH_GAP = 4096, // Unchanged bytes between two in-place replacements worth rewriting to save a `pwrite`
+};
+
+static int replace(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0], *needle = params[1], *replacement = params[2],
+               *max_text = option_value(param_len, params, "--max");
+    size_t needle_len = strlen(needle), replacement_len = strlen(replacement),
+           max = max_text ? parse_count(max_text) : SIZE_MAX;
+    if (needle_len == 0) {
+        fprintf(stderr, "Can't replace an empty string.\n");
+        return 1;
+    }
+    if (max == 0) {
+        fprintf(stderr, "Invalid replacement count '%s'.\n", max_text);
+        return 1;
+    }
+
+    __block struct Searcher searcher;
+    searcher_init(&searcher, needle, false);
+    defer { searcher_free(&searcher); };
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    struct MappedFile file;
+    if (map_fd(tx.fd, &file) != 0) {
+        return 1;
+    }
+    defer { unmap_file(&file); };
+
+    __block size_t *nullable touched = nullptr;
+    size_t touched_count = 0, touched_capacity = 0, last_touched = 0;
+    defer { free(touched); };
+
+    // same length means nothing has to move, so the matches are overwritten right where they are
+    bool in_place = needle_len == replacement_len;
+    char *patch = $malloc(in_place ? READ_BUFFER_SIZE + replacement_len : 1);
+    __block size_t patch_len = 0;
+    __block const char *patch_start = file.data;
+    defer { free(patch); };
+    // only ever behind where the search is up to, so the mapping never sees its own edits
+    auto flush_patch = ^int(void) {
+        if (patch_len > 0 and pwrite(tx.fd, patch, patch_len, patch_start - file.data) != (ssize_t)patch_len) {
+            perror("Error writing file");
+            return -1;
+        }
+        patch_len = 0;
+        return 0;
+    };
+    FILE *nullable out = nullptr;
+    size_t line_number = 1, replaced = 0;
+    const char *data = file.data, *end = data + file.size, *pos = data, *copied = data, *match;
+    while (replaced < max and (match = searcher_find(&searcher, pos, (size_t)(end - pos))) != nullptr) {
+        line_number += count_newlines(pos, (size_t)(match - pos));
+        if (line_number != last_touched) {
+            if (touched_count >= touched_capacity) {
+                touched_capacity = touched_capacity ? touched_capacity * 2 : 64;
+                touched = $realloc(touched, touched_capacity * sizeof(size_t));
+            }
+            size_t *lines = $assert_nonnull(touched);
+            lines[touched_count++] = last_touched = line_number;
+        }
+
+        if (in_place) {
+            // matches close together are patched into one buffer and written in one go, one `pwrite` per match
+            // is a lot of syscalls when there are millions of them
+            if (patch_len > 0 and (match > copied + PATCH_GAP or patch_len + (size_t)(match - copied) + replacement_len > READ_BUFFER_SIZE)) {
+                if (flush_patch() != 0) {
+                    return 1;
+                }
+            }
+            if (patch_len == 0) {
+                patch_start = match;
+            } else {
+                memcpy(&patch[patch_len], copied, (size_t)(match - copied));
+                patch_len += (size_t)(match - copied);
+            }
+            memcpy(&patch[patch_len], replacement, replacement_len);
+            patch_len += replacement_len;
+            copied = match + needle_len;
+        } else {
+            if (out == nullptr and (out = transaction_output(&tx)) == nullptr) {
+                return 1;
+            }
+            FILE *output = $assert_nonnull(out);
+            fwrite(copied, 1, (size_t)(match - copied), output);
+            fwrite(replacement, 1, replacement_len, output);
+            copied = match + needle_len;
+        }
+
+        line_number += count_newlines(match, needle_len);
+        pos = match + needle_len;
+        replaced++;
+    }
+
+    if (replaced == 0) {
+        printf("No matches found for '%s' in '%s'.\n", needle, filename);
+        return 0;
+    }
+
+    if (in_place) {
+        if (flush_patch() != 0 or fsync(tx.fd) != 0) {
+            perror("Error writing file");
+            return 1;
+        }
+    } else {
+        FILE *output = $assert_nonnull(out);
+        fwrite(copied, 1, (size_t)(end - copied), output);
+    }
+
+    // newlines in the needle or the replacement change how many lines there are
+    size_t total = count_newlines(data, file.size) + (file.size > 0 and data[file.size - 1] != '\n');
+    total += replaced * count_newlines(replacement, replacement_len);
+    total -= replaced * count_newlines(needle, needle_len);
+    size_t *lines = $assert_nonnull(touched);
+    for (size_t i = 0; i < touched_count; i++) {
+        log_change(&tx, "Replace Line", lines[i], total);
+    }
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+
+    printf("Replaced %zu occurrence(s) on %zu line(s) in '%s'.\n", replaced, touched_count, filename);
+    return 0;
+}
+
+//As a stage of `pipe` the lines are changed on their way through instead, the file is left alone
+static int replace_stream(size_t param_len, const char *nonnull params[static param_len], int (^run)(StreamLine_b on_line))
+{
+    const char *needle = params[1], *replacement = params[2],
+               *max_text = option_value(param_len, params, "--max");
+    size_t needle_len = strlen(needle), replacement_len = strlen(replacement),
+           max = max_text ? parse_count(max_text) : SIZE_MAX;
+    if (needle_len == 0) {
+        fprintf(stderr, "Can't replace an empty string.\n");
+        return 1;
+    }
+    if (max == 0) {
+        fprintf(stderr, "Invalid replacement count '%s'.\n", max_text);
+        return 1;
+    }
+
+    __block struct Searcher searcher;
+    searcher_init(&searcher, needle, false);
+    defer { searcher_free(&searcher); };
+
+    __block struct PipelineBuffer replaced_line = {0};
+    defer { free(replaced_line.data); };
+    __block size_t replaced = 0;
+    return run(^(const char *line, size_t len, Emit_b emit) {
+        const char *end = line + len, *pos = line, *match;
+        replaced_line.len = 0;
+        while (replaced < max and (match = searcher_find(&searcher, pos, (size_t)(end - pos))) != nullptr) {
+            pipeline_emit(&replaced_line, pos, (size_t)(match - pos));
+            pipeline_emit(&replaced_line, replacement, replacement_len);
+            pos = match + needle_len;
+            replaced++;
+        }
+
+        if (pos == line) {
+            emit(line, len);
+        } else if (replaced_line.len + (size_t)(end - pos) == 0) {
+            emit("", 0);
+        } else {
+            pipeline_emit(&replaced_line, pos, (size_t)(end - pos));
+            const char *data = $assert_nonnull(replaced_line.data);
+            emit(data, replaced_line.len);
+        }
+    });
+}
+
+static int cut(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0], *delimiter = params[1], *field_spec = params[2];
+    // a typed out "\t" is the only way to get a tab past most shells
+    char separator = strcmp(delimiter, "\\t") == 0 ? '\t' : delimiter[0];
+    if (separator == '\0' or (delimiter[1] != '\0' and separator != '\t') or separator == '\n') {
+        fprintf(stderr, "The delimiter has to be a single character.\n");
+        return 1;
+    }
+
+    size_t threads = thread_count(param_len, params);
+    if (threads == 0) {
+        return 1;
+    }
+
+    __block struct CutFields fields;
+    if (cut_fields_parse(&fields, field_spec) != 0) {
+        fprintf(stderr, "Invalid field list '%s'.\n", field_spec);
+        cut_fields_free(&fields);
+        return 1;
+    }
+    defer { cut_fields_free(&fields); };
+
+    struct MappedFile file;
+    if (map_file(filename, &file) != 0) {
+        fprintf(stderr, "Failed to read '%s'.\n", filename);
+        return 1;
+    }
+    defer { unmap_file(&file); };
+
+    // the fields go straight from the mapping to stdout's fd, anything already printed has to go first
+    fflush(stdout);
+    bool quotes = not has_flag(param_len, params, "--no-quotes");
+    return cut_file(&file, separator, &fields, quotes, threads, STDOUT_FILENO) == 0 ? 0 : 1;
+}
+
+static int build_index(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0];
+    size_t threads = thread_count(param_len, params);
+    if (threads == 0) {
+        return 1;
+    }
+
+    struct TrigramIndexInfo info;
+    if (trigram_index_build(filename, threads, &info) != 0) {
+        fprintf(stderr, "Failed to index '%s'.\n", filename);
+        return 1;
+    }
+
+    printf("Indexed '%s': %zu block(s)", filename, info.blocks);
+    if (info.dense_blocks > 0) {
+        printf(" (%zu too varied to index, always searched)", info.dense_blocks);
+    }
+    printf(", %zu trigram(s), %zu byte(s).\n", info.trigrams, info.size);
+    return 0;
+}
+
+//One command of a `pipe`, with its parameters sorted out like `main` would for its action
+struct PipeStage {
+    struct Command *command;
+    size_t param_len;
+    const char *nonnull *params;
+};
+
+struct PipeRun {
+    const char *filename;
+    struct PipeStage *stages;
+    size_t count;
+    StreamLine_b *on_lines;     // What each stage does with a line, once they're all set up
+};
+
+//Hands a line to a stage, and whatever it emits to the one after. Past the last one it's printed
+static void pipe_feed(struct PipeRun *run, size_t stage, const char *line, size_t len)
+{
+    if (stage == run->count) {
+        fwrite(line, 1, len, stdout);
+        fputc('\n', stdout);
+        return;
+    }
+    run->on_lines[stage](line, len, ^(const char *emitted, size_t emitted_len) {
+        pipe_feed(run, stage + 1, emitted, emitted_len);
+    });
+}
+
+//Sets up the last `left` stages, each inside the one after it, and reads the file once they all are. That way each
+//stage's state lives on the stack while the lines go through, and the summaries come out in the order of the stages
+static int pipe_setup(struct PipeRun *run, size_t left)
+{
+    if (left == 0) {
+        return scan_file(run->filename, ^(const char *data, size_t len) {
+            for_each_line(data, len, ^(const char *line, size_t len) {
+                pipe_feed(run, 0, line, line[len - 1] == '\n' ? len - 1 : len);
+            });
+        }) == 0 ? 0 : 1;
+    }
+
+    struct PipeStage *stage = &run->stages[left - 1];
+    Stream_f *stream = $assert_nonnull(stage->command->stream);
+    return stream(stage->param_len, stage->params, ^int(StreamLine_b on_line) {
+        run->on_lines[left - 1] = on_line;
+        return pipe_setup(run, left - 1);
+    });
+}
+
+//Splits something like `trim | find "foo bar" | line-count` into words, with nullptr for every `|`. The words are
+//terminated (and unquoted) right in `text`. Returns how many there are, SIZE_MAX if a quote isn't closed
+static size_t split_pipe(char *text, const char *nullable words[])
+{
+    size_t count = 0;
+    char *in = text, *out = text;
+    for (;;) {
+        while (isspace((unsigned char)*in)) {
+            in++;
+        }
+        if (*in == '\0')
+            return count;
+        if (*in == '|') {
+            words[count++] = nullptr;
+            in++;
+            continue;
+        }
+
+        // the word is shifted back over its quotes as it's read, so it never overwrites anything that's still to come
+        char *word = out, quote = '\0';
+        while (*in != '\0' and (quote != '\0' or not (isspace((unsigned char)*in) or *in == '|'))) {
+            if (quote != '\0' ? *in == quote : (*in == '"' or *in == '\'')) {
+                quote = quote != '\0' ? '\0' : *in;
+                in++;
+                continue;
+            }
+            *out++ = *in++;
+        }
+        if (quote != '\0')
+            return SIZE_MAX;
+
+        char stop = *in;
+        *out++ = '\0';
+        words[count++] = word;
+        if (stop == '\0')
+            return count;
+        if (stop == '|')
+            words[count++] = nullptr;
+        in++;
+    }
+}
+
+static int run_pipe(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0];
+
+    // the stages can come as one string ("trim | find foo"), already split up by the shell (trim '|' find foo) or any
+    // mix of the two, so every argument is split the same way and a lone `|` just comes out as a separator
+    size_t text_len = 0, stage_texts = count_positional(param_len, params, "pipe");
+    for (size_t i = 1; i < stage_texts; i++) {
+        text_len += strlen(params[i]) + 1;
+    }
+
+    char *text = $malloc(text_len + 1);
+    defer { free(text); };
+    const char *nullable *words = $malloc((text_len + 1) * sizeof(*words));
+    defer { free(words); };
+    size_t word_count = 0;
+    for (size_t i = 1, offset = 0; i < stage_texts; i++) {
+        size_t len = strlen(params[i]);
+        memcpy(&text[offset], params[i], len + 1);
+        size_t count = split_pipe(&text[offset], &words[word_count]);
+        if (count == SIZE_MAX) {
+            fprintf(stderr, "Unterminated quote in '%s'.\n", params[i]);
+            return 1;
+        }
+        word_count += count;
+        offset += len + 1;
+    }
+
+    size_t stage_count = 1;
+    for (size_t i = 0; i < word_count; i++) {
+        stage_count += words[i] == nullptr;
+    }
+    struct PipeStage *stages = $calloc(stage_count, sizeof(struct PipeStage));
+    defer { free(stages); };
+    // every stage gets the filename in front of its own words, like its action would
+    const char *nonnull *args = $malloc((word_count + stage_count + 1) * sizeof(*args));
+    defer { free(args); };
+    const char *nonnull *stage_params = $malloc((word_count + stage_count + 1) * sizeof(*stage_params));
+    defer { free(stage_params); };
+
+    size_t used = 0;
+    for (size_t stage = 0, start = 0; stage < stage_count; stage++) {
+        size_t end = start;
+        while (end < word_count and words[end] != nullptr) {
+            end++;
+        }
+        if (end == start) {
+            fprintf(stderr, "Every stage of a pipe needs a command.\n");
+            return 1;
+        }
+
+        const char *name = $assert_nonnull(words[start]);
+        struct Command *command = find_command(name);
+        if (command == nullptr) {
+            fprintf(stderr, "Command '%s' not found.\n", name);
+            return 1;
+        }
+        if (command->stream == nullptr) {
+            fprintf(stderr, "'%s' can't be a stage of a pipe.\n", name);
+            return 1;
+        }
+
+        size_t stage_len = end - start;
+        args[used] = filename;
+        for (size_t i = 1; i < stage_len; i++) {
+            args[used + i] = $assert_nonnull(words[start + i]);
+        }
+        size_t param_len;
+        if (arrange_params(command, stage_len, &args[used], &param_len, &stage_params[used]) != 0) {
+            return 1;
+        }
+        stages[stage] = (struct PipeStage) { .command = command, .param_len = param_len, .params = &stage_params[used] };
+        used += param_len;
+        start = end + 1;
+    }
+
+    StreamLine_b *on_lines = $calloc(stage_count, sizeof(StreamLine_b));
+    defer { free(on_lines); };
+    struct PipeRun run = { .filename = filename, .stages = stages, .count = stage_count, .on_lines = on_lines };
+    return pipe_setup(&run, stage_count);
+}
+
+static int normalize_file(size_t param_len, const char *nonnull params[static param_len])
+{
+    const char *filename = params[0], *tab_text = option_value(param_len, params, "--expand-tabs");
+    struct NormalizeOptions options = {
+        .crlf_to_lf = has_flag(param_len, params, "--crlf-to-lf"),
+        .lf_to_crlf = has_flag(param_len, params, "--lf-to-crlf"),
+        .strip_bom = has_flag(param_len, params, "--strip-bom"),
+        .final_newline = has_flag(param_len, params, "--final-newline"),
+        .tab_width = tab_text ? parse_count(tab_text) : 0,
+    };
+    if (tab_text and options.tab_width == 0) {
+        fprintf(stderr, "Invalid tab width '%s'.\n", tab_text);
+        return 1;
+    }
+    if (options.crlf_to_lf and options.lf_to_crlf) {
+        fprintf(stderr, "--crlf-to-lf and --lf-to-crlf can't both be used.\n");
+        return 1;
+    }
+    if (not (options.crlf_to_lf or options.lf_to_crlf or options.strip_bom or options.final_newline or options.tab_width > 0)) {
+        fprintf(stderr, "Nothing to do, give at least one of --crlf-to-lf, --lf-to-crlf, --strip-bom, --expand-tabs and --final-newline.\n");
+        return 1;
+    }
+
+    // a file that doesn't need fixing is only read, without a transaction (and so without a changelog) at all
+    struct MappedFile file;
+    if (map_file(filename, &file) != 0) {
+        return 1;
+    }
+    __block size_t fixes = 0;
+    struct NormalizeCounts counts;
+    normalize(&options, file.data, file.size, &counts, ^(size_t, size_t, const char *, size_t) { fixes++; });
+    unmap_file(&file);
+    if (fixes == 0) {
+        printf("'%s' is already normalized.\n", filename);
+        return 0;
+    }
+
+    __block struct Transaction tx;
+    if (transaction_begin(&tx, filename, false) != 0) {
+        return 1;
+    }
+    defer { transaction_end(&tx); };
+
+    // mapped again under the lock, it could have changed in between
+    if (map_fd(tx.fd, &file) != 0) {
+        return 1;
+    }
+    defer { unmap_file(&file); };
+
+    __block FILE *nullable out = nullptr;
+    __block size_t copied = 0;
+    __block bool failed = false;
+    normalize(&options, file.data, file.size, &counts, ^(size_t offset, size_t len, const char *replacement, size_t replacement_len) {
+        if (failed or (out == nullptr and (out = transaction_output(&tx)) == nullptr)) {
+            failed = true;
+            return;
+        }
+        FILE *output = $assert_nonnull(out);
+        if (fwrite(&file.data[copied], 1, offset - copied, output) != offset - copied
+            or fwrite(replacement, 1, replacement_len, output) != replacement_len) {
+            perror("Error writing temporary file");
+            failed = true;
+            return;
+        }
+        copied = offset + len;
+    });
+    if (failed) {
+        return 1;
+    }
+    if (out == nullptr) {
+        printf("'%s' is already normalized.\n", filename);
+        return 0;
+    }
+
+    FILE *output = $assert_nonnull(out);
+    if (fwrite(&file.data[copied], 1, file.size - copied, output) != file.size - copied) {
+        perror("Error writing temporary file");
+        return 1;
+    }
+    // fixes never add or take away lines, a final newline only ends the last one
+    size_t lines = count_newlines(file.data, file.size) + (file.size > 0 and file.data[file.size - 1] != '\n');
+    log_change(&tx, "Normalize", 0, lines);
+    if (transaction_commit(&tx) != 0) {
+        return 1;
+    }
+
+    printf("Normalized '%s':", filename);
+    const char *separator = " ";
+    if (options.strip_bom) {
+        printf("%s%zu BOM(s) stripped", separator, counts.boms);
+        separator = ", ";
+    }
+    if (options.crlf_to_lf) {
+        printf("%s%zu CRLF(s) turned into LF", separator, counts.crlf_to_lf);
+        separator = ", ";
+    }
+    if (options.lf_to_crlf) {
+        printf("%s%zu LF(s) turned into CRLF", separator, counts.lf_to_crlf);
+        separator = ", ";
+    }
+    if (options.tab_width > 0) {
+        printf("%s%zu tab(s) expanded", separator, counts.tabs);
+        separator = ", ";
+    }
+    if (options.final_newline) {
+        printf("%s%zu final newline(s) added", separator, counts.final_newlines);
+    }
+    printf(".\n");
+    return 0;
+}
+
+
+[[gnu::constructor(101)]]
+void init_commands()
 {
     // any commands added to the registry here is able to be picked up by the rest of the program and used.
     // registering it here will automatically make it available in `help` and executable from the commandline
@@ -472,6 +1756,8 @@ void init_commands()
     static struct Parameter copy_file_params[] = {
         { .name = "source", .optional = false, .type = ParameterType_STRING },
         { .name = "destination", .optional = false, .type = ParameterType_STRING },
+        { .name = "--delta", .optional = true, .type = ParameterType_FLAG },     // only write the 64K blocks that are different
+        { .name = "--append", .optional = true, .type = ParameterType_FLAG },    // with --delta, the source only ever grows so just copy the new end
         {0}
     };
     add_command((struct Command){
@@ -492,6 +1778,7 @@ void init_commands()
 
     static struct Parameter show_file_params[] = {
         { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--follow", .optional = true, .type = ParameterType_FLAG }, // keep printing whatever gets appended, like `tail -f`
         {0}
     };
     add_command((struct Command){
@@ -537,6 +1824,8 @@ void init_commands()
     static struct Parameter show_line_params[] = {
         { .name = "filename", .optional = false, .type = ParameterType_STRING },
         { .name = "line_number", .optional = false, .type = ParameterType_STRING },
+        { .name = "--index", .optional = true, .type = ParameterType_FLAG }, // keep the newline counts in a ".lines" file next to it for next time
+        { .name = "--threads", .optional = true, .type = ParameterType_OPTION },
         {0}
     };
     add_command((struct Command){
@@ -557,11 +1846,13 @@ void init_commands()
 
     static struct Parameter show_number_of_lines_params[] = {
         { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--follow", .optional = true, .type = ParameterType_FLAG },
         {0}
     };
     add_command((struct Command){
         .name = "line-count",
         .action = &show_number_of_lines,
+        .stream = &count_lines_stream,
         .parameters = show_number_of_lines_params
     });
 
@@ -575,6 +1866,7 @@ void init_commands()
     add_command((struct Command){
         .name = "trim",
         .action = &trim,
+        .stream = &trim_stream,
         .parameters = trim_params
     });
 
@@ -584,14 +1876,152 @@ void init_commands()
     static struct Parameter find_params[] = {
         { .name = "filename", .optional = false, .type = ParameterType_STRING },
         { .name = "search_string", .optional = false, .type = ParameterType_STRING },
+        { .name = "--follow", .optional = true, .type = ParameterType_FLAG },
+        { .name = "-i", .optional = true, .type = ParameterType_FLAG },     // ignore case, ASCII only unless the search string has non-ASCII characters in it
+        { .name = "--utf8", .optional = true, .type = ParameterType_FLAG }, // complain about invalid UTF-8 and report character columns
         {0}
     };
     add_command((struct Command){
         .name = "find",
         .action = &find,
+        .stream = &find_stream,
         .parameters = find_params
     });
 
+    //Additional feature #3: Statistics!
+    //Lines, words, bytes, characters and how long the lines are, for any number of files at once
+    static struct Parameter stats_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "filenames...", .optional = true, .type = ParameterType_STRING },
+        { .name = "--json", .optional = true, .type = ParameterType_FLAG },         // one JSON object per file, per line
+        { .name = "--threads", .optional = true, .type = ParameterType_OPTION },    // defaults to one per CPU
+        {0}
+    };
+    add_command((struct Command){
+        .name = "stats",
+        .action = &stats,
+        .parameters = stats_params
+    });
+
+    //Additional feature #4: Sorting!
+    //Sorts the lines of a file, even ones too big to fit in memory (those get sorted in pieces and merged)
+    static struct Parameter sort_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--key", .optional = true, .type = ParameterType_OPTION },     // sort by this blank separated field (1 is the first) instead of the whole line
+        { .name = "--numeric", .optional = true, .type = ParameterType_FLAG },
+        { .name = "--reverse", .optional = true, .type = ParameterType_FLAG },
+        { .name = "--stable", .optional = true, .type = ParameterType_FLAG },    // lines with equal keys stay in the order they were in
+        { .name = "--memory", .optional = true, .type = ParameterType_OPTION },  // like 64M or 2G, anything bigger is sorted on disk
+        { .name = "--threads", .optional = true, .type = ParameterType_OPTION },
+        {0}
+    };
+    add_command((struct Command){
+        .name = "sort",
+        .action = &sort,
+        .parameters = sort_params
+    });
+
+    //Additional feature #5: Deduplication!
+    //Removes every line that already showed up earlier in the file, the rest stay in the same order
+    static struct Parameter dedupe_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--memory", .optional = true, .type = ParameterType_OPTION },  // like 64M or 2G, past that lines are sorted out on disk
+        {0}
+    };
+    add_command((struct Command){
+        .name = "dedupe",
+        .action = &dedupe,
+        .parameters = dedupe_params
+    });
+
+    //Additional feature #6: Diff!
+    //Shows which lines are different between two files, as a unified diff
+    static struct Parameter diff_params[] = {
+        { .name = "a", .optional = false, .type = ParameterType_STRING },
+        { .name = "b", .optional = false, .type = ParameterType_STRING },
+        {0}
+    };
+    add_command((struct Command){
+        .name = "diff",
+        .action = &show_diff,
+        .parameters = diff_params
+    });
+
+    //Additional feature #7: Find and replace!
+    //Replaces every occurrence of a string (or the first few with --max), the changelog gets every line that changed
+    static struct Parameter replace_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "search_string", .optional = false, .type = ParameterType_STRING },
+        { .name = "replacement", .optional = false, .type = ParameterType_STRING },
+        { .name = "--max", .optional = true, .type = ParameterType_OPTION },     // stop after this many replacements
+        {0}
+    };
+    add_command((struct Command){
+        .name = "replace",
+        .action = &replace,
+        .stream = &replace_stream,
+        .parameters = replace_params
+    });
+
+    //Additional feature #8: Cut!
+    //Prints some of the fields of every line of a CSV/TSV file
+    static struct Parameter cut_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "delimiter", .optional = false, .type = ParameterType_STRING },   // a single character, or \t for tabs
+        { .name = "fields", .optional = false, .type = ParameterType_STRING },      // like 1,3-5,7-
+        { .name = "--no-quotes", .optional = true, .type = ParameterType_FLAG },    // don't treat anything between double quotes as one field
+        { .name = "--threads", .optional = true, .type = ParameterType_OPTION },
+        {0}
+    };
+    add_command((struct Command){
+        .name = "cut",
+        .action = &cut,
+        .parameters = cut_params
+    });
+
+    //Additional feature #9: Indexing!
+    //Keeps a trigram index next to a file, so `find` only has to search the parts of it that can have a match
+    static struct Parameter index_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--threads", .optional = true, .type = ParameterType_OPTION },
+        {0}
+    };
+    add_command((struct Command){
+        .name = "index",
+        .action = &build_index,
+        .parameters = index_params
+    });
+
+    //Additional feature #10: Pipes!
+    //Runs the lines of a file through `trim`, `find`, `replace` and `line-count` one after another, reading it once
+    static struct Parameter pipe_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "stages", .optional = false, .type = ParameterType_STRING },  // like "trim | find foo | line-count", quoted so the shell leaves the |s alone
+        {0}
+    };
+    add_command((struct Command){
+        .name = "pipe",
+        .action = &run_pipe,
+        .parameters = pipe_params
+    });
+
+    //Additional feature #11: Normalizing!
+    //Fixes up line endings, BOMs and tabs in one pass, and leaves the file alone if there's nothing to fix
+    static struct Parameter normalize_params[] = {
+        { .name = "filename", .optional = false, .type = ParameterType_STRING },
+        { .name = "--crlf-to-lf", .optional = true, .type = ParameterType_FLAG },
+        { .name = "--lf-to-crlf", .optional = true, .type = ParameterType_FLAG },
+        { .name = "--strip-bom", .optional = true, .type = ParameterType_FLAG },
+        { .name = "--expand-tabs", .optional = true, .type = ParameterType_OPTION },    // tab width, in characters
+        { .name = "--final-newline", .optional = true, .type = ParameterType_FLAG },    // add a line ending at the end if the last line doesn't have one
+        {0}
+    };
+    add_command((struct Command){
+        .name = "normalize",
+        .action = &normalize_file,
+        .parameters = normalize_params
+    });
+
     static struct Parameter help_params[] = {
         {0}
     };
@@ -624,4 +2054,81 @@ struct Command *find_command(const char *name)
     return nullptr;
 }
 
+struct Parameter *find_option(struct Command *cmd, const char *name)
+{
+    for (struct Parameter *param = cmd->parameters; param->name; param++) {
+        if ((param->type == ParameterType_FLAG or param->type == ParameterType_OPTION) and strcmp(param->name, name) == 0) {
+            return param;
+        }
+    }
+    return nullptr;
+}
+
+int arrange_params(struct Command *cmd, size_t arg_len, const char *nonnull args[nonnull], size_t *param_len, const char *nonnull params[nonnull])
+{
+    // shuffle the flags and options to the back, behind options_start
+    size_t positional = 0, trailing = 0;
+    const char *options[arg_len + 1];
+    options[trailing++] = options_start;
+    for (size_t i = 0; i < arg_len; i++) {
+        const char *arg = args[i];
+        if (strcmp(arg, "--") == 0) {
+            // everything after it is positional, even if it looks like a flag
+            while (++i < arg_len) {
+                params[positional++] = args[i];
+            }
+            break;
+        }
+
+        struct Parameter *option = find_option(cmd, arg);
+        if (option == nullptr) {
+            params[positional++] = arg;
+            continue;
+        }
+
+        options[trailing++] = arg;
+        if (option->type == ParameterType_OPTION) {
+            if (i + 1 >= arg_len) {
+                fprintf(stderr, "Option '%s' of command '%s' needs a value.\n", arg, cmd->name);
+                return -1;
+            }
+            options[trailing++] = args[++i];
+        }
+    }
+    memcpy(&params[positional], options, trailing * sizeof(*options));
+    *param_len = positional + trailing;
+
+    size_t expected_params = 0;
+    for (struct Parameter *param = cmd->parameters; param->name; param++) {
+        if (not param->optional)
+            expected_params++;
+    }
+
+    if (positional < expected_params) {
+        fprintf(stderr, "Insufficient parameters for command '%s'.\n", cmd->name);
+        return -1;
+    }
+    return 0;
+}
+
+bool has_flag(size_t param_len, const char *nonnull params[static param_len], const char *flag)
+{
+    for (size_t i = options_index(param_len, params); i < param_len; i++) {
+        if (strcmp(params[i], flag) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *option_value(size_t param_len, const char *nonnull params[static param_len], const char *option)
+{
+    for (size_t i = options_index(param_len, params); i + 1 < param_len; i++) {
+        if (strcmp(params[i], option) == 0) {
+            return params[i + 1];
+        }
+    }
+    return nullptr;
+}
+
 #pragma clang assume_nonnull end
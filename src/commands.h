@@ -15,15 +15,27 @@
 
 typedef int Action_f(size_t param_len, const char *nonnull params[nonnull]);
 
+//Hands a line (without its newline) on to the next stage of a `pipe`
+typedef void (^Emit_b)(const char *line, size_t len);
+//What a stage of a `pipe` does with every line that reaches it. Whatever it passes to `emit` goes on to the next stage
+typedef void (^StreamLine_b)(const char *line, size_t len, Emit_b emit);
+//Runs a command as a stage of `pipe`. It gets the same parameters its action would, sets itself up and calls `run` with
+//what to do with each line. Once `run` returns every line has been through, so that's the time to print a summary.
+//Returns the exit status, like an action
+typedef int Stream_f(size_t param_len, const char *nonnull params[nonnull], int (^run)(StreamLine_b on_line));
+
 struct Command {
     const char *name;
     Action_f *action;
+    Stream_f *nullable stream;      // For the commands that can work a line at a time, as part of a `pipe`
     struct Parameter {
         const char *name;
         bool optional;
         enum ParameterType {
             ParameterType_STRING,
-            ParameterType_INTEGER
+            ParameterType_INTEGER,
+            ParameterType_FLAG,     // `--name` switches, can go anywhere on the commandline
+            ParameterType_OPTION    // `--name value`, same deal
         } type;
     } *parameters;
 };
@@ -47,5 +59,17 @@ enum {
 
 void add_command(struct Command cmd);
 struct Command *nullable find_command(const char *name);
+//Only finds flags and options, positional parameters are matched by position
+struct Parameter *nullable find_option(struct Command *cmd, const char *name);
+
+//Copies `args` to `params` (room for `arg_len + 1`) with the positional parameters first and the flags and options
+//(which can go anywhere) after them, which is how actions want them. Anything after a "--" is positional even if it
+//looks like a flag. `param_len` is how many went into `params`. Says what's wrong and returns -1 if an option has no
+//value or there aren't enough positional parameters
+int arrange_params(struct Command *cmd, size_t arg_len, const char *nonnull args[nonnull], size_t *param_len, const char *nonnull params[nonnull]);
+
+//Flags and options are moved behind the positional parameters before an action runs, these look them up there only
+bool has_flag(size_t param_len, const char *nonnull params[static param_len], const char *flag);
+const char *nullable option_value(size_t param_len, const char *nonnull params[static param_len], const char *option);
 
 #pragma clang assume_nonnull end
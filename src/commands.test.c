@@ -1,8 +1,13 @@
 #include "commands.c"
 
 #include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #pragma clang assume_nonnull begin
@@ -27,6 +32,60 @@ static char *nullable read_line(const char *filename, int line_number) {
     return nullptr;
 }
 
+static bool line_is(const char *filename, int line_number, const char *expected)
+{
+    char *line = read_line(filename, line_number);
+    return line != nullptr and strcmp(line, expected) == 0;
+}
+
+//Runs `action` with stdout going to a file, and returns whatever it printed (in a static buffer, like `read_line`)
+static const char *capture_stdout(int (^action)(void), int *result)
+{
+    static char output[1 << 18];
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    auto capture = $fopen("test_capture.txt", "w+");
+    dup2(fileno(capture), STDOUT_FILENO);
+
+    *result = action();
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    rewind(capture);
+    size_t len = fread(output, 1, sizeof(output) - 1, capture);
+    output[len] = '\0';
+    fclose(capture);
+    remove("test_capture.txt");
+    return output;
+}
+
+//Runs `action` with `input` coming in on stdin through a pipe, written by a child like it would be in a shell pipeline
+static int with_stdin(const char *input, int (^action)(void))
+{
+    int pipe_fds[2];
+    assert(pipe(pipe_fds) == 0);
+    fflush(stdout);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(pipe_fds[0]);
+        _exit(write_all(pipe_fds[1], input, strlen(input)) == 0 ? 0 : 1);
+    }
+    close(pipe_fds[1]);
+
+    int saved = dup(STDIN_FILENO);
+    dup2(pipe_fds[0], STDIN_FILENO);
+    close(pipe_fds[0]);
+
+    int result = action();
+
+    dup2(saved, STDIN_FILENO);
+    close(saved);
+    waitpid(child, nullptr, 0);
+    return result;
+}
+
 static void test_create_file()
 {
     const char *params[] = { "test_create.txt" };
@@ -59,6 +118,91 @@ static void test_copy_file()
     printf("test_copy_file passed.\n");
 }
 
+static void test_copy_file_delta()
+{
+    // a few blocks and a bit, so the last one is cut short
+    char *data = $malloc(4 * DELTA_BLOCK_SIZE + 100);
+    defer { free(data); };
+    for (size_t i = 0; i < 4 * DELTA_BLOCK_SIZE + 100; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+    auto src = $fopen("test_delta_source.txt", "w");
+    fwrite(data, 1, 3 * DELTA_BLOCK_SIZE, src);
+    fclose(src);
+    defer {
+        remove("test_delta_source.txt");
+        remove("test_delta_copy.txt");
+        remove("test_delta_copy.txt.blocks");
+        char changelog_filename[PATH_MAX];
+        get_changelog_filename("test_delta_copy.txt", changelog_filename, sizeof(changelog_filename));
+        remove(changelog_filename);
+    };
+
+    auto same_as_source = ^bool(void) {
+        struct MappedFile a, b;
+        assert(map_file("test_delta_source.txt", &a) == 0 and map_file("test_delta_copy.txt", &b) == 0);
+        bool same = a.size == b.size and memcmp(a.data, b.data, a.size) == 0;
+        unmap_file(&a);
+        unmap_file(&b);
+        return same;
+    };
+
+    int result;
+    const char *params[] = { "test_delta_source.txt", "test_delta_copy.txt", "--delta" };
+    const char *output = capture_stdout(^int(void) { return copy_file(3, params); }, &result);
+    assert(result == 0 and same_as_source());
+    assert(strstr(output, "3 of 3 block(s) written") != nullptr);
+    assert(file_exists("test_delta_copy.txt.blocks"));
+
+    // nothing changed, the hashes say so without reading the copy
+    output = capture_stdout(^int(void) { return copy_file(3, params); }, &result);
+    assert(result == 0 and strstr(output, "already the same") != nullptr);
+
+    // one byte in the middle block, only that block is written
+    data[DELTA_BLOCK_SIZE + 10] = '#';
+    src = $fopen("test_delta_source.txt", "w");
+    fwrite(data, 1, 3 * DELTA_BLOCK_SIZE, src);
+    fclose(src);
+    output = capture_stdout(^int(void) { return copy_file(3, params); }, &result);
+    assert(result == 0 and same_as_source());
+    assert(strstr(output, "1 of 3 block(s) written") != nullptr);
+
+    // without the hashes the blocks are compared directly
+    remove("test_delta_copy.txt.blocks");
+    data[2 * DELTA_BLOCK_SIZE] = '#';
+    src = $fopen("test_delta_source.txt", "w");
+    fwrite(data, 1, 3 * DELTA_BLOCK_SIZE - 7, src);
+    fclose(src);
+    output = capture_stdout(^int(void) { return copy_file(3, params); }, &result);
+    assert(result == 0 and same_as_source());
+    assert(strstr(output, "1 of 3 block(s) written") != nullptr);
+
+    // appending only copies the new end, and leaves hashes behind even if there weren't any before
+    remove("test_delta_copy.txt.blocks");
+    src = $fopen("test_delta_source.txt", "w");
+    fwrite(data, 1, 4 * DELTA_BLOCK_SIZE + 100, src);
+    fclose(src);
+    const char *append_params[] = { "test_delta_source.txt", "test_delta_copy.txt", "--delta", "--append" };
+    output = capture_stdout(^int(void) { return copy_file(4, append_params); }, &result);
+    assert(result == 0 and same_as_source());
+    assert(strstr(output, "Appended 65643 byte(s)") != nullptr);
+    assert(file_exists("test_delta_copy.txt.blocks"));
+    output = capture_stdout(^int(void) { return copy_file(3, params); }, &result);
+    assert(result == 0 and strstr(output, "already the same") != nullptr);
+
+    // a source that isn't the copy with more on the end falls back to comparing blocks
+    data[4 * DELTA_BLOCK_SIZE + 50] = '#';
+    data[0] = '#';
+    src = $fopen("test_delta_source.txt", "w");
+    fwrite(data, 1, 4 * DELTA_BLOCK_SIZE + 100, src);
+    fclose(src);
+    output = capture_stdout(^int(void) { return copy_file(4, append_params); }, &result);
+    assert(result == 0 and same_as_source());
+    assert(strstr(output, "2 of 5 block(s) written") != nullptr);
+
+    printf("test_copy_file_delta passed.\n");
+}
+
 static void test_delete_file()
 {
     auto file = $fopen("test_delete.txt", "w");
@@ -156,6 +300,117 @@ static void test_show_line()
     printf("test_show_line passed.\n");
 }
 
+static void test_show_line_index()
+{
+    // a bit over two chunks, with lines straddling the chunk edges and an unterminated last line
+    const char *filename = "test_line_index.txt";
+    auto file = $fopen(filename, "w");
+    size_t lines = 0, straddling = 0;
+    for (size_t size = 0; size < 2 * LINE_INDEX_CHUNK_SIZE + 1000; lines++) {
+        if (straddling == 0 and size > LINE_INDEX_CHUNK_SIZE)
+            straddling = lines; // started before the edge and ends after it
+        size += (size_t)fprintf(file, "line %zu %.*s\n", lines + 1, (int)(lines % 97), "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    }
+    fprintf(file, "last");
+    fclose(file);
+    lines++;
+    char index_filename[PATH_MAX];
+    get_line_index_filename(filename, index_filename, sizeof(index_filename));
+    defer {
+        remove(filename);
+        remove(index_filename);
+    };
+
+    // either side of the first chunk edge, plus both ends. Each twice, building the index and then using it
+    __block char line_number[32], expected[256];
+    int checks[] = { 1, 2, (int)straddling - 1, (int)straddling, (int)straddling + 1, (int)lines - 1, (int)lines };
+    for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+        for (int pass = 0; pass < 2; pass++) {
+            snprintf(line_number, sizeof(line_number), "%d", checks[i]);
+            int result;
+            const char *output = capture_stdout(^int(void) {
+                const char *params[] = { filename, line_number, "--index" };
+                return show_line(3, params);
+            }, &result);
+            assert(result == 0);
+            const char *content = read_line(filename, checks[i]);
+            assert(content != nullptr);
+            snprintf(expected, sizeof(expected), "Line %d: %s", checks[i], content);
+            assert(strcmp(output, expected) == 0);
+        }
+    }
+    assert(file_exists(index_filename));
+
+    int result;
+    capture_stdout(^int(void) {
+        snprintf(line_number, sizeof(line_number), "%zu", lines + 1);
+        const char *params[] = { filename, line_number };
+        return show_line(2, params);
+    }, &result);
+    assert(result == 1);
+
+    // the index is for the old contents now, it has to be noticed and not used
+    const char *params_append[] = { filename, "appended" };
+    capture_stdout(^int(void) { return append_line(2, params_append); }, &result);
+    const char *output = capture_stdout(^int(void) {
+        snprintf(line_number, sizeof(line_number), "%zu", lines);
+        const char *params[] = { filename, line_number };
+        return show_line(2, params);
+    }, &result);
+    assert(result == 0);
+    snprintf(expected, sizeof(expected), "Line %zu: lastappended\n", lines);
+    assert(strcmp(output, expected) == 0);
+
+    char changelog_filename[PATH_MAX];
+    get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
+    remove(changelog_filename);
+
+    printf("test_show_line_index passed.\n");
+}
+
+static void test_pipeline()
+{
+    // lines longer than a buffer, lots of short ones, and no newline at the end
+    auto file = $fopen("test_pipeline.txt", "w");
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < PIPELINE_BUFFER_SIZE + 1000; j++) {
+            fputc('a' + (int)i, file);
+        }
+        fputc('\n', file);
+        for (size_t j = 0; j < 100000; j++) {
+            fprintf(file, "short %zu\n", j);
+        }
+    }
+    fprintf(file, "unterminated");
+    fclose(file);
+    defer {
+        remove("test_pipeline.txt");
+        remove("test_pipeline.out");
+    };
+
+    int in = open("test_pipeline.txt", O_RDONLY), out = open("test_pipeline.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(in >= 0 and out >= 0);
+    __block size_t runs = 0;
+    int result = pipeline_run(in, out, ^(const char *data, size_t len, struct PipelineBuffer *output) {
+        // only whole lines, apart from right at the end
+        assert(data[len - 1] == '\n' or memcmp(&data[len - strlen("unterminated")], "unterminated", strlen("unterminated")) == 0);
+        pipeline_emit(output, data, len);
+        runs++;
+    });
+    close(in);
+    close(out);
+    assert(result == 0);
+    assert(runs > 3);
+
+    struct MappedFile original, copy;
+    assert(map_file("test_pipeline.txt", &original) == 0 and map_file("test_pipeline.out", &copy) == 0);
+    assert(original.size == copy.size and memcmp(original.data, copy.data, original.size) == 0);
+    unmap_file(&original);
+    unmap_file(&copy);
+
+    printf("test_pipeline passed.\n");
+}
+
 static void test_show_change_log()
 {
     const char *params1[] = { "test_changelog.txt" };
@@ -248,18 +503,1023 @@ static void test_show_number_of_lines()
     printf("test_show_number_of_lines passed.\n");
 }
 
+static void test_line_reader_long_lines()
+{
+    // way past the old 1024 byte `fgets` buffers, and past the reader's own buffer too
+    size_t long_len = READ_BUFFER_SIZE + 100;
+    auto file = $fopen("test_long_lines.txt", "w");
+    for (size_t i = 0; i < long_len; i++) {
+        fputc('x', file);
+    }
+    fprintf(file, "\nshort\nno newline");
+    fclose(file);
+    defer { remove("test_long_lines.txt"); };
+
+    __block size_t lines = 0, bytes = 0;
+    int result = scan_file("test_long_lines.txt", ^(const char *data, size_t len) {
+        lines += count_newlines(data, len);
+        bytes += len;
+        // every run handed out ends on a line boundary, apart from the unterminated last line
+        assert(data[len - 1] == '\n' or memcmp(&data[len - 10], "no newline", 10) == 0);
+    });
+    assert(result == 0);
+    assert(lines == 2);
+    assert(bytes == long_len + strlen("\nshort\nno newline"));
+
+    printf("test_line_reader_long_lines passed.\n");
+}
+
+//Waits (up to a few seconds) for `expected` to show up as a line of `filename` past line `after`, returns its number or
+//0 if it never does. For watching what a child process prints, without guessing how long it takes
+static int wait_for_line(const char *filename, const char *expected, int after)
+{
+    for (int waited = 0; waited < 5000; waited += 10) {
+        const char *line;
+        for (int i = after + 1; (line = read_line(filename, i)) != nullptr; i++) {
+            if (strcmp(line, expected) == 0)
+                return i;
+        }
+        usleep(10 * 1000);
+    }
+    return 0;
+}
+
+static void test_follow_line_count()
+{
+    auto file = $fopen("test_follow.txt", "w");
+    fprintf(file, "Line 1\n");
+    fclose(file);
+    defer {
+        remove("test_follow.txt");
+        remove("test_follow_output.txt");
+    };
+
+    fflush(stdout); // otherwise the child flushes our buffered output a second time
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        freopen("test_follow_output.txt", "w", stdout);
+        const char *params[] = { "test_follow.txt", "--follow" };
+        _exit(show_number_of_lines(2, params));
+    }
+    defer {
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+    };
+
+    // each step waits for the count it should lead to, so the next change can't land before the last one was seen
+    int seen = wait_for_line("test_follow_output.txt", "File 'test_follow.txt' has 1 line(s).\n", 0);
+    assert(seen > 0);
+    file = $fopen("test_follow.txt", "a");
+    fprintf(file, "Line 2\nLine 3\n");
+    fclose(file);
+    seen = wait_for_line("test_follow_output.txt", "File 'test_follow.txt' has 3 line(s).\n", seen);
+    assert(seen > 0);
+
+    // truncating starts the count over
+    file = $fopen("test_follow.txt", "w");
+    fprintf(file, "Only line\n");
+    fclose(file);
+    seen = wait_for_line("test_follow_output.txt", "File 'test_follow.txt' has 1 line(s).\n", seen);
+    assert(seen > 0);
+
+    printf("test_follow_line_count passed.\n");
+}
+
+static void test_concurrent_writers()
+{
+    const char *filename = "test_concurrent.txt";
+    const char *params_create[] = { filename };
+    create_file(1, params_create);
+    defer {
+        remove(filename);
+        char changelog_filename[PATH_MAX];
+        get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
+        remove(changelog_filename);
+    };
+
+    enum { WRITERS = 4, EDITS = 25 };
+    fflush(stdout);
+    pid_t children[WRITERS];
+    for (size_t i = 0; i < WRITERS; i++) {
+        children[i] = fork();
+        assert(children[i] >= 0);
+        if (children[i] == 0) {
+            freopen("/dev/null", "w", stdout);
+            for (size_t edit = 0; edit < EDITS; edit++) {
+                // every edit would lose lines to the others if they weren't serialised
+                const char *params_append[] = { filename, "appended" };
+                const char *params_insert[] = { filename, "1", "inserted" };
+                if (edit % 2 ? insert_line(3, params_insert) : append_line(2, params_append)) {
+                    _exit(1);
+                }
+            }
+            _exit(0);
+        }
+    }
+    for (size_t i = 0; i < WRITERS; i++) {
+        int status;
+        waitpid(children[i], &status, 0);
+        assert(WIFEXITED(status) and WEXITSTATUS(status) == 0);
+    }
+
+    size_t lines = 0;
+    while (read_line(filename, (int)lines + 1)) {
+        lines++;
+    }
+    assert(lines == WRITERS * EDITS);
+
+    struct Changelog *changelog;
+    assert(parse_changelog(filename, &changelog) == 0);
+    defer { free(changelog); };
+    assert(changelog->length == WRITERS * EDITS + 1);
+    assert(changelog->entries[changelog->length - 1].total_lines == WRITERS * EDITS);
+
+    printf("test_concurrent_writers passed.\n");
+}
+
+static void test_stdin()
+{
+    // bigger than a pipe holds, so the writer has to block and everything comes in over several reads
+    size_t long_len = 200000;
+    char *input = $malloc(long_len + 64);
+    defer { free(input); };
+    size_t head = strlen("first\nneedle here\n");
+    memcpy(input, "first\nneedle here\n", head);
+    memset(&input[head], 'x', long_len);
+    strcpy(&input[head + long_len], "\nlast needle");
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        return with_stdin(input, ^int(void) {
+            const char *params[] = { "-" };
+            return show_number_of_lines(1, params);
+        });
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "File '-' has 4 line(s).\n") == 0);
+
+    output = capture_stdout(^int(void) {
+        return with_stdin(input, ^int(void) {
+            const char *params[] = { "-", "needle" };
+            return find(2, params);
+        });
+    }, &result);
+    assert(result == 0);
+    assert(strncmp(output, "Line 2: needle here\nLine 4: last needleFound 2", strlen("Line 2: needle here\nLine 4: last needleFound 2")) == 0);
+
+    output = capture_stdout(^int(void) {
+        return with_stdin(input, ^int(void) {
+            const char *params[] = { "-", "4" };
+            return show_line(2, params);
+        });
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "Line 4: last needle") == 0);
+
+    // the long line comes out whole, not in 1024 byte pieces
+    output = capture_stdout(^int(void) {
+        return with_stdin(input, ^int(void) {
+            const char *params[] = { "-", "3" };
+            return show_line(2, params);
+        });
+    }, &result);
+    assert(result == 0);
+    assert(strlen(output) == strlen("Line 3: \n") + long_len);
+
+    output = capture_stdout(^int(void) {
+        return with_stdin(input, ^int(void) {
+            const char *params[] = { "-", "5" };
+            return show_line(2, params);
+        });
+    }, &result);
+    assert(result == 1);
+
+    // pipe to file, and file to file
+    output = capture_stdout(^int(void) {
+        return with_stdin("piped\n", ^int(void) {
+            const char *params[] = { "-" };
+            return show_file(1, params);
+        });
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "piped\n") == 0);
+
+    auto file = $fopen("test_stdin.txt", "w");
+    fprintf(file, "Line 1\nLine 2\n");
+    fclose(file);
+    defer { remove("test_stdin.txt"); };
+    output = capture_stdout(^int(void) {
+        printf("before ");
+        const char *params[] = { "test_stdin.txt" };
+        return show_file(1, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "before Line 1\nLine 2\n") == 0);
+
+    printf("test_stdin passed.\n");
+}
+
+static void test_index()
+{
+    // a few blocks of filler, with one match right across the first block edge and one on the last line
+    const char *filename = "test_index.txt";
+    auto file = $fopen(filename, "w");
+    size_t size = 0;
+    while (size < TRIGRAM_BLOCK_SIZE - 40) {
+        size += (size_t)fprintf(file, "filler line number %zu\n", size);
+    }
+    size += (size_t)fprintf(file, "%.*sStraddling needle\n", (int)(TRIGRAM_BLOCK_SIZE - 5 - size), "------------------------------------------------");
+    while (size < 3 * TRIGRAM_BLOCK_SIZE) {
+        size += (size_t)fprintf(file, "more filler %zu\n", size);
+    }
+    fprintf(file, "the end, another NEEDLE");
+    fclose(file);
+    char index_filename[PATH_MAX], changelog_filename[PATH_MAX];
+    get_trigram_index_filename(filename, index_filename, sizeof(index_filename));
+    get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
+    defer {
+        remove(filename);
+        remove(index_filename);
+        remove(changelog_filename);
+    };
+
+    __block const char *needle;
+    __block bool ignore_case;
+    auto search = ^(char *output) {
+        int result;
+        const char *captured = capture_stdout(^int(void) {
+            const char *params[] = { filename, needle, "-i" };
+            return find(ignore_case ? 3 : 2, params);
+        }, &result);
+        assert(result == 0);
+        strcpy(output, captured);
+    };
+
+    const char *needles[] = { "needle", "Straddling needle", "filler 1966", "no such thing", "another" };
+    static char expected[5][2][1 << 14], output[1 << 14];
+    for (size_t i = 0; i < 5; i++) {
+        for (int j = 0; j < 2; j++) {
+            needle = needles[i];
+            ignore_case = j;
+            search(expected[i][j]);
+        }
+    }
+
+    int result;
+    capture_stdout(^int(void) {
+        const char *params[] = { filename };
+        return build_index(1, params);
+    }, &result);
+    assert(result == 0);
+    assert(file_exists(index_filename));
+
+    // the index can only ever leave out blocks without a match, so everything has to come out the same
+    for (size_t i = 0; i < 5; i++) {
+        for (int j = 0; j < 2; j++) {
+            needle = needles[i];
+            ignore_case = j;
+            search(output);
+            assert(strcmp(output, expected[i][j]) == 0);
+        }
+    }
+    struct TrigramIndex index;
+    int fd = open(filename, O_RDONLY);
+    assert(trigram_index_open(filename, fd, &index) == 0);
+    uint64_t *candidates = $assert_nonnull(trigram_index_candidates(&index, "Straddling needle", strlen("Straddling needle")));
+    assert(candidates[0] == 1); // starts in the first block and nowhere else
+    free(candidates);
+    trigram_index_close(&index);
+    close(fd);
+
+    // appending keeps it up to date
+    const char *params_append[] = { filename, "appended needle" };
+    capture_stdout(^int(void) { return append_line(2, params_append); }, &result);
+    needle = "appended";
+    ignore_case = false;
+    search(output);
+    assert(strstr(output, "Line ") != nullptr and strstr(output, "another NEEDLEappended needle") != nullptr);
+    fd = open(filename, O_RDONLY);
+    assert(trigram_index_open(filename, fd, &index) == 0);
+    trigram_index_close(&index);
+
+    // anything else makes it stale, which is noticed and it's not used
+    const char *params_insert[] = { filename, "1", "inserted needle" };
+    capture_stdout(^int(void) { return insert_line(3, params_insert); }, &result);
+    close(fd);
+    fd = open(filename, O_RDONLY);
+    assert(trigram_index_open(filename, fd, &index) == 1);
+    close(fd);
+    needle = "inserted";
+    search(output);
+    assert(strncmp(output, "Line 1: inserted needle\n", strlen("Line 1: inserted needle\n")) == 0);
+
+    printf("test_index passed.\n");
+}
+
+static void test_find_ignore_case_and_utf8()
+{
+    auto file = $fopen("test_find.txt", "w");
+    fprintf(file, "Hello World\nhello world\nnothing\n");
+    // long enough to go through the vector loop, with the match straddling two vectors
+    fprintf(file, "%s HeLLo there\n", "padding padding padding padding");
+    fprintf(file, "Σίσυφος\nσίσυφος ΣΊΣΥΦΟΣ\n");
+    // the Kelvin sign and long s fold to ASCII, and are longer than what they fold to
+    fprintf(file, "%s Grüße aus ZÜRICH\n%s \u00C4\u212A\u017F\n", "padding padding padding padding", "padding padding padding padding");
+    fclose(file);
+    defer { remove("test_find.txt"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "HELLO", "-i" };
+        return find(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 1: Hello World\n") and strstr(output, "Line 2: hello world\n") and strstr(output, "Line 4: padding"));
+    assert(strstr(output, "Found 3 matching line(s)"));
+
+    // non-ASCII needles get full Unicode case folding, final sigma and all
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "ΣΊΣΥΦΟΣ", "-i" };
+        return find(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 5: Σίσυφος\n") and strstr(output, "Line 6: σίσυφος ΣΊΣΥΦΟΣ\n"));
+
+    // looked for by the Ü and the R after it, not the first letter
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "zürich", "-i" };
+        return find(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 7: padding") and strstr(output, "Found 1 matching line(s)"));
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "äks", "-i" };
+        return find(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 8: padding") and strstr(output, "Found 1 matching line(s)"));
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "υφος", "--utf8" };
+        return find(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 5, column 4: Σίσυφος\n") and strstr(output, "Line 6, column 4: "));
+
+    file = $fopen("test_find.txt", "a");
+    fprintf(file, "bad \xC3\x28 byte\n");
+    fclose(file);
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_find.txt", "byte", "--utf8" };
+        return find(3, params);
+    }, &result);
+    assert(result == 1);
+
+    // flags are looked for behind the positional parameters only, and nothing after a "--" is one
+    file = $fopen("test_find.txt", "a");
+    fprintf(file, "add -i to ignore case\n");
+    fclose(file);
+    auto cmd = $assert_nonnull(find_command("find"));
+    output = capture_stdout(^int(void) {
+        const char *args[] = { "test_find.txt", "--", "-i" }, *params[4];
+        size_t param_len;
+        if (arrange_params(cmd, 3, args, &param_len, params) != 0)
+            return -1;
+        return find(param_len, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Line 10: add -i to ignore case\n") and strstr(output, "Found 1 matching line(s)"));
+
+    output = capture_stdout(^int(void) {
+        const char *args[] = { "test_find.txt", "-i", "--", "HELLO" }, *params[5];
+        size_t param_len;
+        if (arrange_params(cmd, 4, args, &param_len, params) != 0)
+            return -1;
+        return find(param_len, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Found 3 matching line(s)"));
+
+    const char *args[] = { "test_find.txt", "-i" }, *params[3];
+    size_t param_len;
+    assert(arrange_params(cmd, 2, args, &param_len, params) != 0);
+
+    printf("test_find_ignore_case_and_utf8 passed.\n");
+}
+
+static void test_stats()
+{
+    const char *text = "hello world\n\n  two  words \nλέξη  ünïcödé\nlast line, no newline";
+    size_t len = strlen(text);
+
+    struct ChunkStats whole;
+    text_stats_chunk(text, len, true, &whole);
+    struct TextStats expected;
+    text_stats_merge(&expected, &whole, 1);
+    assert(expected.lines == 5);
+    assert(expected.words == 10);
+    assert(expected.bytes == len);
+    assert(expected.chars == len - 8); // eight 2-byte characters
+    assert(expected.longest_line == strlen("last line, no newline"));
+    assert(expected.histogram[0] == 1);
+
+    // cutting it anywhere (mid-word, mid-line, mid-character) has to merge back into the same thing
+    for (size_t cut = 0; cut <= len; cut++) {
+        struct ChunkStats chunks[2];
+        text_stats_chunk(text, cut, true, &chunks[0]);
+        text_stats_chunk(&text[cut], len - cut, cut == 0 or is_space((uint8_t)text[cut - 1]), &chunks[1]);
+        struct TextStats merged;
+        text_stats_merge(&merged, chunks, 2);
+        assert(memcmp(&merged, &expected, sizeof(merged)) == 0);
+    }
+
+    auto file = $fopen("test_stats.txt", "w");
+    fputs(text, file);
+    fclose(file);
+    defer { remove("test_stats.txt"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_stats.txt", "--json" };
+        return stats(2, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "\"lines\": 5, \"words\": 10,"));
+
+    // a huge thread count is capped rather than tried, one that isn't a count is turned down
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_stats.txt", "--threads", "100000000" };
+        return stats(3, params);
+    }, &result);
+    assert(result == 0);
+    const char *bad_threads[] = { "0", "-1", "abc" };
+    for (size_t i = 0; i < sizeof(bad_threads) / sizeof(*bad_threads); i++) {
+        const char *params[] = { "test_stats.txt", "--threads", bad_threads[i] };
+        assert(stats(3, params) != 0);
+    }
+
+    printf("test_stats passed.\n");
+}
+
+//Every line has to come in order according to `options`, with `count` lines in total. For `stable`, the input has to
+//have been in order by its first 8 bytes to begin with
+static void assert_sorted(const char *filename, const struct SortOptions *options, size_t count)
+{
+    struct MappedFile file;
+    assert(map_file(filename, &file) == 0);
+    defer { unmap_file(&file); };
+
+    __block struct SortLine previous = {0};
+    __block size_t lines = 0;
+    for_each_line(file.data, file.size, ^(const char *line, size_t len) {
+        struct SortLine current;
+        sort_line_init(&current, line, len - 1, options);
+        if (lines++ > 0) {
+            int order = compare_sort_lines(&previous, &current, options);
+            assert(order < 0 or (order == 0 and (not options->stable or memcmp(previous.data, current.data, 8) < 0)));
+        }
+        previous = current;
+    });
+    assert(lines == count);
+}
+
+static void test_sort()
+{
+    // enough lines that a tiny memory budget has to spill a few dozen runs and merge them
+    auto file = $fopen("test_sort.txt", "w");
+    for (int i = 0; i < 3000; i++) {
+        fprintf(file, "line%04d %d\n", i, (i * 7919) % 100 - 50);
+    }
+    fprintf(file, "no newline 0");
+    fclose(file);
+    defer { remove("test_sort.txt"); remove("test_sort.txt.changelog"); };
+
+    int result;
+    capture_stdout(^int(void) {
+        const char *params[] = { "test_sort.txt", "--key", "2", "--numeric", "--stable", "--memory", "4K" };
+        return sort(7, params);
+    }, &result);
+    assert(result == 0);
+
+    // with --stable, lines with equal numbers compare equal, but they still have to be in their original order
+    struct SortOptions options = { .key = 2, .numeric = true, .stable = true };
+    assert_sorted("test_sort.txt", &options, 3001);
+
+    // in memory and on disk have to agree
+    capture_stdout(^int(void) {
+        const char *params[] = { "test_sort.txt", "--reverse" };
+        return sort(2, params);
+    }, &result);
+    assert(result == 0);
+    options = (struct SortOptions) { .reverse = true };
+    assert_sorted("test_sort.txt", &options, 3001);
+
+    struct MappedFile in_memory;
+    assert(map_file("test_sort.txt", &in_memory) == 0);
+    char *expected = $malloc(in_memory.size);
+    size_t expected_size = in_memory.size;
+    memcpy(expected, in_memory.data, expected_size);
+    unmap_file(&in_memory);
+    defer { free(expected); };
+
+    capture_stdout(^int(void) {
+        const char *params[] = { "test_sort.txt", "--key", "2", "--numeric", "--memory", "4K", "--threads", "3" };
+        return sort(8, params);
+    }, &result);
+    assert(result == 0);
+    capture_stdout(^int(void) {
+        const char *params[] = { "test_sort.txt", "--reverse", "--memory", "4K" };
+        return sort(4, params);
+    }, &result);
+    assert(result == 0);
+
+    struct MappedFile on_disk;
+    assert(map_file("test_sort.txt", &on_disk) == 0);
+    assert(on_disk.size == expected_size and memcmp(on_disk.data, expected, expected_size) == 0);
+    unmap_file(&on_disk);
+
+    // sizes that aren't whole byte counts or don't fit, and keys that aren't field numbers, are turned down
+    const char *bad[][2] = {
+        { "--memory", "1e30" }, { "--memory", "inf" }, { "--memory", "99999999999G" }, { "--memory", "1.5M" }, { "--memory", "-4K" },
+        { "--key", "abc" }, { "--key", "-1" }, { "--key", "0" },
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+        const char *params[] = { "test_sort.txt", bad[i][0], bad[i][1] };
+        assert(sort(3, params) != 0);
+    }
+
+    printf("test_sort passed.\n");
+}
+
+//How much more memory (resident, at its peak) `action` takes than the test was already using, run in a child so
+//whatever the tests before it used doesn't count. Only Linux has a cheap way of finding out, elsewhere it's 0
+static size_t peak_memory(int (^action)(void), int *result)
+{
+#if defined(__linux__)
+    int result_pipe[2];
+    assert(pipe(result_pipe) == 0);
+    fflush(stdout);
+    pid_t child = fork();
+    assert(child >= 0);
+    if (child == 0) {
+        close(result_pipe[0]);
+        // the high-water mark starts out at what the child shares with the parent
+        long pages = 0;
+        auto statm = $fopen("/proc/self/statm", "r");
+        assert(fscanf(statm, "%*d %ld", &pages) == 1);
+        fclose(statm);
+
+        int child_result = action();
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        size_t before = (size_t)pages * (size_t)sysconf(_SC_PAGESIZE), peak = (size_t)usage.ru_maxrss * 1024;
+        size_t report[2] = { (size_t)child_result, peak > before ? peak - before : 0 };
+        _exit(write_all(result_pipe[1], report, sizeof(report)) == 0 ? 0 : 1);
+    }
+    close(result_pipe[1]);
+    size_t report[2];
+    assert(read_all(result_pipe[0], report, sizeof(report)) == 0);
+    close(result_pipe[0]);
+    waitpid(child, nullptr, 0);
+    *result = (int)report[0];
+    return report[1];
+#else
+    *result = action();
+    return 0;
+#endif
+}
+
+static void test_sort_memory_budget()
+{
+    // lots of tiny lines are what used to blow the budget, the line array outgrew the text by 20 times
+    auto file = $fopen("test_sort_budget.txt", "w");
+    for (int i = 0; i < 400000; i++) {
+        fprintf(file, "%c\n", 'a' + (i * 7) % 26);
+    }
+    fclose(file);
+    defer { remove("test_sort_budget.txt"); };
+
+    size_t budget = 1 << 20;
+    int result;
+    size_t peak = peak_memory(^int(void) {
+        int fd = open("test_sort_budget.txt", O_RDONLY);
+        auto out = $fopen("/dev/null", "w");
+        struct SortOptions options = {0};
+        size_t count = 0;
+        int sorted = sort_file(fd, out, "test_sort_budget.txt", budget, &options, 1, &count);
+        fclose(out);
+        close(fd);
+        return sorted == 0 and count == 400000 ? 0 : 1;
+    }, &result);
+    assert(result == 0);
+    // the budget, and some slack for stdio and the allocator
+    assert(peak <= budget + budget / 2);
+
+    printf("test_sort_memory_budget passed.\n");
+}
+
+static void test_dedupe()
+{
+    // a small budget has to take the partitioned path, and both have to keep the first of every line in order
+    for (int pass = 0; pass < 2; pass++) {
+        auto file = $fopen("test_dedupe.txt", "w");
+        for (int i = 0; i < 2000; i++) {
+            fprintf(file, "line %d\n", (i * 37) % 500);
+        }
+        fprintf(file, "\n\nline 3"); // no newline, but still a copy of "line 3"
+        fclose(file);
+        defer { remove("test_dedupe.txt"); remove("test_dedupe.txt.changelog"); };
+
+        int result;
+        const char *output = capture_stdout(^int(void) {
+            const char *params[] = { "test_dedupe.txt", "--memory", pass == 0 ? "64M" : "4K" };
+            return dedupe(3, params);
+        }, &result);
+        assert(result == 0);
+        assert(strstr(output, "Removed 1502 duplicate line(s)"));
+
+        for (int i = 0; i < 500; i++) {
+            char expected[32];
+            snprintf(expected, sizeof(expected), "line %d\n", (i * 37) % 500);
+            const char *line = read_line("test_dedupe.txt", i + 1);
+            assert(line and strcmp(line, expected) == 0);
+        }
+        const char *line = read_line("test_dedupe.txt", 501);
+        assert(line and strcmp(line, "\n") == 0);
+        assert(read_line("test_dedupe.txt", 502) == nullptr);
+    }
+
+    printf("test_dedupe passed.\n");
+}
+
+static void test_dedupe_open_files()
+{
+    // enough distinct lines for a 4K budget to want far more partitions than there are files to open, and for those to
+    // have to be split again
+    auto file = $fopen("test_dedupe.txt", "w");
+    for (int i = 0; i < 40000; i++) {
+        fprintf(file, "entry %d\n", (i * 7) % 20000);
+    }
+    fclose(file);
+    defer { remove("test_dedupe.txt"); remove("test_dedupe.txt.changelog"); };
+
+    struct rlimit files;
+    assert(getrlimit(RLIMIT_NOFILE, &files) == 0);
+    struct rlimit low = { .rlim_cur = 64, .rlim_max = files.rlim_max };
+    assert(setrlimit(RLIMIT_NOFILE, &low) == 0);
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_dedupe.txt", "--memory", "4K" };
+        return dedupe(3, params);
+    }, &result);
+    assert(setrlimit(RLIMIT_NOFILE, &files) == 0);
+    assert(result == 0);
+    assert(strstr(output, "Removed 20000 duplicate line(s)"));
+
+    for (int i = 0; i < 20000; i += 997) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "entry %d\n", (i * 7) % 20000);
+        const char *line = read_line("test_dedupe.txt", i + 1);
+        assert(line and strcmp(line, expected) == 0);
+    }
+    assert(read_line("test_dedupe.txt", 20001) == nullptr);
+
+    printf("test_dedupe_open_files passed.\n");
+}
+
+static void test_diff()
+{
+    auto file = $fopen("test_diff_a.txt", "w");
+    fprintf(file, "one\ntwo\nthree\nfour\nfive\nsix\nseven\neight\nnine\nten\n");
+    fclose(file);
+    file = $fopen("test_diff_b.txt", "w");
+    fprintf(file, "one\nthree\nfour\nfive\nSIX\nseven\neight\nnine\nten\neleven");
+    fclose(file);
+    defer { remove("test_diff_a.txt"); remove("test_diff_b.txt"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_diff_a.txt", "test_diff_b.txt" };
+        return show_diff(2, params);
+    }, &result);
+    assert(result == 1);
+    // the same as `diff -u`
+    assert(strcmp(output, "--- test_diff_a.txt\n+++ test_diff_b.txt\n"
+                          "@@ -1,10 +1,10 @@\n one\n-two\n three\n four\n five\n-six\n+SIX\n seven\n eight\n nine\n ten\n"
+                          "+eleven\n\\ No newline at end of file\n") == 0);
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_diff_a.txt", "test_diff_a.txt" };
+        return show_diff(2, params);
+    }, &result);
+    assert(result == 0 and output[0] == '\0');
+
+    // far apart changes in a longer file get their own hunks, and sync back up in between
+    file = $fopen("test_diff_a.txt", "w");
+    for (int i = 0; i < 2000; i++) {
+        fprintf(file, "line %d\n", i % 100);
+    }
+    fclose(file);
+    file = $fopen("test_diff_b.txt", "w");
+    for (int i = 0; i < 2000; i++) {
+        if (i == 500 or i == 1500)
+            continue;
+        fprintf(file, i == 1000 ? "changed %d\n" : "line %d\n", i % 100);
+    }
+    fclose(file);
+
+    struct MappedFile a, b;
+    assert(map_file("test_diff_a.txt", &a) == 0 and map_file("test_diff_b.txt", &b) == 0);
+    struct Diff diff;
+    diff_files(&a, &b, &diff);
+    assert(diff.count == 3);
+    struct DiffChange *changes = $assert_nonnull(diff.changes);
+    assert(changes[0].a_line == 500 and changes[0].a_count == 1 and changes[0].b_count == 0);
+    assert(changes[1].a_line == 1000 and changes[1].a_count == 1 and changes[1].b_line == 999 and changes[1].b_count == 1);
+    assert(changes[2].a_line == 1500 and changes[2].a_count == 1 and changes[2].b_count == 0);
+    diff_free(&diff);
+    unmap_file(&a);
+    unmap_file(&b);
+
+    printf("test_diff passed.\n");
+}
+
+static void test_replace()
+{
+    auto file = $fopen("test_replace.txt", "w");
+    fprintf(file, "foo bar foo\nbaz\nfoo");
+    fclose(file);
+    defer { remove("test_replace.txt"); remove("test_replace.txt.changelog"); };
+
+    // same length goes in place
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_replace.txt", "foo", "qux" };
+        return replace(3, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Replaced 3 occurrence(s) on 2 line(s)"));
+    assert(line_is("test_replace.txt", 1, "qux bar qux\n"));
+    assert(line_is("test_replace.txt", 3, "qux"));
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_replace.txt", "qux", "a\nlonger one", "--max", "2" };
+        return replace(5, params);
+    }, &result);
+    assert(result == 0);
+    assert(strstr(output, "Replaced 2 occurrence(s) on 1 line(s)"));
+    assert(line_is("test_replace.txt", 1, "a\n"));
+    assert(line_is("test_replace.txt", 2, "longer one bar a\n"));
+    assert(line_is("test_replace.txt", 5, "qux"));
+
+    // a count that isn't one is turned down before anything is touched
+    const char *bad_max[] = { "0", "-1", "abc", "2x", "" };
+    for (size_t i = 0; i < sizeof(bad_max) / sizeof(*bad_max); i++) {
+        const char *params[] = { "test_replace.txt", "qux", "x", "--max", bad_max[i] };
+        assert(replace(5, params) != 0);
+    }
+    assert(line_is("test_replace.txt", 5, "qux"));
+
+    // no file to edit, no changelog for it either
+    const char *missing[] = { "test_replace_missing.txt", "qux", "x" };
+    assert(replace(3, missing) != 0);
+    assert(not file_exists("test_replace_missing.txt.changelog"));
+
+    struct Changelog *nonnull changelog;
+    assert(parse_changelog("test_replace.txt", &changelog) == 0);
+    assert(changelog->length == 3);
+    assert(strcmp(changelog->entries[2].operation, "Replace Line") == 0 and changelog->entries[2].line_number == 1);
+    assert(changelog->entries[2].total_lines == 5);
+    free(changelog);
+
+    printf("test_replace passed.\n");
+}
+
+static void test_cut()
+{
+    auto file = $fopen("test_cut.csv", "w");
+    fprintf(file, "id,name,notes\n1,\"Smith, John\",\"said \"\"hi\"\"\nand left\"\n2,Jane,\nno delimiters here\n3,Bob,last");
+    fclose(file);
+    defer { remove("test_cut.csv"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_cut.csv", ",", "2-" };
+        return cut(3, params);
+    }, &result);
+    assert(result == 0);
+    // quoted delimiters and newlines stay part of the field, and the quotes stay on
+    assert(strcmp(output, "name,notes\n\"Smith, John\",\"said \"\"hi\"\"\nand left\"\nJane,\nno delimiters here\nBob,last\n") == 0);
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_cut.csv", ",", "1,3", "--no-quotes" };
+        return cut(4, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "id,notes\n1, John\"\nand left\"\n2,\nno delimiters here\n3,last\n") == 0);
+
+    struct CutFields fields;
+    assert(cut_fields_parse(&fields, "-2,4,6-") == 0);
+    assert(cut_field_selected(&fields, 1) and cut_field_selected(&fields, 2) and not cut_field_selected(&fields, 3));
+    assert(cut_field_selected(&fields, 4) and not cut_field_selected(&fields, 5) and cut_field_selected(&fields, 100));
+    cut_fields_free(&fields);
+    assert(cut_fields_parse(&fields, "0") != 0);
+    cut_fields_free(&fields);
+    assert(cut_fields_parse(&fields, "3-1") != 0);
+    cut_fields_free(&fields);
+    assert(cut_fields_parse(&fields, "1000000000000") != 0);
+    cut_fields_free(&fields);
+    assert(cut_fields_parse(&fields, "2-99999999999999999999") != 0);
+    cut_fields_free(&fields);
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_cut.csv", ",", "1000000000000" };
+        return cut(3, params);
+    }, &result);
+    assert(result != 0);
+
+    printf("test_cut passed.\n");
+}
+
+static void test_pipe()
+{
+    auto file = $fopen("test_pipe.txt", "w");
+    fprintf(file, "foo one  \nbar two\t\nfoo three\r\nFOO four\nlast foo ");
+    fclose(file);
+    defer { remove("test_pipe.txt"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "trim | find foo | replace foo 'a b'" };
+        return run_pipe(2, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "a b one\na b three\nlast a b\n") == 0);
+
+    // already split up by the shell, and the summary comes after the lines
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "find", "foo", "-i", "|", "line-count" };
+        return run_pipe(6, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "4 line(s) out of 'test_pipe.txt'.\n") == 0);
+
+    // a lone `|` mixed in with stages that still need splitting
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "trim", "|", "find foo" };
+        return run_pipe(4, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "foo one\nfoo three\nlast foo\n") == 0);
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "find foo | replace foo x --max 1" };
+        return run_pipe(2, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "x one  \nfoo three\r\nlast foo \n") == 0);
+
+    // the file is only read, never changed
+    assert(line_is("test_pipe.txt", 1, "foo one  \n"));
+
+    const char *bad[][2] = {
+        { "test_pipe.txt", "trim | sort" }, { "test_pipe.txt", "trim |" }, { "test_pipe.txt", "find 'foo" }, { "test_pipe.txt", "find" },
+        { "test_pipe.txt", "find foo --follow" }, { "test_pipe.txt", "replace foo x --max 0" },
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+        assert(run_pipe(2, bad[i]) != 0);
+    }
+
+    file = $fopen("test_pipe.txt", "a");
+    fprintf(file, "\nbad \xC3\x28 foo\n");
+    fclose(file);
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "find foo --utf8" };
+        return run_pipe(2, params);
+    }, &result);
+    assert(result == 1);
+    assert(strstr(output, "bad \xC3\x28 foo\n") != nullptr);
+
+    // "--" works inside a stage too
+    file = $fopen("test_pipe.txt", "a");
+    fprintf(file, "try -i\n");
+    fclose(file);
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_pipe.txt", "find -- -i | replace -- -i --follow" };
+        return run_pipe(2, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "try --follow\n") == 0);
+
+    printf("test_pipe passed.\n");
+}
+
+static void test_normalize()
+{
+    auto file = $fopen("test_normalize.txt", "w");
+    fprintf(file, "\xEF\xBB\xBF" "a\tb\r\n\xC3\xA9\tc\r\nlone\rcr\n\t\tend");
+    fclose(file);
+    defer { remove("test_normalize.txt"); remove("test_normalize.txt.changelog"); };
+
+    int result;
+    const char *output = capture_stdout(^int(void) {
+        const char *params[] = { "test_normalize.txt", "--strip-bom", "--crlf-to-lf", "--expand-tabs", "4", "--final-newline" };
+        return normalize_file(6, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "Normalized 'test_normalize.txt': 1 BOM(s) stripped, 2 CRLF(s) turned into LF, 4 tab(s) expanded, 1 final newline(s) added.\n") == 0);
+    struct MappedFile normalized;
+    assert(map_file("test_normalize.txt", &normalized) == 0);
+    // tabs go to the next multiple of 4 characters, not bytes
+    const char *expected = "a   b\n\xC3\xA9   c\nlone\rcr\n        end\n";
+    assert(normalized.size == strlen(expected) and memcmp(normalized.data, expected, normalized.size) == 0);
+    unmap_file(&normalized);
+
+    struct Changelog *nonnull changelog;
+    assert(parse_changelog("test_normalize.txt", &changelog) == 0);
+    assert(changelog->length == 1 and strcmp(changelog->entries[0].operation, "Normalize") == 0 and changelog->entries[0].total_lines == 4);
+    free(changelog);
+
+    // nothing left to fix, so nothing is written, not even to the changelog
+    remove("test_normalize.txt.changelog");
+    struct stat before, after;
+    assert(stat("test_normalize.txt", &before) == 0);
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_normalize.txt", "--strip-bom", "--crlf-to-lf", "--expand-tabs", "4", "--final-newline" };
+        return normalize_file(6, params);
+    }, &result);
+    assert(result == 0);
+    assert(strcmp(output, "'test_normalize.txt' is already normalized.\n") == 0);
+    assert(stat("test_normalize.txt", &after) == 0 and before.st_ino == after.st_ino);
+    assert(not file_exists("test_normalize.txt.changelog"));
+
+    output = capture_stdout(^int(void) {
+        const char *params[] = { "test_normalize.txt", "--lf-to-crlf" };
+        return normalize_file(2, params);
+    }, &result);
+    assert(result == 0);
+    assert(line_is("test_normalize.txt", 2, "\xC3\xA9   c\r\n") and line_is("test_normalize.txt", 4, "        end\r\n"));
+
+    // a \r right at the end becomes the line ending instead of getting a \n of its own after it
+    const char *cut_short[][3] = { { "x\r\ny\r", "--crlf-to-lf", "x\ny\n" }, { "x\ny\r", "--lf-to-crlf", "x\r\ny\r\n" } };
+    for (size_t i = 0; i < sizeof(cut_short) / sizeof(*cut_short); i++) {
+        file = $fopen("test_normalize.txt", "w");
+        fputs(cut_short[i][0], file);
+        fclose(file);
+        const char *mode = cut_short[i][1];
+        output = capture_stdout(^int(void) {
+            const char *params[] = { "test_normalize.txt", mode, "--final-newline" };
+            return normalize_file(3, params);
+        }, &result);
+        assert(result == 0 and strstr(output, "1 final newline(s) added"));
+        assert(map_file("test_normalize.txt", &normalized) == 0);
+        assert(normalized.size == strlen(cut_short[i][2]) and memcmp(normalized.data, cut_short[i][2], normalized.size) == 0);
+        unmap_file(&normalized);
+    }
+
+    const char *both[] = { "test_normalize.txt", "--lf-to-crlf", "--crlf-to-lf" };
+    assert(normalize_file(3, both) != 0);
+    const char *nothing[] = { "test_normalize.txt" };
+    assert(normalize_file(1, nothing) != 0);
+    const char *bad_width[] = { "test_normalize.txt", "--expand-tabs", "4x" };
+    assert(normalize_file(3, bad_width) != 0);
+
+    printf("test_normalize passed.\n");
+}
+
 int main() {
     test_create_file();
     test_copy_file();
+    test_copy_file_delta();
     test_delete_file();
     test_show_file();
     test_append_line();
     test_delete_line();
     test_insert_line();
     test_show_line();
+    test_show_line_index();
+    test_pipeline();
     test_show_change_log();
     test_change_log();
     test_show_number_of_lines();
+    test_line_reader_long_lines();
+    test_follow_line_count();
+    test_concurrent_writers();
+    test_stdin();
+    test_index();
+    test_find_ignore_case_and_utf8();
+    test_stats();
+    test_sort();
+    test_sort_memory_budget();
+    test_dedupe();
+    test_dedupe_open_files();
+    test_diff();
+    test_replace();
+    test_cut();
+    test_pipe();
+    test_normalize();
 
     printf("All tests passed.\n");
     return 0;
@@ -0,0 +1,303 @@
+#include "cut.h"
+#include "parallel.h"
+#include "simd.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    CUT_BLOCK = 2 * SIMD_WIDTH,     // One bit per byte in a `uint64_t`
+    CUT_WRITE_IOVECS = 1024,        // IOV_MAX on Linux and macOS
+};
+
+int cut_fields_parse(struct CutFields *fields, const char *spec)
+{
+    *fields = (struct CutFields) { .open_from = SIZE_MAX };
+
+    for (const char *p = spec;;) {
+        char *end;
+        errno = 0;
+        size_t first = *p == '-' ? 1 : (size_t)strtoull(p, &end, 10), last;
+        if (*p == '-')
+            end = (char *)p;
+        if (first == 0 or first > CUT_MAX_FIELD or (end == p and *p != '-'))
+            return -1;
+
+        if (*end == '-') {
+            p = end + 1;
+            last = SIZE_MAX;
+            end = (char *)p;
+            if (*p >= '0' and *p <= '9')
+                last = (size_t)strtoull(p, &end, 10);
+            if (errno == ERANGE or last < first or (last != SIZE_MAX and last > CUT_MAX_FIELD))
+                return -1;
+        } else {
+            last = first;
+        }
+
+        if (last == SIZE_MAX) {
+            fields->open_from = first < fields->open_from ? first : fields->open_from;
+        } else {
+            if (last >= fields->listed_count) {
+                fields->listed = $realloc(fields->listed, (last + 1) * sizeof(bool));
+                bool *listed = $assert_nonnull(fields->listed);
+                memset(&listed[fields->listed_count], 0, last + 1 - fields->listed_count);
+                fields->listed_count = last + 1;
+            }
+            bool *listed = $assert_nonnull(fields->listed);
+            for (size_t field = first; field <= last; field++) {
+                listed[field] = true;
+            }
+        }
+
+        if (*end == '\0')
+            return 0;
+        if (*end != ',')
+            return -1;
+        p = end + 1;
+    }
+}
+
+void cut_fields_free(struct CutFields *fields)
+{
+    free(fields->listed);
+    *fields = (struct CutFields) {0};
+}
+
+//Walks the delimiters and newlines that aren't inside quotes. Every 64 bytes get turned into bitmaps of where the
+//delimiters, newlines and quotes are, the quote bitmap's prefix XOR is a bitmap of what's inside quotes (every quote
+//flips in/out, escaped "" flips twice), and whatever's left is handed out one set bit at a time
+struct Scanner {
+    const char *data;
+    size_t size,
+           block;                   // Where the current 64 bytes start
+    uint64_t structurals,           // Not handed out yet from the current block
+             in_quotes;             // All ones if the next block starts inside quotes
+    uint8_t delimiter;
+    bool quotes;
+};
+
+static inline uint64_t block_mask(simd_bytes low, simd_bytes high, uint8_t byte)
+{ return simd_mask(simd_eq(low, byte)) | (uint64_t)simd_mask(simd_eq(high, byte)) << 32; }
+
+//Bit i is the XOR of bits 0 through i
+static inline uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static void scanner_load(struct Scanner *s)
+{
+    const char *block = &s->data[s->block];
+    size_t left = s->size - s->block;
+    char padded[CUT_BLOCK] = {0};
+    if (left < CUT_BLOCK) {
+        memcpy(padded, block, left);
+        block = padded;
+    }
+
+    simd_bytes low = simd_load(block), high = simd_load(block + SIMD_WIDTH);
+    uint64_t structurals = block_mask(low, high, '\n') | block_mask(low, high, s->delimiter);
+    if (s->quotes) {
+        uint64_t inside = prefix_xor(block_mask(low, high, '"')) ^ s->in_quotes;
+        s->in_quotes = (uint64_t)((int64_t)inside >> 63);
+        structurals &= ~inside;
+    }
+    if (left < CUT_BLOCK)
+        structurals &= (UINT64_C(1) << left) - 1; // the padding
+    s->structurals = structurals;
+}
+
+static void scanner_init(struct Scanner *s, const char *data, size_t size, size_t start, bool in_quotes, char delimiter, bool quotes)
+{
+    *s = (struct Scanner) {
+        .data = data, .size = size, .block = start,
+        .in_quotes = in_quotes ? UINT64_MAX : 0,
+        .delimiter = (uint8_t)delimiter, .quotes = quotes,
+    };
+    if (start < size)
+        scanner_load(s);
+}
+
+//Where the next delimiter or newline is, `size` if there are none left
+static inline size_t scanner_next(struct Scanner *s)
+{
+    while (s->structurals == 0) {
+        if (s->block + CUT_BLOCK >= s->size)
+            return s->size;
+        s->block += CUT_BLOCK;
+        scanner_load(s);
+    }
+    size_t pos = s->block + (size_t)__builtin_ctzll(s->structurals);
+    s->structurals &= s->structurals - 1;
+    return pos;
+}
+
+//The output of a chunk, as pieces of the mapping (and the odd delimiter/newline) for `writev`
+struct CutOutput {
+    struct iovec *nullable iov;
+    size_t count, capacity;
+};
+
+static inline void emit(struct CutOutput *out, const char *data, size_t len)
+{
+    struct iovec *iov = out->iov;
+    // most of the time this continues right where the last piece ended (neighbouring fields, the newline)
+    if (out->count > 0 and (const char *)iov[out->count - 1].iov_base + iov[out->count - 1].iov_len == data) {
+        iov[out->count - 1].iov_len += len;
+        return;
+    }
+    if (out->count >= out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 4096;
+        iov = out->iov = $realloc(out->iov, out->capacity * sizeof(struct iovec));
+    }
+    iov[out->count++] = (struct iovec) { .iov_base = (void *)data, .iov_len = len };
+}
+
+struct CutJob {
+    const struct MappedFile *file;
+    const struct CutFields *fields;
+    char delimiter;
+    bool quotes;
+};
+
+//Cuts every line that starts in [begin, end), the last one can run past `end`
+static void cut_chunk(const struct CutJob *job, size_t begin, size_t end, bool in_quotes, struct CutOutput *out)
+{
+    static const char newline = '\n';
+    const char *data = job->file->data;
+    size_t size = job->file->size;
+
+    struct Scanner s;
+    scanner_init(&s, data, size, begin, in_quotes, job->delimiter, job->quotes);
+
+    // the first line that starts in this chunk, the one before belongs to the chunk before
+    size_t line_start = begin;
+    if (begin > 0 and (data[begin - 1] != '\n' or in_quotes)) {
+        size_t pos = scanner_next(&s);
+        while (pos < size and data[pos] != '\n') {
+            pos = scanner_next(&s);
+        }
+        line_start = pos + 1;
+    }
+
+    while (line_start < end and line_start < size) {
+        size_t field = 1, field_start = line_start, pos;
+        bool split = false, wrote = false;
+        for (;;) {
+            pos = scanner_next(&s);
+            bool line_end = pos == size or data[pos] == '\n';
+            split |= not line_end;
+
+            // like `cut`, a line without any delimiters comes out whole
+            if (cut_field_selected(job->fields, field) or (line_end and not split)) {
+                if (wrote)
+                    emit(out, &data[field_start - 1], 1); // the delimiter before it, so neighbours stay one piece
+                emit(out, &data[field_start], pos - field_start);
+                wrote = true;
+            }
+            if (line_end)
+                break;
+            field++;
+            field_start = pos + 1;
+        }
+
+        emit(out, pos < size ? &data[pos] : &newline, 1);
+        line_start = pos + 1;
+    }
+}
+
+static int writev_all(int fd, struct iovec *iov, size_t count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, (int)(count < CUT_WRITE_IOVECS ? count : CUT_WRITE_IOVECS));
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // skip whatever made it out, which can end halfway through a piece
+        for (size_t done = (size_t)written; done > 0 and count > 0;) {
+            if (done >= iov->iov_len) {
+                done -= iov->iov_len;
+                iov++;
+                count--;
+            } else {
+                iov->iov_base = (char *)iov->iov_base + done;
+                iov->iov_len -= done;
+                done = 0;
+            }
+        }
+        while (count > 0 and iov->iov_len == 0) {
+            iov++;
+            count--;
+        }
+    }
+    return 0;
+}
+
+int cut_file(const struct MappedFile *file, char delimiter, const struct CutFields *fields, bool quotes, size_t threads, int out_fd)
+{
+    size_t chunk_count = (file->size + CUT_CHUNK_SIZE - 1) / CUT_CHUNK_SIZE;
+    bool *in_quotes = $calloc(chunk_count + 1, sizeof(bool));
+    defer { free(in_quotes); };
+
+    // a chunk can start in the middle of a quoted field, which only counting every quote before it can tell. Counting
+    // is cheap and splits up fine, so that's a quick pass of its own and every chunk knows where it stands
+    if (quotes) {
+        parallel_for(chunk_count, threads, ^(size_t chunk) {
+            size_t offset = chunk * CUT_CHUNK_SIZE;
+            size_t len = file->size - offset < CUT_CHUNK_SIZE ? file->size - offset : CUT_CHUNK_SIZE;
+            in_quotes[chunk + 1] = count_byte(&file->data[offset], len, '"') % 2;
+        });
+        for (size_t chunk = 1; chunk <= chunk_count; chunk++) {
+            in_quotes[chunk] ^= in_quotes[chunk - 1];
+        }
+    }
+
+    // a few chunks per thread at a time, written out in order before the next few, so memory doesn't grow with the file
+    size_t batch = (threads > 0 ? threads : 1) * 2;
+    struct CutOutput *outputs = $calloc(batch, sizeof(struct CutOutput));
+    defer {
+        for (size_t i = 0; i < batch; i++) {
+            free(outputs[i].iov);
+        }
+        free(outputs);
+    };
+    struct CutJob job = { .file = file, .fields = fields, .delimiter = delimiter, .quotes = quotes };
+    const struct CutJob *job_ref = &job;
+
+    for (size_t first = 0; first < chunk_count; first += batch) {
+        size_t count = chunk_count - first < batch ? chunk_count - first : batch;
+        parallel_for(count, threads, ^(size_t i) {
+            size_t chunk = first + i;
+            outputs[i].count = 0;
+            cut_chunk(job_ref, chunk * CUT_CHUNK_SIZE, (chunk + 1) * CUT_CHUNK_SIZE, in_quotes[chunk], &outputs[i]);
+        });
+
+        for (size_t i = 0; i < count; i++) {
+            if (outputs[i].count == 0)
+                continue;
+            struct iovec *iov = $assert_nonnull(outputs[i].iov);
+            if (writev_all(out_fd, iov, outputs[i].count) != 0) {
+                perror("Error writing output");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+#pragma clang assume_nonnull end
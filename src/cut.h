@@ -0,0 +1,31 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#pragma clang assume_nonnull begin
+
+enum {
+    CUT_CHUNK_SIZE = 4 << 20,
+    CUT_MAX_FIELD = 1 << 20,        // Field numbers past this are rejected, `listed` is one bool per field up to the last
+};
+
+//Which fields to keep, 1-based like `cut -f`
+struct CutFields {
+    bool *nullable listed;          // Fields up to `listed_count` that were asked for by number
+    size_t listed_count,
+           open_from;               // Every field from here on, for "3-". SIZE_MAX if there wasn't one
+};
+
+//"1,3-5,7-", returns -1 if it doesn't make sense or names a field past CUT_MAX_FIELD
+int cut_fields_parse(struct CutFields *fields, const char *spec);
+void cut_fields_free(struct CutFields *fields);
+
+static inline bool cut_field_selected(const struct CutFields *fields, size_t field)
+{ return field >= fields->open_from or (field < fields->listed_count and fields->listed[field]); }
+
+//Writes the selected fields of every line of `file` to `out_fd`, straight out of the mapping. With `quotes`, delimiters
+//and newlines inside double quotes don't count (CSV), fields keep their quotes
+int cut_file(const struct MappedFile *file, char delimiter, const struct CutFields *fields, bool quotes, size_t threads, int out_fd);
+
+#pragma clang assume_nonnull end
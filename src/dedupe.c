@@ -0,0 +1,436 @@
+#include "dedupe.h"
+#include "fileio.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    LINE_ARENA_CHUNK = 1 << 20,
+    MAX_PARTITIONS = 1024,          // Each one is an open file, and there's a lower cap from RLIMIT_NOFILE
+    RESERVED_FILES = 256,           // Left for everything else that's open when working out that cap
+    MAX_PARTITION_DEPTH = 4,        // How many times a partition that's still too big is split again
+};
+
+struct LineSetSlot {
+    uint64_t hash;
+    const char *nullable line;      // Into the arena, null for an empty slot
+    size_t len;
+};
+
+//Every distinct line seen so far. The table only holds fingerprints and pointers (open addressing, linear probing,
+//at most half full), the lines themselves are copied into big arena chunks so there's no allocation per line
+struct LineSet {
+    struct LineSetSlot *nullable slots;
+    size_t capacity, count;
+    char *nullable *nullable chunks;
+    size_t chunk_count, chunk_used, chunk_size;
+    size_t memory, limit;           // What all of that takes up, and how much it's allowed to (0 for no limit)
+};
+
+static void line_set_free(struct LineSet *set)
+{
+    char *nullable *chunks = set->chunks;
+    for (size_t i = 0; i < set->chunk_count; i++) {
+        free(chunks[i]);
+    }
+    free(chunks);
+    free(set->slots);
+    *set = (struct LineSet) { .limit = set->limit };
+}
+
+static void line_set_grow(struct LineSet *set)
+{
+    size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+    struct LineSetSlot *slots = $calloc(capacity, sizeof(struct LineSetSlot));
+
+    struct LineSetSlot *nullable old_slots = set->slots;
+    for (size_t i = 0; i < set->capacity; i++) {
+        struct LineSetSlot slot = old_slots[i];
+        if (slot.line == nullptr)
+            continue;
+        size_t index = slot.hash & (capacity - 1);
+        while (slots[index].line != nullptr) {
+            index = (index + 1) & (capacity - 1);
+        }
+        slots[index] = slot;
+    }
+
+    free(set->slots);
+    set->memory += (capacity - set->capacity) * sizeof(struct LineSetSlot);
+    set->slots = slots;
+    set->capacity = capacity;
+}
+
+//1 if the line is new (and now remembered), 0 if it's been seen before, -1 if remembering it would go over the limit
+static int line_set_add(struct LineSet *set, const char *line, size_t len, uint64_t hash)
+{
+    if (set->capacity > 0) {
+        struct LineSetSlot *slots = $assert_nonnull(set->slots);
+        for (size_t index = hash & (set->capacity - 1); slots[index].line != nullptr; index = (index + 1) & (set->capacity - 1)) {
+            // the fingerprint settles it almost every time, the bytes are only compared to be sure
+            if (slots[index].hash == hash and slots[index].len == len and memcmp(slots[index].line, line, len) == 0)
+                return 0;
+        }
+    }
+
+    bool grow_table = set->count + 1 > set->capacity / 2,
+         new_chunk = set->chunk_count == 0 or set->chunk_used + len > set->chunk_size;
+    size_t chunk_size = len > LINE_ARENA_CHUNK ? len : LINE_ARENA_CHUNK;
+    size_t needed = (grow_table ? (set->capacity ? set->capacity : 1024) * sizeof(struct LineSetSlot) : 0) + (new_chunk ? chunk_size : 0);
+    if (set->limit > 0 and set->memory + needed > set->limit)
+        return -1;
+
+    if (grow_table)
+        line_set_grow(set);
+    if (new_chunk) {
+        char *nullable *chunks = $realloc(set->chunks, (set->chunk_count + 1) * sizeof(char *));
+        chunks[set->chunk_count++] = $malloc(chunk_size);
+        set->chunks = chunks;
+        set->chunk_used = 0;
+        set->chunk_size = chunk_size;
+        set->memory += chunk_size;
+    }
+
+    char *nullable *chunks = set->chunks;
+    char *chunk = $assert_nonnull(chunks[set->chunk_count - 1]);
+    char *copy = &chunk[set->chunk_used];
+    memcpy(copy, line, len);
+    set->chunk_used += len;
+
+    struct LineSetSlot *slots = $assert_nonnull(set->slots);
+    size_t index = hash & (set->capacity - 1);
+    while (slots[index].line != nullptr) {
+        index = (index + 1) & (set->capacity - 1);
+    }
+    slots[index] = (struct LineSetSlot) { .hash = hash, .line = copy, .len = len };
+    set->count++;
+    return 1;
+}
+
+//Lines are compared without their newline
+static inline size_t content_length(const char *line, size_t len)
+{ return len > 0 and line[len - 1] == '\n' ? len - 1 : len; }
+
+//Goes through every line of `fd` from the top, stops early if `on_line` returns non-zero and returns that
+static int each_line(int fd, int (^on_line)(const char *line, size_t len, size_t index))
+{
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        perror("Error seeking file");
+        return -1;
+    }
+
+    __block struct LineReader reader;
+    line_reader_init(&reader, fd);
+    defer { line_reader_free(&reader); };
+
+    const char *data;
+    ssize_t len;
+    size_t index = 0;
+    while ((len = line_reader_next(&reader, &data)) > 0) {
+        for (const char *line = data, *end = data + len; line < end;) {
+            const char *newline = memchr(line, '\n', (size_t)(end - line));
+            size_t line_len = newline ? (size_t)(newline - line) + 1 : (size_t)(end - line);
+            int result = on_line(line, line_len, index++);
+            if (result != 0)
+                return result;
+            line += line_len;
+        }
+    }
+    if (len < 0) {
+        perror("Error reading file");
+        return -1;
+    }
+    return 0;
+}
+
+//Everything in one table, writing lines out as they're found to be new. 1 if it didn't fit in the limit
+static int dedupe_in_memory(int fd, FILE *out, size_t memory, size_t *kept, size_t *removed)
+{
+    __block struct LineSet set = { .limit = memory };
+    defer { line_set_free(&set); };
+
+    __block size_t kept_lines = 0, removed_lines = 0;
+    int result = each_line(fd, ^int(const char *line, size_t len, size_t) {
+        size_t content = content_length(line, len);
+        switch (line_set_add(&set, line, content, hash64(line, content, 0))) {
+        case 1:
+            kept_lines++;
+            if (fwrite(line, 1, len, out) != len) {
+                perror("Error writing deduplicated lines");
+                return -1;
+            }
+            return 0;
+        case 0:
+            removed_lines++;
+            return 0;
+        default:
+            return 1;
+        }
+    });
+
+    *kept = kept_lines;
+    *removed = removed_lines;
+    return result;
+}
+
+//What's written to a partition for each line, followed by the line itself
+struct PartitionRecord {
+    uint64_t index, hash, len;
+};
+
+//How many partitions of `size` bytes split into, with `open_files` partitions already open
+static size_t partitions_needed(size_t size, size_t memory, size_t open_files)
+{
+    size_t limit = MAX_PARTITIONS;
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 and files.rlim_cur < MAX_PARTITIONS + RESERVED_FILES) {
+        // with a really low limit, half of it is all that can be counted on
+        size_t reserved = files.rlim_cur / 2 < RESERVED_FILES ? (size_t)files.rlim_cur / 2 : RESERVED_FILES;
+        limit = (size_t)files.rlim_cur - reserved;
+    }
+    limit = limit > open_files + 2 ? limit - open_files : 2;
+
+    // half the budget per partition leaves room for the table and the arena's slack
+    size_t count = size / (memory / 2 > 0 ? memory / 2 : 1) + 1;
+    return count < 2 ? 2 : count > limit ? limit : count;
+}
+
+static void close_partitions(FILE *nullable *partitions, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (partitions[i])
+            fclose(partitions[i]);
+    }
+    free(partitions);
+}
+
+static FILE *nullable *nullable open_partitions(size_t count, const char *spill_path)
+{
+    FILE *nullable *partitions = $calloc(count, sizeof(FILE *));
+    for (size_t i = 0; i < count; i++) {
+        int partition_fd = open_temp_file(spill_path);
+        if (partition_fd >= 0 and (partitions[i] = fdopen(partition_fd, "w+b")) == nullptr) {
+            perror("Error opening temporary file");
+            close(partition_fd);
+        }
+        if (partitions[i] == nullptr) {
+            close_partitions(partitions, count);
+            return nullptr;
+        }
+    }
+    return partitions;
+}
+
+//Which of `count` partitions a line goes to at `depth`. The top half of the hash picks it, the bottom half is the slot
+//in its table. A partition split again gets the hash mixed with its depth, or every line would land in the same one
+static inline size_t partition_of(uint64_t hash, size_t depth, size_t count)
+{ return (size_t)((depth == 0 ? hash : hash64(&hash, sizeof(hash), depth)) >> 32) % count; }
+
+//Where the duplicates found so far are marked, by line index
+struct Duplicates {
+    uint64_t *bits;
+    size_t count;
+    char *nullable scratch;         // For reading lines back out of partitions
+    size_t scratch_size;
+};
+
+static int dedupe_partition(FILE *partition, size_t depth, size_t open_files, const char *spill_path, size_t memory, struct Duplicates *duplicates);
+
+//Reads the records of `partition` back from the top, stops early if `on_record` returns non-zero and returns that
+static int each_record(FILE *partition, struct Duplicates *duplicates,
+                       int (^on_record)(const struct PartitionRecord *record, const char *line))
+{
+    if (fflush(partition) != 0 or fseek(partition, 0, SEEK_SET) != 0) {
+        perror("Error reading temporary file");
+        return -1;
+    }
+
+    struct PartitionRecord record;
+    while (fread(&record, sizeof(record), 1, partition) == 1) {
+        if (record.len > duplicates->scratch_size) {
+            duplicates->scratch_size = record.len;
+            duplicates->scratch = $realloc(duplicates->scratch, duplicates->scratch_size);
+        }
+        char *line = $assert_nonnull(duplicates->scratch);
+        if (fread(line, 1, record.len, partition) != record.len) {
+            perror("Error reading temporary file");
+            return -1;
+        }
+        int result = on_record(&record, line);
+        if (result != 0)
+            return result;
+    }
+    if (ferror(partition)) {
+        perror("Error reading temporary file");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_record(FILE *partition, const struct PartitionRecord *record, const char *line)
+{
+    if (fwrite(record, sizeof(*record), 1, partition) != 1 or fwrite(line, 1, record->len, partition) != record->len) {
+        perror("Error writing temporary file");
+        return -1;
+    }
+    return 0;
+}
+
+//Splits the records of `partition` between new ones by hash, and deduplicates those one at a time
+static int split_partition(FILE *partition, size_t depth, size_t open_files, const char *spill_path, size_t memory,
+                           struct Duplicates *duplicates)
+{
+    long size;
+    if (fseek(partition, 0, SEEK_END) != 0 or (size = ftell(partition)) < 0) {
+        perror("Error reading temporary file");
+        return -1;
+    }
+    size_t count = partitions_needed((size_t)size, memory, open_files);
+    FILE *nullable *nullable opened = open_partitions(count, spill_path);
+    if (opened == nullptr)
+        return -1;
+    FILE *nullable *parts = opened;
+    defer { close_partitions(parts, count); };
+
+    int result = each_record(partition, duplicates, ^int(const struct PartitionRecord *record, const char *line) {
+        FILE *part = $assert_nonnull(parts[partition_of(record->hash, depth, count)]);
+        return write_record(part, record, line);
+    });
+    if (result != 0)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        FILE *part = $assert_nonnull(parts[i]);
+        if (dedupe_partition(part, depth, open_files + count - i, spill_path, memory, duplicates) != 0)
+            return -1;
+        // done with it, no point keeping the disk space
+        fclose(part);
+        parts[i] = nullptr;
+    }
+    return 0;
+}
+
+//Marks the duplicates among the lines of `partition`, splitting it again if its distinct lines don't fit in `memory`.
+//Past `MAX_PARTITION_DEPTH` (or with a partition that's small already) they're all kept in memory, whatever it takes
+static int dedupe_partition(FILE *partition, size_t depth, size_t open_files, const char *spill_path, size_t memory, struct Duplicates *duplicates)
+{
+    __block struct LineSet set = { .limit = depth < MAX_PARTITION_DEPTH ? memory : 0 };
+    defer { line_set_free(&set); };
+
+    struct Duplicates *marks = duplicates;
+    int result = each_record(partition, duplicates, ^int(const struct PartitionRecord *record, const char *line) {
+        switch (line_set_add(&set, line, record->len, record->hash)) {
+        case 0: {
+            // a partition that gets split again goes over some of these twice
+            uint64_t bit = 1ull << (record->index % 64);
+            marks->count += (marks->bits[record->index / 64] & bit) == 0;
+            marks->bits[record->index / 64] |= bit;
+            return 0;
+        }
+        case 1:
+            return 0;
+        default:
+            return 1;
+        }
+    });
+    if (result <= 0)
+        return result;
+
+    // a partition no bigger than the budget going over is down to the table and arena, splitting it wouldn't help
+    long size;
+    if (fseek(partition, 0, SEEK_END) != 0 or (size = ftell(partition)) < 0) {
+        perror("Error reading temporary file");
+        return -1;
+    }
+    if ((size_t)size > memory / 2)
+        return split_partition(partition, depth + 1, open_files, spill_path, memory, duplicates);
+    return dedupe_partition(partition, MAX_PARTITION_DEPTH, open_files, spill_path, memory, duplicates);
+}
+
+//Too big for one table: every line goes to one of several partitions by its hash, so all copies of a line end up in the
+//same one and each partition can be deduplicated on its own (split again if it's still too big). That marks which
+//lines to drop, and a last pass over the input writes everything else out in the original order
+static int dedupe_partitioned(int fd, FILE *out, const char *spill_path, size_t memory, size_t *kept, size_t *removed)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error checking file");
+        return -1;
+    }
+    size_t partition_count = partitions_needed((size_t)st.st_size, memory, 0);
+    FILE *nullable *nullable opened = open_partitions(partition_count, spill_path);
+    if (opened == nullptr)
+        return -1;
+    FILE *nullable *partitions = opened;
+    defer { close_partitions(partitions, partition_count); };
+
+    __block size_t line_count = 0;
+    int result = each_line(fd, ^int(const char *line, size_t len, size_t index) {
+        size_t content = content_length(line, len);
+        uint64_t hash = hash64(line, content, 0);
+        struct PartitionRecord record = { .index = index, .hash = hash, .len = content };
+        line_count++;
+        FILE *partition = $assert_nonnull(partitions[partition_of(hash, 0, partition_count)]);
+        return write_record(partition, &record, line);
+    });
+    if (result != 0) {
+        return -1;
+    }
+
+    uint64_t *duplicate_bits = $calloc(line_count / 64 + 1, sizeof(uint64_t));
+    struct Duplicates duplicates = { .bits = duplicate_bits };
+    defer {
+        free(duplicates.bits);
+        free(duplicates.scratch);
+    };
+
+    for (size_t i = 0; i < partition_count; i++) {
+        // lines were split evenly by hash, so a partition only goes over if a whole lot of distinct lines landed in it
+        FILE *partition = $assert_nonnull(partitions[i]);
+        if (dedupe_partition(partition, 0, partition_count - i, spill_path, memory, &duplicates) != 0)
+            return -1;
+
+        // done with it, no point keeping the disk space
+        fclose(partition);
+        partitions[i] = nullptr;
+    }
+
+    result = each_line(fd, ^int(const char *line, size_t len, size_t index) {
+        if (duplicate_bits[index / 64] & (1ull << (index % 64)))
+            return 0;
+        if (fwrite(line, 1, len, out) != len) {
+            perror("Error writing deduplicated lines");
+            return -1;
+        }
+        return 0;
+    });
+    if (result != 0) {
+        return -1;
+    }
+
+    *kept = line_count - duplicates.count;
+    *removed = duplicates.count;
+    return 0;
+}
+
+int dedupe_file(int fd, FILE *out, const char *spill_path, size_t memory, size_t *kept, size_t *removed)
+{
+    // most inputs fit (it's only the distinct lines that have to), so try that first and start over if they don't
+    int result = dedupe_in_memory(fd, out, memory, kept, removed);
+    if (result <= 0)
+        return result;
+
+    if (fflush(out) != 0 or ftruncate(fileno(out), 0) != 0 or fseek(out, 0, SEEK_SET) != 0) {
+        perror("Error rewinding output");
+        return -1;
+    }
+    return dedupe_partitioned(fd, out, spill_path, memory, kept, removed);
+}
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    DEDUPE_DEFAULT_MEMORY = 256 << 20,
+};
+
+//Copies `fd` to `out` leaving out every line that was already seen, so the first of each stays where it was. A missing
+//newline at the end doesn't make a line different. Works in about `memory` bytes, past that lines are split by hash
+//between temp files next to `spill_path` and deduplicated one file at a time
+int dedupe_file(int fd, FILE *out, const char *spill_path, size_t memory, size_t *kept, size_t *removed);
+
+#pragma clang assume_nonnull end
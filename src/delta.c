@@ -0,0 +1,130 @@
+#include "delta.h"
+#include "hash.h"
+#include "parallel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#   include <linux/limits.h>
+#else
+#   include <limits.h>
+#endif
+
+#pragma clang assume_nonnull begin
+
+static const char BLOCK_HASHES_MAGIC[8] = "TXBLOCK1";
+
+//What the sidecar starts with, followed by the hashes
+struct BlockHashesHeader {
+    char magic[8];
+    struct FileStamp stamp;
+    uint64_t block_size, block_count, digest;
+};
+
+void block_hashes_update(struct BlockHashes *hashes, const struct MappedFile *file, size_t first_block, size_t threads)
+{
+    size_t count = delta_block_count(file->size);
+    hashes->hashes = $realloc(hashes->hashes, (count ? count : 1) * sizeof(uint64_t));
+    hashes->count = count;
+
+    uint64_t *block_hashes = hashes->hashes;
+    if (first_block < count) {
+        parallel_for(count - first_block, threads, ^(size_t index) {
+            size_t block = first_block + index, offset = block * DELTA_BLOCK_SIZE;
+            size_t len = file->size - offset < DELTA_BLOCK_SIZE ? file->size - offset : DELTA_BLOCK_SIZE;
+            block_hashes[block] = hash64(&file->data[offset], len, 0);
+        });
+    }
+    // seeded with the size, so a file cut short at a block boundary doesn't look like its longer self
+    hashes->digest = hash64(block_hashes, count * sizeof(uint64_t), file->size);
+}
+
+void block_hashes_free(struct BlockHashes *hashes)
+{
+    free(hashes->hashes);
+    *hashes = (struct BlockHashes) {0};
+}
+
+int block_hashes_load(const char *filename, int fd, struct BlockHashes *hashes)
+{
+    *hashes = (struct BlockHashes) {0};
+
+    char hashes_filename[PATH_MAX];
+    get_block_hashes_filename(filename, hashes_filename, sizeof(hashes_filename));
+    int hashes_fd = open(hashes_filename, O_RDONLY | O_CLOEXEC);
+    if (hashes_fd < 0)
+        return -1; // not having one is normal
+    defer { close(hashes_fd); };
+
+    struct FileStamp stamp;
+    struct BlockHashesHeader header;
+    if (file_stamp(fd, &stamp) != 0 or read_all(hashes_fd, &header, sizeof(header)) != 0)
+        return -1;
+    if (memcmp(header.magic, BLOCK_HASHES_MAGIC, sizeof(header.magic)) != 0 or not file_stamp_equal(header.stamp, stamp)
+        or header.block_size != DELTA_BLOCK_SIZE or header.block_count != delta_block_count(stamp.size))
+        return -1;
+
+    uint64_t *block_hashes = $malloc((header.block_count ? header.block_count : 1) * sizeof(uint64_t));
+    if (read_all(hashes_fd, block_hashes, header.block_count * sizeof(uint64_t)) != 0) {
+        free(block_hashes);
+        return -1;
+    }
+
+    *hashes = (struct BlockHashes) { .hashes = block_hashes, .count = header.block_count, .digest = header.digest };
+    return 0;
+}
+
+int block_hashes_save(const char *filename, int fd, const struct BlockHashes *hashes)
+{
+    struct BlockHashesHeader header = { .block_size = DELTA_BLOCK_SIZE, .block_count = hashes->count, .digest = hashes->digest };
+    memcpy(header.magic, BLOCK_HASHES_MAGIC, sizeof(header.magic));
+    if (file_stamp(fd, &header.stamp) != 0)
+        return -1;
+
+    const uint64_t *block_hashes = $assert_nonnull(hashes->hashes);
+    struct iovec parts[] = {
+        { &header, sizeof(header) },
+        { (void *)block_hashes, hashes->count * sizeof(uint64_t) },
+    };
+    if (save_sidecar(filename, ".blocks", parts, sizeof(parts) / sizeof(*parts)) != 0) {
+        perror("Error writing block hashes");
+        return -1;
+    }
+    return 0;
+}
+
+int delta_apply(int fd, size_t dest_size, const struct MappedFile *source, bool (^same)(size_t block), struct DeltaInfo *info)
+{
+    size_t count = delta_block_count(source->size);
+    *info = (struct DeltaInfo) { .blocks = count };
+
+    for (size_t block = 0; block < count; block++) {
+        if (same(block))
+            continue;
+        size_t last = block;
+        while (last + 1 < count and not same(last + 1)) {
+            last++;
+        }
+
+        size_t offset = block * DELTA_BLOCK_SIZE, end = (last + 1) * DELTA_BLOCK_SIZE;
+        end = end < source->size ? end : source->size;
+        if (pwrite_all(fd, &source->data[offset], end - offset, (off_t)offset) != 0) {
+            perror("Error writing file");
+            return -1;
+        }
+        info->changed_blocks += last - block + 1;
+        info->written += end - offset;
+        block = last;
+    }
+
+    if (dest_size > source->size and ftruncate(fd, (off_t)source->size) != 0) {
+        perror("Error truncating file");
+        return -1;
+    }
+    return 0;
+}
+
+#pragma clang assume_nonnull end
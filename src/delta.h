@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    DELTA_BLOCK_SIZE = 64 << 10,        // What gets rewritten when anything in it changed
+};
+
+static inline void get_block_hashes_filename(const char *filename, char *hashes_filename, size_t size)
+{ snprintf(hashes_filename, size, "%s.blocks", filename); }
+
+static inline size_t delta_block_count(size_t size)
+{ return (size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE; }
+
+//`hash64` of every block of a file, and of all of those together. A `--delta` copy keeps them in a ".blocks" sidecar
+//next to the destination, so the next one only has to read the source
+struct BlockHashes {
+    uint64_t *nullable hashes;
+    size_t count;
+    uint64_t digest;
+};
+
+//Hashes the blocks of `file` from `first_block` on (in parallel), the ones before it are kept as they are
+void block_hashes_update(struct BlockHashes *hashes, const struct MappedFile *file, size_t first_block, size_t threads);
+void block_hashes_free(struct BlockHashes *hashes);
+//The ".blocks" sidecar of `filename`, -1 if there isn't one or the file (`fd`) changed since it was saved
+int block_hashes_load(const char *filename, int fd, struct BlockHashes *hashes);
+//Saves `hashes` as the ones of `filename` as it is right now (`fd`)
+int block_hashes_save(const char *filename, int fd, const struct BlockHashes *hashes);
+
+//What a delta copy did, for reporting
+struct DeltaInfo {
+    size_t blocks, changed_blocks;
+    uint64_t written;
+};
+
+//Makes `fd` (`dest_size` bytes long) the same as `source` by writing only the blocks `same` says aren't. Runs of
+//changed blocks go out in one `pwrite`
+int delta_apply(int fd, size_t dest_size, const struct MappedFile *source, bool (^same)(size_t block), struct DeltaInfo *info);
+
+#pragma clang assume_nonnull end
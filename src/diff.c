@@ -0,0 +1,478 @@
+#include "diff.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    DIFF_WINDOW = 256,          // Lines from each side looked at to begin with when the files stop matching
+    DIFF_SYNC_LINES = 16,       // How many matching lines in a row it takes to call the files back in sync
+    DIFF_MAX_COST = 4096,       // Give up on a minimal diff past this many edits in one go, and just take a good one
+};
+
+//How many bytes of whole lines `a` and `b` start with in common
+static size_t common_lines_forward(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t len = a_len < b_len ? a_len : b_len, n = 0;
+    // big blocks first, `memcmp` is vectorised already
+    while (n + 4096 <= len and memcmp(&a[n], &b[n], 4096) == 0) {
+        n += 4096;
+    }
+    while (n < len and a[n] == b[n]) {
+        n++;
+    }
+    if (n == a_len and n == b_len)
+        return n;
+
+    // back to the start of the line the difference is in
+    while (n > 0 and a[n - 1] != '\n') {
+        n--;
+    }
+    return n;
+}
+
+//Same from the back, `a` and `b` point right after the end
+static size_t common_lines_backward(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t len = a_len < b_len ? a_len : b_len, n = 0;
+    while (n + 4096 <= len and memcmp(a - n - 4096, b - n - 4096, 4096) == 0) {
+        n += 4096;
+    }
+    while (n < len and a[-(ptrdiff_t)n - 1] == b[-(ptrdiff_t)n - 1]) {
+        n++;
+    }
+
+    // forward to where a line starts in both
+    while (n > 0 and not ((n == a_len or a[-(ptrdiff_t)n - 1] == '\n') and (n == b_len or b[-(ptrdiff_t)n - 1] == '\n'))) {
+        n--;
+    }
+    return n;
+}
+
+struct InternSlot {
+    uint64_t hash;
+    const char *nullable line;
+    size_t len;
+    uint32_t id;
+};
+
+//Lines from both sides looked at together, turned into ids so that comparing two lines is comparing two numbers
+struct Window {
+    size_t *nullable a_offsets, *nullable b_offsets;    // Where each line starts, plus one for where the last one ends
+    uint32_t *nullable a_ids, *nullable b_ids;
+    bool *nullable deleted, *nullable inserted;
+    ptrdiff_t *nullable forward, *nullable backward;    // Furthest reaching paths, see `middle_snake`
+    struct InternSlot *nullable slots;
+    size_t a_capacity, b_capacity, slot_capacity;
+};
+
+static void window_free(struct Window *window)
+{
+    free(window->a_offsets);
+    free(window->b_offsets);
+    free(window->a_ids);
+    free(window->b_ids);
+    free(window->deleted);
+    free(window->inserted);
+    free(window->forward);
+    free(window->backward);
+    free(window->slots);
+    *window = (struct Window) {0};
+}
+
+//Finds where up to `max_lines` lines from `offset` start, stopping at `end`. Returns how many there are
+static size_t load_lines(const char *data, size_t offset, size_t end, size_t max_lines, size_t *offsets)
+{
+    size_t count = 0;
+    while (count < max_lines and offset < end) {
+        offsets[count++] = offset;
+        const char *newline = memchr(&data[offset], '\n', end - offset);
+        offset = newline ? (size_t)(newline - data) + 1 : end;
+    }
+    offsets[count] = offset;
+    return count;
+}
+
+static uint32_t intern(struct Window *window, uint32_t *next_id, const char *line, size_t len)
+{
+    uint64_t hash = hash64(line, len, 0);
+    struct InternSlot *slots = $assert_nonnull(window->slots);
+    size_t mask = window->slot_capacity - 1, index = hash & mask;
+    for (; slots[index].line != nullptr; index = (index + 1) & mask) {
+        if (slots[index].hash == hash and slots[index].len == len and memcmp(slots[index].line, line, len) == 0)
+            return slots[index].id;
+    }
+    slots[index] = (struct InternSlot) { .hash = hash, .line = line, .len = len, .id = (*next_id)++ };
+    return slots[index].id;
+}
+
+struct Myers {
+    const uint32_t *a, *b;
+    bool *deleted, *inserted;
+    ptrdiff_t *forward, *backward;
+};
+
+//Linear space Myers: walks the furthest reaching paths from both corners at once until they overlap, somewhere on an
+//optimal path. Only the ends of the paths are kept (one per diagonal), so the space is linear and the path itself is
+//recovered by recursing on both halves. Past `DIFF_MAX_COST` it settles for the forward path that got the furthest
+static void middle_snake(struct Myers *m, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi, size_t *split_a, size_t *split_b)
+{
+    const uint32_t *a = &m->a[a_lo], *b = &m->b[b_lo];
+    ptrdiff_t n = (ptrdiff_t)(a_hi - a_lo), mm = (ptrdiff_t)(b_hi - b_lo);
+    ptrdiff_t max_d = (n + mm + 1) / 2, offset = max_d, length = 2 * max_d;
+    ptrdiff_t *v1 = m->forward, *v2 = m->backward;
+    for (ptrdiff_t i = 0; i < length + 2; i++) {
+        v1[i] = v2[i] = -1;
+    }
+    v1[offset + 1] = v2[offset + 1] = 0;
+
+    // with an odd difference in length, the paths can only meet going forwards
+    ptrdiff_t delta = n - mm;
+    bool front = delta % 2 != 0;
+    ptrdiff_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+    ptrdiff_t best_x = 0, best_y = 0;
+
+    ptrdiff_t limit = max_d < DIFF_MAX_COST ? max_d : DIFF_MAX_COST;
+    for (ptrdiff_t d = 0; d < limit; d++) {
+        for (ptrdiff_t k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+            ptrdiff_t k1_offset = offset + k1;
+            ptrdiff_t x1 = k1 == -d or (k1 != d and v1[k1_offset - 1] < v1[k1_offset + 1]) ? v1[k1_offset + 1] : v1[k1_offset - 1] + 1;
+            ptrdiff_t y1 = x1 - k1;
+            while (x1 < n and y1 < mm and a[x1] == b[y1]) {
+                x1++;
+                y1++;
+            }
+            v1[k1_offset] = x1;
+
+            if (x1 > n) {
+                k1_end += 2;        // off the right
+            } else if (y1 > mm) {
+                k1_start += 2;      // off the bottom
+            } else {
+                if (x1 + y1 > best_x + best_y) {
+                    best_x = x1;
+                    best_y = y1;
+                }
+                ptrdiff_t k2_offset = offset + delta - k1;
+                if (front and k2_offset >= 0 and k2_offset < length and v2[k2_offset] != -1 and x1 >= n - v2[k2_offset]) {
+                    *split_a = a_lo + (size_t)x1;
+                    *split_b = b_lo + (size_t)y1;
+                    return;
+                }
+            }
+        }
+
+        for (ptrdiff_t k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+            ptrdiff_t k2_offset = offset + k2;
+            ptrdiff_t x2 = k2 == -d or (k2 != d and v2[k2_offset - 1] < v2[k2_offset + 1]) ? v2[k2_offset + 1] : v2[k2_offset - 1] + 1;
+            ptrdiff_t y2 = x2 - k2;
+            while (x2 < n and y2 < mm and a[n - x2 - 1] == b[mm - y2 - 1]) {
+                x2++;
+                y2++;
+            }
+            v2[k2_offset] = x2;
+
+            if (x2 > n) {
+                k2_end += 2;
+            } else if (y2 > mm) {
+                k2_start += 2;
+            } else if (not front) {
+                ptrdiff_t k1_offset = offset + delta - k2;
+                if (k1_offset >= 0 and k1_offset < length and v1[k1_offset] != -1) {
+                    ptrdiff_t x1 = v1[k1_offset], y1 = offset + x1 - k1_offset;
+                    if (x1 >= n - x2) {
+                        *split_a = a_lo + (size_t)x1;
+                        *split_b = b_lo + (size_t)y1;
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    // too expensive, any point on a path is a correct place to split, just maybe not the best one
+    *split_a = a_lo + (size_t)best_x;
+    *split_b = b_lo + (size_t)best_y;
+}
+
+static void myers(struct Myers *m, size_t a_lo, size_t a_hi, size_t b_lo, size_t b_hi)
+{
+    while (a_lo < a_hi and b_lo < b_hi and m->a[a_lo] == m->b[b_lo]) {
+        a_lo++;
+        b_lo++;
+    }
+    while (a_lo < a_hi and b_lo < b_hi and m->a[a_hi - 1] == m->b[b_hi - 1]) {
+        a_hi--;
+        b_hi--;
+    }
+
+    if (a_lo == a_hi or b_lo == b_hi) {
+        for (size_t i = a_lo; i < a_hi; i++) {
+            m->deleted[i] = true;
+        }
+        for (size_t i = b_lo; i < b_hi; i++) {
+            m->inserted[i] = true;
+        }
+        return;
+    }
+
+    size_t split_a, split_b;
+    middle_snake(m, a_lo, a_hi, b_lo, b_hi, &split_a, &split_b);
+    if ((split_a == a_lo and split_b == b_lo) or (split_a == a_hi and split_b == b_hi)) {
+        // no progress (only when it gave up on the very first step), the whole thing is a change
+        split_a = a_hi;
+        split_b = b_lo;
+    }
+    myers(m, a_lo, split_a, b_lo, split_b);
+    myers(m, split_a, a_hi, split_b, b_hi);
+}
+
+static void add_change(struct Diff *diff, struct DiffChange change)
+{
+    if (diff->count >= diff->capacity) {
+        diff->capacity = diff->capacity ? diff->capacity * 2 : 16;
+        diff->changes = $realloc(diff->changes, diff->capacity * sizeof(struct DiffChange));
+    }
+    struct DiffChange *changes = $assert_nonnull(diff->changes);
+    changes[diff->count++] = change;
+}
+
+//Where both files are after a window
+struct DiffPosition {
+    size_t a_offset, b_offset, a_line, b_line;
+};
+
+//Diffs the lines starting at `at` (which differ) until the files are back in sync, or until `a_end`/`b_end`.
+//The window starts small and doubles until that happens, so the memory only grows with the size of the change
+static void diff_window(struct Window *window, const struct MappedFile *a, size_t a_end, const struct MappedFile *b, size_t b_end,
+                        struct DiffPosition *at, struct Diff *diff)
+{
+    for (size_t lines = DIFF_WINDOW;; lines *= 2) {
+        if (lines + 1 > window->a_capacity) {
+            window->a_capacity = window->b_capacity = lines + 1;
+            window->a_offsets = $realloc(window->a_offsets, window->a_capacity * sizeof(size_t));
+            window->b_offsets = $realloc(window->b_offsets, window->b_capacity * sizeof(size_t));
+            window->a_ids = $realloc(window->a_ids, window->a_capacity * sizeof(uint32_t));
+            window->b_ids = $realloc(window->b_ids, window->b_capacity * sizeof(uint32_t));
+            window->deleted = $realloc(window->deleted, window->a_capacity * sizeof(bool));
+            window->inserted = $realloc(window->inserted, window->b_capacity * sizeof(bool));
+            window->forward = $realloc(window->forward, (2 * window->a_capacity + 2) * sizeof(ptrdiff_t));
+            window->backward = $realloc(window->backward, (2 * window->a_capacity + 2) * sizeof(ptrdiff_t));
+            window->slot_capacity = 1;
+            while (window->slot_capacity < 4 * lines) {
+                window->slot_capacity *= 2;
+            }
+            window->slots = $realloc(window->slots, window->slot_capacity * sizeof(struct InternSlot));
+        }
+        size_t *a_offsets = $assert_nonnull(window->a_offsets);
+        size_t *b_offsets = $assert_nonnull(window->b_offsets);
+        uint32_t *a_ids = $assert_nonnull(window->a_ids);
+        uint32_t *b_ids = $assert_nonnull(window->b_ids);
+        bool *deleted = $assert_nonnull(window->deleted);
+        bool *inserted = $assert_nonnull(window->inserted);
+
+        size_t na = load_lines(a->data, at->a_offset, a_end, lines, a_offsets),
+               nb = load_lines(b->data, at->b_offset, b_end, lines, b_offsets);
+        bool whole = a_offsets[na] == a_end and b_offsets[nb] == b_end;
+
+        struct InternSlot *slots = $assert_nonnull(window->slots);
+        memset(slots, 0, window->slot_capacity * sizeof(struct InternSlot));
+        uint32_t next_id = 0;
+        for (size_t i = 0; i < na; i++) {
+            a_ids[i] = intern(window, &next_id, &a->data[a_offsets[i]], a_offsets[i + 1] - a_offsets[i]);
+            deleted[i] = false;
+        }
+        for (size_t i = 0; i < nb; i++) {
+            b_ids[i] = intern(window, &next_id, &b->data[b_offsets[i]], b_offsets[i + 1] - b_offsets[i]);
+            inserted[i] = false;
+        }
+
+        struct Myers m = {
+            .a = a_ids, .b = b_ids,
+            .deleted = deleted, .inserted = inserted,
+        };
+        m.forward = $assert_nonnull(window->forward);
+        m.backward = $assert_nonnull(window->backward);
+        myers(&m, 0, na, 0, nb);
+
+        // the end of the window cuts the diff off at a random place, so only the part before a good long stretch of
+        // matching lines is trusted
+        size_t i = 0, j = 0, run = 0, cut_a = na, cut_b = nb;
+        bool synced = false;
+        while (i < na or j < nb) {
+            if (i < na and deleted[i]) {
+                i++;
+                run = 0;
+            } else if (j < nb and inserted[j]) {
+                j++;
+                run = 0;
+            } else {
+                if (run++ == 0) {
+                    cut_a = i;
+                    cut_b = j;
+                }
+                if (run == DIFF_SYNC_LINES) {
+                    synced = true;
+                    break;
+                }
+                i++;
+                j++;
+            }
+        }
+        if (not synced and not whole)
+            continue;
+        if (not synced and run == 0) {
+            cut_a = na;
+            cut_b = nb;
+        }
+
+        for (i = 0, j = 0; i < cut_a or j < cut_b;) {
+            if ((i < cut_a and deleted[i]) or (j < cut_b and inserted[j])) {
+                struct DiffChange change = {
+                    .a_line = at->a_line + i, .a_offset = a_offsets[i],
+                    .b_line = at->b_line + j, .b_offset = b_offsets[j],
+                };
+                for (; i < cut_a and deleted[i]; i++) {
+                    change.a_count++;
+                }
+                for (; j < cut_b and inserted[j]; j++) {
+                    change.b_count++;
+                }
+                add_change(diff, change);
+            } else {
+                i++;
+                j++;
+            }
+        }
+
+        *at = (struct DiffPosition) {
+            .a_offset = a_offsets[cut_a], .b_offset = b_offsets[cut_b],
+            .a_line = at->a_line + cut_a, .b_line = at->b_line + cut_b,
+        };
+        return;
+    }
+}
+
+void diff_files(const struct MappedFile *a, const struct MappedFile *b, struct Diff *diff)
+{
+    *diff = (struct Diff) {0};
+
+    // matching lines at the start and end never need to be looked at line by line
+    size_t prefix = common_lines_forward(a->data, a->size, b->data, b->size);
+    size_t suffix = common_lines_backward(a->data + a->size, a->size - prefix, b->data + b->size, b->size - prefix);
+    size_t a_end = a->size - suffix, b_end = b->size - suffix;
+
+    __block struct Window window = {0};
+    defer { window_free(&window); };
+
+    size_t lines = count_newlines(a->data, prefix);
+    struct DiffPosition at = { .a_offset = prefix, .b_offset = prefix, .a_line = lines, .b_line = lines };
+    while (at.a_offset < a_end or at.b_offset < b_end) {
+        // same trick between changes, skipping matching lines costs no more than a `memcmp`
+        size_t same = common_lines_forward(&a->data[at.a_offset], a_end - at.a_offset, &b->data[at.b_offset], b_end - at.b_offset);
+        if (same > 0) {
+            lines = count_newlines(&a->data[at.a_offset], same);
+            at.a_offset += same;
+            at.b_offset += same;
+            at.a_line += lines;
+            at.b_line += lines;
+            continue;
+        }
+        diff_window(&window, a, a_end, b, b_end, &at, diff);
+    }
+}
+
+void diff_free(struct Diff *diff)
+{
+    free(diff->changes);
+    *diff = (struct Diff) {0};
+}
+
+//Offset of the line `count` lines before the one at `offset`
+static size_t lines_before(const struct MappedFile *file, size_t offset, size_t count)
+{
+    for (; count > 0 and offset > 0; count--) {
+        offset--; // the newline ending the line before
+        while (offset > 0 and file->data[offset - 1] != '\n') {
+            offset--;
+        }
+    }
+    return offset;
+}
+
+//Offset of the line `count` lines after the one at `offset`, `skipped` is set to how many there actually were
+static size_t lines_after(const struct MappedFile *file, size_t offset, size_t count, size_t *nullable skipped)
+{
+    size_t i = 0;
+    for (; i < count and offset < file->size; i++) {
+        const char *newline = memchr(&file->data[offset], '\n', file->size - offset);
+        offset = newline ? (size_t)(newline - file->data) + 1 : file->size;
+    }
+    if (skipped)
+        *skipped = i;
+    return offset;
+}
+
+//Prints the line at `offset` with `prefix` in front, and returns where the next one starts
+static size_t print_line(FILE *out, char prefix, const struct MappedFile *file, size_t offset)
+{
+    const char *newline = memchr(&file->data[offset], '\n', file->size - offset);
+    size_t end = newline ? (size_t)(newline - file->data) + 1 : file->size;
+    fputc(prefix, out);
+    fwrite(&file->data[offset], 1, end - offset, out);
+    if (newline == nullptr)
+        fputs("\n\\ No newline at end of file\n", out);
+    return end;
+}
+
+static size_t print_lines(FILE *out, char prefix, const struct MappedFile *file, size_t offset, size_t count)
+{
+    for (size_t i = 0; i < count and offset < file->size; i++) {
+        offset = print_line(out, prefix, file, offset);
+    }
+    return offset;
+}
+
+static void print_range(FILE *out, char side, size_t start, size_t count)
+{
+    // an empty range is named after the line before it
+    fprintf(out, " %c%zu", side, count > 0 ? start + 1 : start);
+    if (count != 1)
+        fprintf(out, ",%zu", count);
+}
+
+void print_unified_diff(FILE *out, const char *a_name, const struct MappedFile *a, const char *b_name, const struct MappedFile *b,
+                        const struct Diff *diff, size_t context)
+{
+    if (diff->count == 0)
+        return;
+    const struct DiffChange *changes = $assert_nonnull(diff->changes);
+
+    fprintf(out, "--- %s\n+++ %s\n", a_name, b_name);
+    for (size_t first = 0, last; first < diff->count; first = last + 1) {
+        // changes close enough that their context would touch go in the same hunk
+        for (last = first; last + 1 < diff->count and changes[last + 1].a_line - (changes[last].a_line + changes[last].a_count) <= 2 * context; last++);
+
+        const struct DiffChange *start = &changes[first], *end = &changes[last];
+        size_t before = start->a_line < context ? start->a_line : context;
+        size_t after;
+        lines_after(a, lines_after(a, end->a_offset, end->a_count, nullptr), context, &after);
+
+        fputs("@@", out);
+        print_range(out, '-', start->a_line - before, end->a_line + end->a_count + after - (start->a_line - before));
+        print_range(out, '+', start->b_line - before, end->b_line + end->b_count + after - (start->b_line - before));
+        fputs(" @@\n", out);
+
+        print_lines(out, ' ', a, lines_before(a, start->a_offset, before), before);
+        for (size_t i = first; i <= last; i++) {
+            size_t a_offset = print_lines(out, '-', a, changes[i].a_offset, changes[i].a_count);
+            print_lines(out, '+', b, changes[i].b_offset, changes[i].b_count);
+            size_t common = i < last ? changes[i + 1].a_line - (changes[i].a_line + changes[i].a_count) : after;
+            print_lines(out, ' ', a, a_offset, common);
+        }
+    }
+}
+
+#pragma clang assume_nonnull end
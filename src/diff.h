@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    DIFF_CONTEXT = 3, // Unchanged lines shown around each change, same as `diff -u`
+};
+
+//A run of lines only in `a` (deleted) followed by a run of lines only in `b` (inserted), either can be empty.
+//Line numbers count from 0, offsets are where the runs start in the files
+struct DiffChange {
+    size_t a_line, a_count, a_offset,
+           b_line, b_count, b_offset;
+};
+
+struct Diff {
+    struct DiffChange *nullable changes;
+    size_t count, capacity;
+};
+
+//Finds the lines that differ between `a` and `b`. Memory use follows the size of the changes, not of the files
+void diff_files(const struct MappedFile *a, const struct MappedFile *b, struct Diff *diff);
+void diff_free(struct Diff *diff);
+//Unified diff, with `context` unchanged lines around each change
+void print_unified_diff(FILE *out, const char *a_name, const struct MappedFile *a, const char *b_name, const struct MappedFile *b,
+                        const struct Diff *diff, size_t context);
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,589 @@
+#if defined(__linux__)
+#   define _GNU_SOURCE // splice and F_SETPIPE_SZ
+#endif
+
+#include "fileio.h"
+#include "simd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#   include <sys/inotify.h>
+#   include <sys/sendfile.h>
+#else
+#   include <sys/event.h>
+#endif
+
+//fuck you linux! Just be posix compliant!!
+#if defined(__linux__)
+#   include <linux/limits.h>
+#else
+#   include <limits.h>
+#endif
+
+#pragma clang assume_nonnull begin
+
+int map_file(const char *filename, struct MappedFile *file)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return -1;
+    }
+    defer { close(fd); }; // the mapping sticks around without it
+
+    return map_fd(fd, file);
+}
+
+int map_fd(int fd, struct MappedFile *file)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error checking file");
+        return -1;
+    }
+
+    // `mmap` refuses to map nothing
+    if (st.st_size == 0) {
+        *file = (struct MappedFile) { .data = "", .size = 0 };
+        return 0;
+    }
+
+    void *data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return -1;
+    }
+    posix_madvise(data, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    *file = (struct MappedFile) { .data = data, .size = (size_t)st.st_size };
+    return 0;
+}
+
+void unmap_file(struct MappedFile *file)
+{
+    if (file->size > 0)
+        munmap((void *)file->data, file->size);
+    file->size = 0;
+}
+
+void line_reader_init(struct LineReader *reader, int fd)
+{ line_reader_init_sized(reader, fd, READ_BUFFER_SIZE); }
+
+void line_reader_init_sized(struct LineReader *reader, int fd, size_t capacity)
+{
+    *reader = (struct LineReader) {
+        .fd = fd,
+        .capacity = capacity > 0 ? capacity : 1,
+    };
+    reader->buffer = $malloc(reader->capacity);
+}
+
+void line_reader_reset(struct LineReader *reader, int fd)
+{
+    reader->fd = fd;
+    reader->start = reader->end = 0;
+    reader->offset = 0;
+    reader->eof = false;
+}
+
+void line_reader_free(struct LineReader *reader)
+{
+    free(reader->buffer);
+    reader->buffer = nullptr;
+}
+
+static const char *nullable last_newline(const char *data, size_t len)
+{
+    for (size_t i = len; i > 0; i--) {
+        if (data[i - 1] == '\n')
+            return &data[i - 1];
+    }
+    return nullptr;
+}
+
+ssize_t line_reader_next(struct LineReader *reader, const char *nonnull *nonnull data)
+{
+    char *buffer = $assert_nonnull(reader->buffer);
+
+    for (;;) {
+        //only scanning what we haven't looked at yet would be faster, but the last newline is almost always near the end anyway
+        size_t pending = reader->end - reader->start;
+        const char *newline = last_newline(&buffer[reader->start], pending);
+        if (newline != nullptr or (reader->eof and pending > 0 and not reader->hold_partial)) {
+            size_t len = newline ? (size_t)(newline - &buffer[reader->start]) + 1 : pending;
+            *data = &buffer[reader->start];
+            reader->start += len;
+            reader->offset += (off_t)len;
+            return (ssize_t)len;
+        }
+
+        if (reader->eof)
+            return 0;
+
+        // make room, only growing if a single line doesn't fit
+        if (reader->start > 0) {
+            memmove(buffer, &buffer[reader->start], pending);
+            reader->start = 0;
+            reader->end = pending;
+        }
+        if (reader->end == reader->capacity) {
+            reader->capacity *= 2;
+            buffer = reader->buffer = $realloc(buffer, reader->capacity);
+        }
+
+        ssize_t bytes = read(reader->fd, &buffer[reader->end], reader->capacity - reader->end);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes == 0)
+            reader->eof = true;
+        reader->end += (size_t)bytes;
+    }
+}
+
+bool is_stdin(const char *filename)
+{ return strcmp(filename, "-") == 0; }
+
+int open_input(const char *filename)
+{
+    if (not is_stdin(filename)) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            perror("Error opening file");
+        return fd;
+    }
+
+#if defined(__linux__)
+    // a pipe only holds 64K by default, so every `read` would come back with at most that much no matter the buffer.
+    // Only a hint, it's capped by /proc/sys/fs/pipe-max-size for unprivileged users
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 and S_ISFIFO(st.st_mode))
+        fcntl(STDIN_FILENO, F_SETPIPE_SZ, READ_BUFFER_SIZE);
+#endif
+    return STDIN_FILENO;
+}
+
+void close_input(int fd)
+{
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
+
+int scan_file(const char *filename, void (^on_data)(const char *data, size_t len))
+{
+    int fd = open_input(filename);
+    if (fd < 0)
+        return -1;
+    defer { close_input(fd); };
+
+    return scan_fd(fd, on_data);
+}
+
+int scan_fd(int fd, void (^on_data)(const char *data, size_t len))
+{
+    __block struct LineReader reader;
+    line_reader_init(&reader, fd);
+    defer { line_reader_free(&reader); };
+
+    const char *data;
+    ssize_t len;
+    while ((len = line_reader_next(&reader, &data)) > 0) {
+        on_data(data, (size_t)len);
+    }
+    if (len < 0) {
+        perror("Error reading file");
+        return -1;
+    }
+    return 0;
+}
+
+void for_each_line(const char *data, size_t len, void (^on_line)(const char *line, size_t len))
+{
+    const char *end = data + len;
+    for (const char *line = data; line < end;) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        size_t line_len = newline ? (size_t)(newline - line) + 1 : (size_t)(end - line);
+        on_line(line, line_len);
+        line += line_len;
+    }
+}
+
+size_t count_newlines(const char *data, size_t len)
+{ return count_byte(data, len, '\n'); }
+
+size_t count_byte(const char *data, size_t len, char byte)
+{
+    // per-lane counters, emptied before they can overflow
+    size_t count = 0, i = 0;
+    simd_bytes counters = {0};
+    for (size_t blocks = 0; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        counters -= simd_eq(simd_load(&data[i]), (uint8_t)byte); // matches are 0xFF, i.e. -1
+        if (++blocks == 255) {
+            count += simd_sum(counters);
+            counters = (simd_bytes){0};
+            blocks = 0;
+        }
+    }
+    count += simd_sum(counters);
+
+    for (; i < len; i++) {
+        count += data[i] == byte;
+    }
+    return count;
+}
+
+int file_stamp(int fd, struct FileStamp *stamp)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error checking file");
+        return -1;
+    }
+#if defined(__linux__)
+    struct timespec mtime = st.st_mtim;
+#else
+    struct timespec mtime = st.st_mtimespec;
+#endif
+    *stamp = (struct FileStamp) { .size = (uint64_t)st.st_size, .mtime_sec = mtime.tv_sec, .mtime_nsec = mtime.tv_nsec };
+    return 0;
+}
+
+int open_temp_file(const char *near)
+{
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s.tmp.XXXXXX", near);
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("Error creating temporary file");
+        return -1;
+    }
+    unlink(filename);
+    return fd;
+}
+
+int save_sidecar(const char *filename, const char *suffix, const struct iovec *iov, size_t count)
+{
+    char sidecar_filename[PATH_MAX], tmp_filename[PATH_MAX];
+    snprintf(sidecar_filename, sizeof(sidecar_filename), "%s%s", filename, suffix);
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s%s.XXXXXX", filename, suffix);
+    int fd = mkstemp(tmp_filename);
+    if (fd < 0)
+        return -1;
+
+    int result = 0;
+    for (size_t i = 0; i < count and result == 0; i++) {
+        result = write_all(fd, iov[i].iov_base, iov[i].iov_len);
+    }
+    if (close(fd) != 0 or result != 0 or rename(tmp_filename, sidecar_filename) != 0) {
+        int error = errno;
+        unlink(tmp_filename);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        bytes += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+int pwrite_all(int fd, const void *data, size_t len, off_t offset)
+{
+    const char *bytes = data;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, bytes, len, offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        bytes += written;
+        len -= (size_t)written;
+        offset += written;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *data, size_t len)
+{
+    char *bytes = data;
+    while (len > 0) {
+        ssize_t got = read(fd, bytes, len);
+        if (got < 0 and errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        bytes += got;
+        len -= (size_t)got;
+    }
+    return 0;
+}
+
+int copy_fd(int in_fd, int out_fd)
+{
+#if defined(__linux__)
+    // the kernel moves the pages itself: `sendfile` out of a regular file, `splice` when either end is a pipe. Anything
+    // they won't take (a terminal, mostly) falls through to the plain loop, from wherever they got to
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == 0 and fstat(out_fd, &out_st) == 0) {
+        bool to_file = S_ISREG(out_st.st_mode) or S_ISFIFO(out_st.st_mode) or S_ISSOCK(out_st.st_mode),
+             use_sendfile = S_ISREG(in_st.st_mode) and to_file,
+             use_splice = not use_sendfile and (S_ISFIFO(in_st.st_mode) or S_ISFIFO(out_st.st_mode));
+        while (use_sendfile or use_splice) {
+            ssize_t moved = use_sendfile ? sendfile(out_fd, in_fd, nullptr, 1 << 30)
+                                         : splice(in_fd, nullptr, out_fd, nullptr, 1 << 30, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved == 0)
+                return 0;
+            if (moved < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EINVAL and errno != ENOSYS)
+                    return -1;
+                break;
+            }
+        }
+    }
+#endif
+
+    char *buffer = $malloc(READ_BUFFER_SIZE);
+    defer { free(buffer); };
+    for (;;) {
+        ssize_t bytes = read(in_fd, buffer, READ_BUFFER_SIZE);
+        if (bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes == 0)
+            return 0;
+        if (write_all(out_fd, buffer, (size_t)bytes) != 0)
+            return -1;
+    }
+}
+
+//Blocks until something happened to the file or its directory that might need a look
+struct FileWatch {
+#if defined(__linux__)
+    int fd, file_wd, dir_wd;
+#else
+    int kq, file_fd, dir_fd;
+#endif
+    char basename[NAME_MAX + 1];
+};
+
+static int watch_file(struct FileWatch *watch, const char *filename)
+{
+#if defined(__linux__)
+    if (watch->file_wd >= 0)
+        inotify_rm_watch(watch->fd, watch->file_wd); //fails if the file is already gone, that's fine
+    watch->file_wd = inotify_add_watch(watch->fd, filename, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
+    return watch->file_wd < 0 ? -1 : 0;
+#else
+    if (watch->file_fd >= 0)
+        close(watch->file_fd);
+    watch->file_fd = open(filename, O_RDONLY);
+    if (watch->file_fd < 0)
+        return -1;
+
+    struct kevent change;
+    EV_SET(&change, watch->file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_RENAME | NOTE_DELETE, 0, nullptr);
+    return kevent(watch->kq, &change, 1, nullptr, 0, nullptr) < 0 ? -1 : 0;
+#endif
+}
+
+static int watch_open(struct FileWatch *watch, const char *filename)
+{
+    //`dirname` and `basename` are allowed to scribble over their argument
+    char path[PATH_MAX], directory[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", filename);
+    snprintf(watch->basename, sizeof(watch->basename), "%s", basename(path));
+    snprintf(path, sizeof(path), "%s", filename);
+    snprintf(directory, sizeof(directory), "%s", dirname(path));
+
+#if defined(__linux__)
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd < 0)
+        return -1;
+    watch->file_wd = -1;
+    // the directory is watched so we notice a rotated file coming back
+    watch->dir_wd = inotify_add_watch(watch->fd, directory, IN_CREATE | IN_MOVED_TO);
+    if (watch->dir_wd < 0) {
+        close(watch->fd);
+        return -1;
+    }
+#else
+    watch->kq = kqueue();
+    if (watch->kq < 0)
+        return -1;
+    watch->file_fd = -1;
+    watch->dir_fd = open(directory, O_RDONLY);
+    if (watch->dir_fd < 0) {
+        close(watch->kq);
+        return -1;
+    }
+
+    struct kevent change;
+    EV_SET(&change, watch->dir_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, nullptr);
+    if (kevent(watch->kq, &change, 1, nullptr, 0, nullptr) < 0) {
+        close(watch->dir_fd);
+        close(watch->kq);
+        return -1;
+    }
+#endif
+
+    if (watch_file(watch, filename) != 0) {
+#if defined(__linux__)
+        close(watch->fd);
+#else
+        close(watch->dir_fd);
+        close(watch->kq);
+#endif
+        return -1;
+    }
+    return 0;
+}
+
+static void watch_close(struct FileWatch *watch)
+{
+#if defined(__linux__)
+    close(watch->fd);
+#else
+    if (watch->file_fd >= 0)
+        close(watch->file_fd);
+    close(watch->dir_fd);
+    close(watch->kq);
+#endif
+}
+
+static int watch_wait(struct FileWatch *watch)
+{
+#if defined(__linux__)
+    _Alignas(struct inotify_event) char events[4096];
+    for (;;) {
+        ssize_t len = read(watch->fd, events, sizeof(events));
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // other files coming and going in the same directory are none of our business
+        for (ssize_t i = 0; i < len;) {
+            const struct inotify_event *event = (const struct inotify_event *)&events[i];
+            if (event->wd != watch->dir_wd or (event->len > 0 and strcmp(event->name, watch->basename) == 0))
+                return 0;
+            i += (ssize_t)(sizeof(struct inotify_event) + event->len);
+        }
+    }
+#else
+    struct kevent event;
+    for (;;) {
+        int n = kevent(watch->kq, nullptr, 0, &event, 1, nullptr);
+        if (n < 0 and errno == EINTR)
+            continue;
+        return n < 0 ? -1 : 0;
+    }
+#endif
+}
+
+int follow_file(const char *filename, bool whole_lines, struct FollowHandlers handlers)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    // `__block` so the deferred cleanup sees the watch/reader as they are at the end, not as they were when captured
+    __block struct FileWatch watch;
+    if (watch_open(&watch, filename) != 0) {
+        perror("Error watching file");
+        close(fd);
+        return -1;
+    }
+    defer { watch_close(&watch); };
+
+    __block struct LineReader reader;
+    line_reader_init(&reader, fd);
+    reader.hold_partial = whole_lines;
+    defer {
+        close(reader.fd);
+        line_reader_free(&reader);
+    };
+
+    for (;;) {
+        const char *data;
+        ssize_t len;
+        while ((len = line_reader_next(&reader, &data)) > 0) {
+            handlers.on_data(data, (size_t)len);
+        }
+        if (len < 0) {
+            perror("Error reading file");
+            return -1;
+        }
+        if (handlers.on_idle)
+            handlers.on_idle();
+
+        // sleeps in `read`/`kevent`, so no CPU gets burnt while nothing happens
+        if (watch_wait(&watch) != 0) {
+            perror("Error waiting for file changes");
+            return -1;
+        }
+        reader.eof = false;
+
+        struct stat by_fd, by_path;
+        if (fstat(reader.fd, &by_fd) != 0) {
+            perror("Error checking file");
+            return -1;
+        }
+        if (stat(filename, &by_path) != 0) {
+            continue; // rotated away and not back yet, the directory watch will wake us up when it is
+        }
+
+        if (by_path.st_ino != by_fd.st_ino or by_path.st_dev != by_fd.st_dev) {
+            // whatever got written to the old file before it was replaced still counts
+            while ((len = line_reader_next(&reader, &data)) > 0) {
+                handlers.on_data(data, (size_t)len);
+            }
+
+            int new_fd = open(filename, O_RDONLY);
+            if (new_fd < 0) {
+                continue; // lost a race with another rotation, try again on the next event
+            }
+            close(reader.fd);
+            line_reader_reset(&reader, new_fd);
+            watch_file(&watch, filename);
+            if (handlers.on_restart)
+                handlers.on_restart();
+        } else if (by_fd.st_size < lseek(reader.fd, 0, SEEK_CUR)) {
+            lseek(reader.fd, 0, SEEK_SET);
+            line_reader_reset(&reader, reader.fd);
+            if (handlers.on_restart)
+                handlers.on_restart();
+        }
+    }
+}
+
+#pragma clang assume_nonnull end
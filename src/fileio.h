@@ -0,0 +1,98 @@
+#pragma once
+
+#include "common.h"
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    READ_BUFFER_SIZE = 1 << 20, // Big reads, `fgets` sized ones are what made everything slow
+};
+
+//A whole file mapped read-only, for when random access or splitting it between threads is worth it
+struct MappedFile {
+    const char *data;
+    size_t size;
+};
+
+int map_file(const char *filename, struct MappedFile *file);
+int map_fd(int fd, struct MappedFile *file);
+void unmap_file(struct MappedFile *file);
+
+//Buffered reader that hands out runs of whole lines, no matter how long the lines are
+struct LineReader {
+    int fd;
+    char *nullable buffer;
+    size_t capacity, start, end;
+    off_t offset;               // How many bytes have been handed out so far
+    bool eof,
+         hold_partial;          // Keep an unterminated last line in the buffer at EOF instead of handing it out (for files still being written)
+};
+
+void line_reader_init(struct LineReader *reader, int fd);
+//For when there are a lot of readers at once, it still grows if a line doesn't fit
+void line_reader_init_sized(struct LineReader *reader, int fd, size_t capacity);
+//Throws away anything buffered and starts reading `fd` from its current position
+void line_reader_reset(struct LineReader *reader, int fd);
+void line_reader_free(struct LineReader *reader);
+//Points `data` at one or more complete lines. Returns the length, 0 at EOF and -1 on errors
+ssize_t line_reader_next(struct LineReader *reader, const char *nonnull *nonnull data);
+
+//"-" means stdin, for commands that only read
+bool is_stdin(const char *filename);
+//Opens `filename` for reading, or hands back stdin for "-". Prints why and returns -1 if it can't be opened
+int open_input(const char *filename);
+//Closes whatever `open_input` opened, stdin stays open
+void close_input(int fd);
+
+//Runs `on_data` over the whole file (or stdin, for "-"), a run of complete lines at a time
+int scan_file(const char *filename, void (^on_data)(const char *data, size_t len));
+//Same, for an already open file, starting wherever its offset is
+int scan_fd(int fd, void (^on_data)(const char *data, size_t len));
+//Splits a run from `scan_file` and friends into single lines, newline included (if there is one)
+void for_each_line(const char *data, size_t len, void (^on_line)(const char *line, size_t len));
+size_t count_newlines(const char *data, size_t len);
+size_t count_byte(const char *data, size_t len, char byte);
+
+//What a file looked like when something derived from it (an index next to it) was made, if either changed it's stale
+struct FileStamp {
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+};
+
+int file_stamp(int fd, struct FileStamp *stamp);
+static inline bool file_stamp_equal(struct FileStamp a, struct FileStamp b)
+{ return a.size == b.size and a.mtime_sec == b.mtime_sec and a.mtime_nsec == b.mtime_nsec; }
+
+//Anonymous temp file in the same directory as `near`, it's gone as soon as it's closed. For spilling to disk
+int open_temp_file(const char *near);
+//Writes `count` pieces of data to the `suffix` sidecar of `filename` ("x.txt" + ".lines" and so on). It's written on the
+//side and renamed over, so a reader never sees half of one. -1 with errno set if that doesn't work out
+int save_sidecar(const char *filename, const char *suffix, const struct iovec *iov, size_t count);
+
+//`write` until everything is written, returns -1 with errno set if that doesn't work out
+int write_all(int fd, const void *data, size_t len);
+//Same, at `offset` without moving the file offset
+int pwrite_all(int fd, const void *data, size_t len, off_t offset);
+//`read` until `len` bytes have been read, -1 if that doesn't work out (EOF before then included)
+int read_all(int fd, void *data, size_t len);
+
+//Copies everything from `in_fd`'s offset on to `out_fd`, without going through a buffer here when the kernel can do it
+//(Linux `sendfile`/`splice`). Returns -1 with errno set if reading or writing fails
+int copy_fd(int in_fd, int out_fd);
+
+//Things a followed file can do, see `follow_file`
+struct FollowHandlers {
+    void (^on_data)(const char *data, size_t len);
+    void (^nullable on_idle)(void);     // Everything has been processed, about to go to sleep
+    void (^nullable on_restart)(void);  // File was truncated or replaced, start counting from scratch
+};
+
+//Feeds the whole file to `on_data`, then sleeps until it grows and feeds only the appended bytes.
+//Truncation and rotation (the path pointing to a new inode) restart from the beginning.
+//Only returns on errors.
+int follow_file(const char *filename, bool whole_lines, struct FollowHandlers handlers);
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,87 @@
+#include "hash.h"
+
+#include <string.h>
+
+#pragma clang assume_nonnull begin
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL,
+                      PRIME2 = 0xC2B2AE3D27D4EB4FULL,
+                      PRIME3 = 0x165667B19E3779F9ULL,
+                      PRIME4 = 0x85EBCA77C2B2AE63ULL,
+                      PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int bits)
+{ return (x << bits) | (x >> (64 - bits)); }
+
+//Unaligned little-endian reads
+static inline uint64_t read64(const uint8_t *data)
+{
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+static inline uint32_t read32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{ return rotl(acc + input * PRIME2, 31) * PRIME1; }
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t value)
+{ return (acc ^ round64(0, value)) * PRIME1 + PRIME4; }
+
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + len;
+    uint64_t hash;
+
+    if (len >= 32) {
+        // four independent lanes, so the CPU can work on all of them at once
+        uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed, v4 = seed - PRIME1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+        }
+        hash = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        hash = merge_round(hash, v1);
+        hash = merge_round(hash, v2);
+        hash = merge_round(hash, v3);
+        hash = merge_round(hash, v4);
+    } else {
+        hash = seed + PRIME5;
+    }
+    hash += len;
+
+    for (; p + 8 <= end; p += 8) {
+        hash = rotl(hash ^ round64(0, read64(p)), 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        hash = rotl(hash ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = rotl(hash ^ (*p * PRIME5), 11) * PRIME1;
+    }
+
+    // avalanche, so every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+//64-bit non-cryptographic hash (the XXH64 algorithm). Fast on long inputs, and good enough to use as a fingerprint
+//as long as a match is double-checked against the real bytes
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+#pragma clang assume_nonnull end
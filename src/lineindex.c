@@ -0,0 +1,140 @@
+#include "lineindex.h"
+#include "parallel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#   include <linux/limits.h>
+#else
+#   include <limits.h>
+#endif
+
+#pragma clang assume_nonnull begin
+
+static const char LINE_INDEX_MAGIC[8] = "TXLINES1";
+
+//What the sidecar starts with, followed by the counts
+struct LineIndexHeader {
+    char magic[8];
+    struct FileStamp stamp;
+    uint64_t chunk_size, chunk_count;
+};
+
+int line_index_build(int fd, const struct MappedFile *file, size_t threads, struct LineIndex *index)
+{
+    *index = (struct LineIndex) {0};
+    if (file_stamp(fd, &index->stamp) != 0)
+        return -1;
+
+    size_t chunk_count = (file->size + LINE_INDEX_CHUNK_SIZE - 1) / LINE_INDEX_CHUNK_SIZE;
+    uint64_t *before = $calloc(chunk_count + 1, sizeof(uint64_t));
+    parallel_for(chunk_count, threads, ^(size_t chunk) {
+        size_t offset = chunk * LINE_INDEX_CHUNK_SIZE;
+        size_t len = file->size - offset < LINE_INDEX_CHUNK_SIZE ? file->size - offset : LINE_INDEX_CHUNK_SIZE;
+        before[chunk + 1] = count_newlines(&file->data[offset], len);
+    });
+    for (size_t chunk = 1; chunk <= chunk_count; chunk++) {
+        before[chunk] += before[chunk - 1];
+    }
+
+    index->newlines_before = before;
+    index->chunk_count = chunk_count;
+    return 0;
+}
+
+void line_index_free(struct LineIndex *index)
+{
+    free(index->newlines_before);
+    *index = (struct LineIndex) {0};
+}
+
+int line_index_find(const struct LineIndex *index, const struct MappedFile *file, size_t line_number, size_t *offset, size_t *len)
+{
+    if (line_number == 0)
+        return -1;
+
+    // line N starts right after newline N - 1
+    size_t start = 0;
+    uint64_t skip = line_number - 1;
+    if (skip > 0) {
+        const uint64_t *before = $assert_nonnull(index->newlines_before);
+        if (skip > before[index->chunk_count])
+            return -1;
+
+        // the first chunk with newline `skip` in it
+        size_t low = 0, high = index->chunk_count - 1;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (before[middle + 1] >= skip)
+                high = middle;
+            else
+                low = middle + 1;
+        }
+
+        const char *pos = &file->data[low * LINE_INDEX_CHUNK_SIZE], *end = file->data + file->size;
+        for (uint64_t left = skip - before[low];; left--) {
+            pos = (const char *)memchr(pos, '\n', (size_t)(end - pos)) + 1;
+            if (left == 1)
+                break;
+        }
+        start = (size_t)(pos - file->data);
+    }
+    // a trailing newline ends the last line, it doesn't start another one
+    if (start >= file->size)
+        return -1;
+
+    const char *newline = memchr(&file->data[start], '\n', file->size - start);
+    *offset = start;
+    *len = newline ? (size_t)(newline - &file->data[start]) + 1 : file->size - start;
+    return 0;
+}
+
+int line_index_load(const char *filename, int fd, struct LineIndex *index)
+{
+    *index = (struct LineIndex) {0};
+
+    char index_filename[PATH_MAX];
+    get_line_index_filename(filename, index_filename, sizeof(index_filename));
+    int index_fd = open(index_filename, O_RDONLY | O_CLOEXEC);
+    if (index_fd < 0)
+        return -1; // not having one is normal
+    defer { close(index_fd); };
+
+    struct FileStamp stamp;
+    struct LineIndexHeader header;
+    if (file_stamp(fd, &stamp) != 0 or read_all(index_fd, &header, sizeof(header)) != 0)
+        return -1;
+    if (memcmp(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic)) != 0 or not file_stamp_equal(header.stamp, stamp)
+        or header.chunk_size != LINE_INDEX_CHUNK_SIZE or header.chunk_count != (stamp.size + LINE_INDEX_CHUNK_SIZE - 1) / LINE_INDEX_CHUNK_SIZE)
+        return -1;
+
+    uint64_t *before = $malloc((header.chunk_count + 1) * sizeof(uint64_t));
+    if (read_all(index_fd, before, (header.chunk_count + 1) * sizeof(uint64_t)) != 0) {
+        free(before);
+        return -1;
+    }
+
+    *index = (struct LineIndex) { .stamp = stamp, .newlines_before = before, .chunk_count = header.chunk_count };
+    return 0;
+}
+
+int line_index_save(const char *filename, const struct LineIndex *index)
+{
+    struct LineIndexHeader header = { .stamp = index->stamp, .chunk_size = LINE_INDEX_CHUNK_SIZE, .chunk_count = index->chunk_count };
+    memcpy(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic));
+    const uint64_t *before = $assert_nonnull(index->newlines_before);
+    struct iovec parts[] = {
+        { &header, sizeof(header) },
+        { (void *)before, (index->chunk_count + 1) * sizeof(uint64_t) },
+    };
+    if (save_sidecar(filename, ".lines", parts, sizeof(parts) / sizeof(*parts)) != 0) {
+        perror("Error writing line index");
+        return -1;
+    }
+    return 0;
+}
+
+#pragma clang assume_nonnull end
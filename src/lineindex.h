@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    LINE_INDEX_CHUNK_SIZE = 4 << 20,    // Counting one is well under a millisecond, so that's the most a lookup ever scans
+};
+
+static inline void get_line_index_filename(const char *filename, char *index_filename, size_t size)
+{ snprintf(index_filename, size, "%s.lines", filename); }
+
+//How many newlines come before each fixed-size chunk of a file. Finding line N is a binary search for its chunk and
+//a scan of just that chunk
+struct LineIndex {
+    struct FileStamp stamp;             // The file it was made from
+    uint64_t *nullable newlines_before; // `chunk_count + 1` of them, the last is the total
+    size_t chunk_count;
+};
+
+//Counts every chunk of `file` (mapped from `fd`) in parallel
+int line_index_build(int fd, const struct MappedFile *file, size_t threads, struct LineIndex *index);
+void line_index_free(struct LineIndex *index);
+//Where line `line_number` (from 1) starts in `file` and how long it is, newline included. -1 if there's no such line
+int line_index_find(const struct LineIndex *index, const struct MappedFile *file, size_t line_number, size_t *offset, size_t *len);
+//The ".lines" sidecar of `filename`, -1 if there isn't one or it's for an older version of the file (`fd`)
+int line_index_load(const char *filename, int fd, struct LineIndex *index);
+int line_index_save(const char *filename, const struct LineIndex *index);
+
+#pragma clang assume_nonnull end
@@ -17,6 +17,9 @@ Example:
     ./main find test.txt "search string"
     ./main trim test.txt
     ./main changelog test.txt
+    ./main line-count test.log --follow
+    ./main pipe test.log "trim | find error | line-count"
+    ./main find test.txt -- -i          (searches for "-i", anything after -- is never a flag)
 */
 
 int main(int argc, const char *argv[])
@@ -34,16 +37,12 @@ int main(int argc, const char *argv[])
         return 1;
     }
 
-    size_t expected_params = 0;
-    while (cmd->parameters[expected_params].name) {
-        expected_params++;
-    }
-
-    if ((argc - 2) < (int)expected_params) {
-        fprintf(stderr, "Insufficient parameters for command '%s'.\n", command_name);
+    // flags and options are allowed anywhere, but actions want their positional parameters first
+    size_t arg_len = (size_t)argc - 2, param_len;
+    const char *params[arg_len + 1];
+    if (arrange_params(cmd, arg_len, &argv[2], &param_len, params) != 0) {
         return 1;
     }
 
-    return cmd->action(argc - 2, &argv[2]);
+    return cmd->action(param_len, params);
 }
-
@@ -0,0 +1,127 @@
+#include "normalize.h"
+#include "simd.h"
+#include "utf8.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma clang assume_nonnull begin
+
+static const char BOM[3] = "\xEF\xBB\xBF";
+
+struct Normalizer {
+    const struct NormalizeOptions *options;
+    const char *data;
+    size_t len;
+    struct NormalizeCounts *counts;
+    void (^on_fix)(size_t offset, size_t len, const char *replacement, size_t replacement_len);
+    const char *spaces;                 // `tab_width` of them
+    size_t column_from, column;         // Which character of its line `column_from` is, tabs expanded
+};
+
+//Deals with one of the bytes that can need fixing
+static void fix_byte(struct Normalizer *n, size_t i)
+{
+    const struct NormalizeOptions *options = n->options;
+    switch (n->data[i]) {
+    case '\r':
+        // a lone \r isn't a line ending, it's left alone
+        if (i + 1 < n->len and n->data[i + 1] == '\n') {
+            n->on_fix(i, 1, "", 0);
+            n->counts->crlf_to_lf++;
+        }
+        break;
+    case '\n':
+        if (options->lf_to_crlf and (i == 0 or n->data[i - 1] != '\r')) {
+            n->on_fix(i, 0, "\r", 1);
+            n->counts->lf_to_crlf++;
+        }
+        n->column_from = i + 1;
+        n->column = 0;
+        break;
+    case '\t': {
+        n->column += utf8_length(&n->data[n->column_from], i - n->column_from);
+        size_t width = options->tab_width - n->column % options->tab_width;
+        n->on_fix(i, 1, n->spaces, width);
+        n->counts->tabs++;
+        n->column += width;
+        n->column_from = i + 1;
+        break;
+    }
+    }
+}
+
+void normalize(const struct NormalizeOptions *options, const char *data, size_t len, struct NormalizeCounts *counts,
+               void (^on_fix)(size_t offset, size_t len, const char *replacement, size_t replacement_len))
+{
+    *counts = (struct NormalizeCounts) {0};
+
+    // a BOM isn't part of the first line, even when it stays
+    size_t start = 0;
+    if (len >= sizeof(BOM) and memcmp(data, BOM, sizeof(BOM)) == 0) {
+        start = sizeof(BOM);
+        if (options->strip_bom) {
+            on_fix(0, sizeof(BOM), "", 0);
+            counts->boms++;
+        }
+    }
+
+    char *spaces = $malloc(options->tab_width + 1);
+    memset(spaces, ' ', options->tab_width);
+    defer { free(spaces); };
+    struct Normalizer n = {
+        .options = options, .data = data, .len = len, .counts = counts, .on_fix = on_fix, .spaces = spaces,
+        .column_from = start,
+    };
+
+    // the bytes worth stopping at, with the first repeated to fill the rest of the slots
+    uint8_t special[3];
+    size_t special_count = 0;
+    if (options->crlf_to_lf)
+        special[special_count++] = '\r';
+    if (options->lf_to_crlf or options->tab_width > 0)
+        special[special_count++] = '\n';
+    if (options->tab_width > 0)
+        special[special_count++] = '\t';
+
+    if (special_count > 0) {
+        for (size_t i = special_count; i < sizeof(special); i++) {
+            special[i] = special[0];
+        }
+
+        size_t i = start;
+        for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+            simd_bytes v = simd_load(&data[i]);
+            uint32_t found = simd_mask(simd_eq(v, special[0]) | simd_eq(v, special[1]) | simd_eq(v, special[2]));
+            for (; found; found &= found - 1) {
+                fix_byte(&n, i + (size_t)__builtin_ctz(found));
+            }
+        }
+        for (; i < len; i++) {
+            uint8_t c = (uint8_t)data[i];
+            if (c == special[0] or c == special[1] or c == special[2])
+                fix_byte(&n, i);
+        }
+    }
+
+    if (options->final_newline and len > start and data[len - 1] != '\n') {
+        // same ending as the other lines, unless they're all being changed anyway
+        bool crlf = options->lf_to_crlf;
+        if (not options->lf_to_crlf and not options->crlf_to_lf) {
+            size_t last = len;
+            while (last > start and data[last - 1] != '\n') {
+                last--;
+            }
+            crlf = last >= start + 2 and data[last - 2] == '\r';
+        }
+        // a \r at the very end is taken as the start of the missing line ending, not a line of its own
+        if (data[len - 1] == '\r') {
+            on_fix(crlf ? len : len - 1, crlf ? 0 : 1, "\n", 1);
+        } else {
+            on_fix(len, 0, crlf ? "\r\n" : "\n", crlf ? 2 : 1);
+        }
+        counts->final_newlines++;
+    }
+}
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+//What `normalize` should fix
+struct NormalizeOptions {
+    bool crlf_to_lf, lf_to_crlf,        // Not both
+         strip_bom,
+         final_newline;                 // Make sure a non-empty file ends with a line ending
+    size_t tab_width;                   // Tabs become spaces up to the next multiple of this (in characters), 0 leaves them alone
+};
+
+//How many of each fix there were
+struct NormalizeCounts {
+    size_t boms, crlf_to_lf, lf_to_crlf, tabs, final_newlines;
+};
+
+//Goes over `data` (a whole file) once and calls `on_fix` for every change, in order: the `len` bytes at `offset` turn
+//into `replacement`. Everything in between stays as it is, so if `on_fix` is never called there's nothing to write.
+//Only the bytes that can need a fix are looked at one at a time, the rest are skipped over a vector at a time
+void normalize(const struct NormalizeOptions *options, const char *data, size_t len, struct NormalizeCounts *counts,
+               void (^on_fix)(size_t offset, size_t len, const char *replacement, size_t replacement_len));
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,60 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+size_t default_thread_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+struct ParallelFor {
+    void (^body)(size_t index);
+    size_t count;
+    _Atomic size_t next;
+};
+
+static void *nullable parallel_worker(void *nullable arg)
+{
+    struct ParallelFor *work = (struct ParallelFor *)arg;
+    size_t index;
+    while ((index = atomic_fetch_add_explicit(&work->next, 1, memory_order_relaxed)) < work->count) {
+        work->body(index);
+    }
+    return nullptr;
+}
+
+void parallel_for(size_t count, size_t threads, void (^body)(size_t index))
+{
+    if (threads > count)
+        threads = count;
+    if (threads <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+
+    struct ParallelFor work = { .body = body, .count = count };
+    // on the heap, a stack array sized by the caller is one big `--threads` away from running off the stack
+    pthread_t *workers = $malloc((threads - 1) * sizeof(pthread_t));
+    defer { free(workers); };
+    size_t started = 0;
+    for (; started < threads - 1; started++) {
+        // not being able to start more threads just means less parallelism, the caller still gets through everything
+        if (pthread_create(&workers[started], nullptr, &parallel_worker, &work) != 0)
+            break;
+    }
+
+    parallel_worker(&work);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], nullptr);
+    }
+}
+
+#pragma clang assume_nonnull end
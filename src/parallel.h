@@ -0,0 +1,13 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+//One per online CPU
+size_t default_thread_count(void);
+//Runs `body` for every index in [0, count) spread over up to `threads` threads (the caller being one of them),
+//and returns once every one of them is done. Indices are handed out one at a time, so uneven work balances out
+void parallel_for(size_t count, size_t threads, void (^body)(size_t index));
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,225 @@
+#include "pipeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+//Single producer, single consumer. Slots `drained` up to `filled` are ready for the consumer, the rest belong to the
+//producer. Each side only ever writes its own counter
+struct Ring {
+    struct PipelineBuffer slots[PIPELINE_DEPTH];
+    _Atomic size_t filled, drained;
+    _Atomic bool closed;                // Nothing more is coming after what's been filled
+};
+
+struct Pipeline {
+    int in_fd, out_fd;
+    struct Ring input, output;
+    _Atomic bool failed;                // Every stage gives up as soon as it sees this
+};
+
+//Waiting on the other side of a ring: spinning is cheapest when it's about to be ready, sleeping when it isn't (and
+//when there are fewer cores than threads)
+static void backoff(unsigned *spins)
+{
+    if (++*spins < 64)
+        return;
+    if (*spins < 128) {
+        sched_yield();
+        return;
+    }
+    nanosleep(&(struct timespec) { .tv_nsec = 50 * 1000 }, nullptr);
+}
+
+//The next slot for the producer to fill, nullptr if the pipeline failed
+static struct PipelineBuffer *nullable ring_acquire(struct Ring *ring, _Atomic bool *failed)
+{
+    size_t filled = atomic_load_explicit(&ring->filled, memory_order_relaxed);
+    for (unsigned spins = 0; filled - atomic_load_explicit(&ring->drained, memory_order_acquire) == PIPELINE_DEPTH;) {
+        if (atomic_load_explicit(failed, memory_order_relaxed))
+            return nullptr;
+        backoff(&spins);
+    }
+    return &ring->slots[filled % PIPELINE_DEPTH];
+}
+
+static void ring_publish(struct Ring *ring)
+{ atomic_fetch_add_explicit(&ring->filled, 1, memory_order_release); }
+
+static void ring_close(struct Ring *ring)
+{ atomic_store_explicit(&ring->closed, true, memory_order_release); }
+
+//The next slot for the consumer, nullptr once the producer is done and everything has been drained (or it failed)
+static struct PipelineBuffer *nullable ring_peek(struct Ring *ring, _Atomic bool *failed)
+{
+    size_t drained = atomic_load_explicit(&ring->drained, memory_order_relaxed);
+    for (unsigned spins = 0; atomic_load_explicit(&ring->filled, memory_order_acquire) == drained;) {
+        // closing comes after the last publish, so if it's closed and still empty there's nothing left
+        if (atomic_load_explicit(&ring->closed, memory_order_acquire) and atomic_load_explicit(&ring->filled, memory_order_acquire) == drained)
+            return nullptr;
+        if (atomic_load_explicit(failed, memory_order_relaxed))
+            return nullptr;
+        backoff(&spins);
+    }
+    return &ring->slots[drained % PIPELINE_DEPTH];
+}
+
+static void ring_release(struct Ring *ring)
+{ atomic_fetch_add_explicit(&ring->drained, 1, memory_order_release); }
+
+static void buffer_reserve(struct PipelineBuffer *buffer, size_t capacity)
+{
+    if (capacity <= buffer->capacity)
+        return;
+    size_t grown = buffer->capacity ? buffer->capacity : PIPELINE_BUFFER_SIZE;
+    while (grown < capacity) {
+        grown *= 2;
+    }
+    buffer->data = $realloc(buffer->data, grown);
+    buffer->capacity = grown;
+}
+
+void pipeline_emit(struct PipelineBuffer *out, const void *data, size_t len)
+{
+    if (len == 0)
+        return;
+    buffer_reserve(out, out->len + len);
+    char *buffer = $assert_nonnull(out->data);
+    memcpy(&buffer[out->len], data, len);
+    out->len += len;
+}
+
+static void fail(struct Pipeline *pipeline, const char *message)
+{
+    perror(message);
+    atomic_store(&pipeline->failed, true);
+}
+
+//Fills buffers with whole lines. Whatever comes after the last newline of a read is carried over to the start of the
+//next buffer, and a line that doesn't fit just makes its buffer bigger
+static void *nullable reader(void *nullable arg)
+{
+    struct Pipeline *pipeline = (struct Pipeline *)arg;
+    __block struct PipelineBuffer carry = {0};
+    defer { free(carry.data); };
+
+    for (;;) {
+        struct PipelineBuffer *slot = ring_acquire(&pipeline->input, &pipeline->failed);
+        if (slot == nullptr)
+            break;
+        buffer_reserve(slot, carry.len + PIPELINE_BUFFER_SIZE / 2);
+        slot->len = 0;
+        if (carry.len > 0) {
+            char *carried = $assert_nonnull(carry.data);
+            pipeline_emit(slot, carried, carry.len);
+        }
+        carry.len = 0;
+
+        size_t cut = SIZE_MAX;      // Just past the last newline
+        bool eof = false;
+        while (cut == SIZE_MAX and not eof) {
+            if (slot->len == slot->capacity)
+                buffer_reserve(slot, slot->capacity * 2);
+            char *data = $assert_nonnull(slot->data);
+            ssize_t bytes = read(pipeline->in_fd, &data[slot->len], slot->capacity - slot->len);
+            if (bytes < 0) {
+                if (errno == EINTR)
+                    continue;
+                fail(pipeline, "Error reading file");
+                return nullptr;
+            }
+            eof = bytes == 0;
+            for (size_t i = slot->len + (size_t)bytes; i > slot->len; i--) {
+                if (data[i - 1] == '\n') {
+                    cut = i;
+                    break;
+                }
+            }
+            slot->len += (size_t)bytes;
+        }
+
+        if (not eof) {
+            char *data = $assert_nonnull(slot->data);
+            pipeline_emit(&carry, &data[cut], slot->len - cut);
+            slot->len = cut;
+        }
+        // at EOF the slot has everything left, an unterminated last line included
+        if (slot->len > 0)
+            ring_publish(&pipeline->input);
+        if (eof)
+            break;
+    }
+    ring_close(&pipeline->input);
+    return nullptr;
+}
+
+static void *nullable writer(void *nullable arg)
+{
+    struct Pipeline *pipeline = (struct Pipeline *)arg;
+    struct PipelineBuffer *slot;
+    while ((slot = ring_peek(&pipeline->output, &pipeline->failed)) != nullptr) {
+        if (slot->len > 0) {
+            char *data = $assert_nonnull(slot->data);
+            if (write_all(pipeline->out_fd, data, slot->len) != 0) {
+                fail(pipeline, "Error writing file");
+                return nullptr;
+            }
+        }
+        ring_release(&pipeline->output);
+    }
+    return nullptr;
+}
+
+int pipeline_run(int in_fd, int out_fd, void (^process)(const char *data, size_t len, struct PipelineBuffer *out))
+{
+    __block struct Pipeline pipeline = { .in_fd = in_fd, .out_fd = out_fd };
+    defer {
+        for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+            free(pipeline.input.slots[i].data);
+            free(pipeline.output.slots[i].data);
+        }
+    };
+#if defined(__linux__)
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    pthread_t reader_thread, writer_thread;
+    if (pthread_create(&reader_thread, nullptr, reader, &pipeline) != 0) {
+        perror("Error starting reader thread");
+        return -1;
+    }
+    if (pthread_create(&writer_thread, nullptr, writer, &pipeline) != 0) {
+        perror("Error starting writer thread");
+        atomic_store(&pipeline.failed, true);
+        pthread_join(reader_thread, nullptr);
+        return -1;
+    }
+
+    struct PipelineBuffer *in;
+    while ((in = ring_peek(&pipeline.input, &pipeline.failed)) != nullptr) {
+        struct PipelineBuffer *out = ring_acquire(&pipeline.output, &pipeline.failed);
+        if (out == nullptr)
+            break;
+        out->len = 0;
+        char *data = $assert_nonnull(in->data);
+        process(data, in->len, out);
+        ring_release(&pipeline.input);
+        ring_publish(&pipeline.output);
+    }
+    ring_close(&pipeline.output);
+
+    pthread_join(reader_thread, nullptr);
+    pthread_join(writer_thread, nullptr);
+    return atomic_load(&pipeline.failed) ? -1 : 0;
+}
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#pragma clang assume_nonnull begin
+
+enum {
+    PIPELINE_BUFFER_SIZE = READ_BUFFER_SIZE,
+    PIPELINE_DEPTH = 4,                 // Buffers in flight between each pair of stages
+};
+
+//One buffer going around a pipeline
+struct PipelineBuffer {
+    char *nullable data;
+    size_t len, capacity;
+};
+
+//Adds to the output of a pipeline's processing stage
+void pipeline_emit(struct PipelineBuffer *out, const void *data, size_t len);
+
+//Reads `in_fd` from its offset to the end, runs `process` over it a run of whole lines at a time (in order, always on
+//the calling thread) and writes whatever it emits to `out_fd`. Reading and writing get a thread each, and hand buffers
+//to and from the caller through lock-free rings, so the disk and the CPU work all overlap
+int pipeline_run(int in_fd, int out_fd, void (^process)(const char *data, size_t len, struct PipelineBuffer *out));
+
+#pragma clang assume_nonnull end
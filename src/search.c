@@ -0,0 +1,273 @@
+#include "search.h"
+#include "simd.h"
+#include "utf8.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#pragma clang assume_nonnull begin
+
+//Roughly how common `byte` is at the start of a character in text, for picking the rarest one to look for
+static unsigned byte_frequency(uint8_t byte)
+{
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+    const char *found = byte != 0 ? strchr(common, ascii_lower(byte)) : nullptr;
+    return found ? 2 + (unsigned)(sizeof(common) - (size_t)(found - common)) : 2;
+}
+
+//What a code point of the needle can look like in the haystack: the first bytes of everything that folds to it, the
+//first repeated to fill the slots
+struct FoldedLeads {
+    uint8_t bytes[3];
+    size_t count,                   // 0 if there are too many to look for
+           length;                  // Of their UTF-8, 0 if they aren't all as long
+};
+
+static size_t utf8_encoded_length(uint32_t cp)
+{ return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4; }
+
+static uint8_t utf8_lead_byte(uint32_t cp)
+{
+    size_t length = utf8_encoded_length(cp);
+    static const uint8_t marks[] = { 0, 0, 0xC0, 0xE0, 0xF0 };
+    return (uint8_t)(marks[length] | cp >> (6 * (length - 1)));
+}
+
+static struct FoldedLeads folded_leads(uint32_t folded)
+{
+    // a bad byte in the needle only matches itself
+    if (folded >= UTF8_INVALID) {
+        uint8_t byte = (uint8_t)(folded - UTF8_INVALID);
+        return (struct FoldedLeads) { .bytes = { byte, byte, byte }, .count = 1, .length = 1 };
+    }
+
+    uint32_t sources[8];
+    size_t source_count = unicode_fold_sources(folded, sources, sizeof(sources) / sizeof(*sources));
+
+    struct FoldedLeads leads = {0};
+    for (size_t i = 0; i < source_count; i++) {
+        uint8_t lead = utf8_lead_byte(sources[i]);
+        if (memchr(leads.bytes, lead, leads.count) == nullptr) {
+            if (leads.count == sizeof(leads.bytes))
+                return (struct FoldedLeads) {0};
+            leads.bytes[leads.count++] = lead;
+        }
+        size_t length = utf8_encoded_length(sources[i]);
+        leads.length = i == 0 or length == leads.length ? length : 0;
+    }
+    for (size_t i = leads.count; i < sizeof(leads.bytes); i++) {
+        leads.bytes[i] = leads.bytes[0];
+    }
+    return leads;
+}
+
+//Picks the code point of the needle whose possible first bytes are fewest and rarest, and a neighbour of it that's
+//always the same number of bytes away, like `find_bytes` does with the first and last byte
+static void choose_anchor(struct Searcher *searcher)
+{
+    const uint32_t *folded = $assert_nonnull(searcher->folded);
+    struct FoldedLeads best = {0};
+    unsigned best_score = UINT32_MAX;
+    for (size_t i = 0; i < searcher->folded_len; i++) {
+        struct FoldedLeads leads = folded_leads(folded[i]);
+        unsigned score = 0;
+        for (size_t j = 0; j < leads.count; j++) {
+            score += byte_frequency(leads.bytes[j]);
+        }
+        if (leads.count > 0 and score < best_score) {
+            best = leads;
+            best_score = score;
+            searcher->anchor = i;
+        }
+    }
+    if (best.count == 0)
+        return;
+    memcpy(searcher->anchor_bytes, best.bytes, sizeof(best.bytes));
+    searcher->anchor_count = best.count;
+
+    size_t anchor = searcher->anchor;
+    struct FoldedLeads after = anchor + 1 < searcher->folded_len ? folded_leads(folded[anchor + 1]) : (struct FoldedLeads) {0},
+                       before = anchor > 0 ? folded_leads(folded[anchor - 1]) : (struct FoldedLeads) {0};
+    if (best.length > 0 and after.count > 0) {
+        memcpy(searcher->neighbour_bytes, after.bytes, sizeof(after.bytes));
+        searcher->neighbour_offset = (ptrdiff_t)best.length;
+    } else if (before.length > 0 and before.count > 0) {
+        memcpy(searcher->neighbour_bytes, before.bytes, sizeof(before.bytes));
+        searcher->neighbour_offset = -(ptrdiff_t)before.length;
+    }
+}
+
+void searcher_init(struct Searcher *searcher, const char *needle, bool ignore_case)
+{
+    size_t needle_len = strlen(needle);
+    *searcher = (struct Searcher) {
+        .needle = needle,
+        .needle_len = needle_len,
+        .ignore_case = ignore_case,
+    };
+    if (not ignore_case)
+        return;
+
+    char *lowered = $malloc(needle_len + 1);
+    for (size_t i = 0; i <= needle_len; i++) {
+        lowered[i] = (char)ascii_lower((uint8_t)needle[i]);
+        searcher->unicode |= (uint8_t)needle[i] >= 0x80;
+    }
+    searcher->needle = lowered;
+
+    if (searcher->unicode) {
+        uint32_t *folded = $malloc(needle_len * sizeof(uint32_t));
+        for (size_t i = 0; i < needle_len;) {
+            uint32_t cp;
+            i += utf8_decode(&needle[i], needle_len - i, &cp);
+            folded[searcher->folded_len++] = unicode_fold(cp);
+        }
+        searcher->folded = folded;
+        choose_anchor(searcher);
+    }
+}
+
+void searcher_free(struct Searcher *searcher)
+{
+    if (searcher->ignore_case)
+        free((void *)searcher->needle);
+    free(searcher->folded);
+    searcher->folded = nullptr;
+}
+
+static inline bool matches_at(const struct Searcher *searcher, const char *at)
+{
+    if (not searcher->ignore_case)
+        return memcmp(at, searcher->needle, searcher->needle_len) == 0;
+
+    for (size_t i = 0; i < searcher->needle_len; i++) {
+        if (ascii_lower((uint8_t)at[i]) != (uint8_t)searcher->needle[i])
+            return false;
+    }
+    return true;
+}
+
+//Looks for the needle's first and last byte a vector at a time (each `needle_len - 1` apart) and only compares the
+//whole thing where both line up, see http://0x80.pl/articles/simd-strfind.html
+static const char *nullable find_bytes(const struct Searcher *searcher, const char *haystack, size_t len)
+{
+    size_t needle_len = searcher->needle_len;
+    if (needle_len == 0)
+        return haystack;
+    if (needle_len > len)
+        return nullptr;
+
+    uint8_t first = (uint8_t)searcher->needle[0], last = (uint8_t)searcher->needle[needle_len - 1];
+    simd_bytes firsts = simd_splat(first), lasts = simd_splat(last);
+
+    size_t i = 0;
+    for (; i + needle_len - 1 + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        simd_bytes block_first = simd_load(&haystack[i]),
+                   block_last = simd_load(&haystack[i + needle_len - 1]);
+        if (searcher->ignore_case) {
+            block_first = simd_ascii_lower(block_first);
+            block_last = simd_ascii_lower(block_last);
+        }
+
+        uint32_t candidates = simd_mask((simd_bytes)(block_first == firsts) & (simd_bytes)(block_last == lasts));
+        while (candidates) {
+            size_t at = i + (size_t)__builtin_ctz(candidates);
+            if (matches_at(searcher, &haystack[at]))
+                return &haystack[at];
+            candidates &= candidates - 1;
+        }
+    }
+
+    for (; i + needle_len <= len; i++) {
+        uint8_t c = (uint8_t)haystack[i];
+        if ((searcher->ignore_case ? ascii_lower(c) : c) == first and matches_at(searcher, &haystack[i]))
+            return &haystack[i];
+    }
+    return nullptr;
+}
+
+//Whether the code points from `at` on fold to the needle's
+static bool folded_matches_at(const struct Searcher *searcher, const char *at, const char *end)
+{
+    const uint32_t *folded = $assert_nonnull(searcher->folded);
+    const char *pos = at;
+    for (size_t i = 0; i < searcher->folded_len; i++) {
+        if (pos >= end)
+            return false;
+        uint32_t cp;
+        pos += utf8_decode(pos, (size_t)(end - pos), &cp);
+        if (unicode_fold(cp) != folded[i])
+            return false;
+    }
+    return true;
+}
+
+//The match whose anchor code point is at `at`, if there is one
+static const char *nullable match_around_anchor(const struct Searcher *searcher, const char *haystack, size_t at, const char *end)
+{
+    const char *start = &haystack[at];
+    for (size_t back = 0; back < searcher->anchor; back++) {
+        if (start == haystack)
+            return nullptr;
+        start--;
+        while (start > haystack and ((uint8_t)*start & 0xC0) == 0x80) {
+            start--;
+        }
+    }
+    return folded_matches_at(searcher, start, end) ? start : nullptr;
+}
+
+//Folding every code point of the haystack is slow, so it's only done around the bytes a match's anchor code point can
+//start with, found a vector at a time. Simple case folding is one code point to one, so a match starts exactly `anchor`
+//code points before it. Lead bytes are never continuation bytes, so those positions are all character boundaries
+static const char *nullable find_folded(const struct Searcher *searcher, const char *haystack, size_t len)
+{
+    const char *end = haystack + len;
+    if (searcher->anchor_count == 0) {
+        for (const char *pos = haystack; pos < end;) {
+            if (folded_matches_at(searcher, pos, end))
+                return pos;
+            uint32_t cp;
+            pos += utf8_decode(pos, (size_t)(end - pos), &cp);
+        }
+        return nullptr;
+    }
+
+    // without a neighbour to check, the anchor is compared with itself
+    const uint8_t *bytes = searcher->anchor_bytes, *neighbour = searcher->neighbour_bytes;
+    ptrdiff_t offset = searcher->neighbour_offset;
+    if (offset == 0)
+        neighbour = bytes;
+    simd_bytes leads[3] = { simd_splat(bytes[0]), simd_splat(bytes[1]), simd_splat(bytes[2]) },
+               neighbours[3] = { simd_splat(neighbour[0]), simd_splat(neighbour[1]), simd_splat(neighbour[2]) };
+
+    // a match can't have its anchor before `from`, or past `to` (past the end is fine for the scalar check, which verifies)
+    size_t from = offset < 0 ? (size_t)-offset : 0, to = offset > 0 ? (size_t)offset : 0;
+    size_t i = from;
+    for (; i + to + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        simd_bytes v = simd_load(&haystack[i]), w = simd_load(&haystack[(ptrdiff_t)i + offset]);
+        simd_bytes found = ((simd_bytes)(v == leads[0]) | (simd_bytes)(v == leads[1]) | (simd_bytes)(v == leads[2]))
+                         & ((simd_bytes)(w == neighbours[0]) | (simd_bytes)(w == neighbours[1]) | (simd_bytes)(w == neighbours[2]));
+        for (uint32_t candidates = simd_mask(found); candidates; candidates &= candidates - 1) {
+            const char *match = match_around_anchor(searcher, haystack, i + (size_t)__builtin_ctz(candidates), end);
+            if (match != nullptr)
+                return match;
+        }
+    }
+    for (; i < len; i++) {
+        uint8_t c = (uint8_t)haystack[i];
+        if (c == bytes[0] or c == bytes[1] or c == bytes[2]) {
+            const char *match = match_around_anchor(searcher, haystack, i, end);
+            if (match != nullptr)
+                return match;
+        }
+    }
+    return nullptr;
+}
+
+const char *searcher_find(const struct Searcher *searcher, const char *haystack, size_t len)
+{
+    return searcher->unicode ? find_folded(searcher, haystack, len) : find_bytes(searcher, haystack, len);
+}
+
+#pragma clang assume_nonnull end
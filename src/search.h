@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+//A compiled needle for `searcher_find`
+struct Searcher {
+    const char *needle;             // Lowercased copy with `ignore_case`
+    size_t needle_len;
+    bool ignore_case,
+         unicode;                   // `ignore_case` with a non-ASCII needle, which has to be compared a code point at a time
+    uint32_t *nullable folded;      // Case folded code points of the needle, only for `unicode`
+    size_t folded_len;
+    size_t anchor;                  // Which of them a match is looked for by, see `find_folded`
+    uint8_t anchor_bytes[3];        // First bytes of everything that folds to the anchor, the first repeated if there are fewer
+    size_t anchor_count;            // 0 if there isn't a usable anchor and every code point has to be folded
+    uint8_t neighbour_bytes[3];     // Same for the code point next to the anchor, if it's always `neighbour_offset` bytes away
+    ptrdiff_t neighbour_offset;     // 0 if there's no such neighbour
+};
+
+void searcher_init(struct Searcher *searcher, const char *needle, bool ignore_case);
+void searcher_free(struct Searcher *searcher);
+//Returns where the first match in `haystack` starts, or nullptr if there isn't one
+const char *nullable searcher_find(const struct Searcher *searcher, const char *haystack, size_t len);
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+
+#include <string.h>
+#if defined(__SSE2__)
+#   include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#   include <arm_neon.h>
+#endif
+
+#pragma clang assume_nonnull begin
+
+//Portable vectors using the GCC/clang `vector_size` extension, only movemask needs per-arch code.
+//32 bytes so x86 gets two SSE2 registers' worth per iteration without needing `-mavx2`
+
+enum {
+    SIMD_WIDTH = 32,
+};
+
+typedef uint8_t simd_bytes __attribute__((vector_size(SIMD_WIDTH)));
+typedef uint8_t simd_half __attribute__((vector_size(SIMD_WIDTH / 2)));
+
+static inline simd_bytes simd_load(const void *data)
+{
+    simd_bytes v;
+    memcpy(&v, data, sizeof(v)); // unaligned load
+    return v;
+}
+
+static inline simd_bytes simd_splat(uint8_t byte)
+{ return (simd_bytes){0} + byte; }
+
+//Lanes equal to `byte` become 0xFF, everything else 0
+static inline simd_bytes simd_eq(simd_bytes v, uint8_t byte)
+{ return (simd_bytes)(v == simd_splat(byte)); }
+
+static inline uint16_t simd_half_mask(simd_half lanes)
+{
+#if defined(__SSE2__)
+    return (uint16_t)_mm_movemask_epi8((__m128i)lanes);
+#elif defined(__ARM_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t masked = vandq_u8((uint8x16_t)lanes, vld1q_u8(bits));
+    return (uint16_t)(vaddv_u8(vget_low_u8(masked)) | vaddv_u8(vget_high_u8(masked)) << 8);
+#else
+    uint16_t mask = 0;
+    for (int i = 0; i < 16; i++) {
+        mask |= (uint16_t)((lanes[i] >> 7) << i);
+    }
+    return mask;
+#endif
+}
+
+//One bit per lane, set where the top bit of the lane is set (so for the result of a comparison, where it was true)
+static inline uint32_t simd_mask(simd_bytes lanes)
+{
+    simd_half low, high;
+    memcpy(&low, &lanes, sizeof(low));
+    memcpy(&high, (const char *)&lanes + sizeof(low), sizeof(high));
+    return simd_half_mask(low) | (uint32_t)simd_half_mask(high) << 16;
+}
+
+static inline size_t simd_sum(simd_bytes v)
+{
+    size_t sum = 0;
+    for (int i = 0; i < SIMD_WIDTH; i++) {
+        sum += v[i];
+    }
+    return sum;
+}
+
+static inline bool simd_any(simd_bytes lanes)
+{ return simd_mask(lanes) != 0; }
+
+//'A'-'Z' to 'a'-'z', everything else left alone
+static inline simd_bytes simd_ascii_lower(simd_bytes v)
+{
+    simd_bytes upper = (simd_bytes)((simd_bytes)(v - simd_splat('A')) < simd_splat(26));
+    return v | (upper & simd_splat(0x20));
+}
+
+static inline uint8_t ascii_lower(uint8_t c)
+{ return (uint8_t)(c - 'A') < 26 ? c | 0x20 : c; }
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,457 @@
+#include "sort.h"
+#include "fileio.h"
+#include "parallel.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    SORT_MERGE_BUFFER = 64 * 1024, // smallest read buffer a run gets while merging
+};
+
+static inline bool is_blank(char c)
+{ return c == ' ' or c == '\t'; }
+
+//Good enough for sorting: sign, digits and a fraction. Anything that isn't a number sorts as 0, like `sort -n`
+static double parse_number(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len and is_blank(data[i])) {
+        i++;
+    }
+
+    bool negative = false;
+    if (i < len and (data[i] == '-' or data[i] == '+')) {
+        negative = data[i++] == '-';
+    }
+
+    double value = 0;
+    for (; i < len and data[i] >= '0' and data[i] <= '9'; i++) {
+        value = value * 10 + (data[i] - '0');
+    }
+    if (i < len and data[i] == '.') {
+        double scale = 0.1;
+        for (i++; i < len and data[i] >= '0' and data[i] <= '9'; i++, scale /= 10) {
+            value += (data[i] - '0') * scale;
+        }
+    }
+    return negative ? -value : value;
+}
+
+void sort_line_init(struct SortLine *line, const char *data, size_t len, const struct SortOptions *options)
+{
+    *line = (struct SortLine) { .data = data, .len = len, .key = data, .key_len = len };
+
+    if (options->key > 0) {
+        // fields are separated by runs of blanks, leading blanks don't start an empty field
+        size_t start = 0, field = 0;
+        for (;;) {
+            while (start < len and is_blank(data[start])) {
+                start++;
+            }
+            size_t end = start;
+            while (end < len and not is_blank(data[end])) {
+                end++;
+            }
+
+            if (++field == options->key or start == len) {
+                line->key = &data[start];
+                line->key_len = field == options->key ? end - start : 0;
+                break;
+            }
+            start = end;
+        }
+    }
+
+    if (options->numeric)
+        line->number = parse_number(line->key, line->key_len);
+}
+
+static inline int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    return order != 0 ? order : (a_len > b_len) - (a_len < b_len);
+}
+
+int compare_sort_lines(const struct SortLine *a, const struct SortLine *b, const struct SortOptions *options)
+{
+    int order = options->numeric ? (a->number > b->number) - (a->number < b->number)
+                                 : compare_bytes(a->key, a->key_len, b->key, b->key_len);
+    // last resort so the output doesn't depend on input order, unless keeping input order is the whole point
+    if (order == 0 and not options->stable)
+        order = compare_bytes(a->data, a->len, b->data, b->len);
+    return options->reverse ? -order : order;
+}
+
+//Right only goes first when it's strictly smaller, which is what keeps equal lines in order
+static void merge(const struct SortLine *left, size_t left_len, const struct SortLine *right, size_t right_len,
+                  struct SortLine *out, const struct SortOptions *options)
+{
+    size_t l = 0, r = 0, o = 0;
+    while (l < left_len and r < right_len) {
+        if (compare_sort_lines(&right[r], &left[l], options) < 0) {
+            out[o++] = right[r++];
+        } else {
+            out[o++] = left[l++];
+        }
+    }
+    memcpy(&out[o], &left[l], (left_len - l) * sizeof(*out));
+    o += left_len - l;
+    memcpy(&out[o], &right[r], (right_len - r) * sizeof(*out));
+}
+
+static void merge_sort(struct SortLine *lines, struct SortLine *scratch, size_t count, const struct SortOptions *options)
+{
+    if (count <= 16) {
+        for (size_t i = 1; i < count; i++) {
+            struct SortLine line = lines[i];
+            size_t j = i;
+            for (; j > 0 and compare_sort_lines(&line, &lines[j - 1], options) < 0; j--) {
+                lines[j] = lines[j - 1];
+            }
+            lines[j] = line;
+        }
+        return;
+    }
+
+    size_t half = count / 2;
+    merge_sort(lines, scratch, half, options);
+    merge_sort(&lines[half], &scratch[half], count - half, options);
+    merge(lines, half, &lines[half], count - half, scratch, options);
+    memcpy(lines, scratch, count * sizeof(*lines));
+}
+
+void sort_lines(struct SortLine *lines, size_t count, const struct SortOptions *options, size_t threads)
+{
+    // one piece per thread, sorted at the same time, then merged pairwise (also at the same time) until one is left
+    size_t pieces = threads < 1 ? 1 : threads;
+    if (pieces > count / 1024)
+        pieces = count / 1024 > 0 ? count / 1024 : 1;
+
+    struct SortLine *scratch = $malloc((count > 0 ? count : 1) * sizeof(struct SortLine));
+    defer { free(scratch); };
+
+    size_t bounds[pieces + 1];
+    for (size_t i = 0; i <= pieces; i++) {
+        bounds[i] = count * i / pieces;
+    }
+    // blocks can't capture VLAs
+    const size_t *piece_bounds = bounds;
+
+    parallel_for(pieces, threads, ^(size_t piece) {
+        merge_sort(&lines[piece_bounds[piece]], &scratch[piece_bounds[piece]], piece_bounds[piece + 1] - piece_bounds[piece], options);
+    });
+
+    for (size_t width = 1; width < pieces; width *= 2) {
+        parallel_for((pieces + 2 * width - 1) / (2 * width), threads, ^(size_t pair) {
+            size_t first = pair * 2 * width,
+                   middle = first + width < pieces ? first + width : pieces,
+                   last = first + 2 * width < pieces ? first + 2 * width : pieces;
+            size_t start = piece_bounds[first], split = piece_bounds[middle], end = piece_bounds[last];
+            merge(&lines[start], split - start, &lines[split], end - split, &scratch[start], options);
+            memcpy(&lines[start], &scratch[start], (end - start) * sizeof(*lines));
+        });
+    }
+}
+
+static int write_lines(FILE *out, const struct SortLine *lines, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (fwrite(lines[i].data, 1, lines[i].len, out) != lines[i].len or fputc('\n', out) == EOF) {
+            perror("Error writing sorted lines");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Cuts `data` into lines, up to `max_lines` of them (what `lines` has room for). Returns how many bytes made up the
+//lines that were collected (all of them if `last` and they all fit)
+static size_t collect_lines(const char *data, size_t len, bool last, struct SortLine *lines, size_t max_lines, size_t *count,
+                            const struct SortOptions *options)
+{
+    size_t start = 0;
+    *count = 0;
+    while (start < len and *count < max_lines) {
+        const char *newline = memchr(&data[start], '\n', len - start);
+        if (newline == nullptr and not last)
+            break;
+
+        size_t end = newline ? (size_t)(newline - data) : len;
+        sort_line_init(&lines[(*count)++], &data[start], end - start, options);
+        start = newline ? end + 1 : len;
+    }
+    return start;
+}
+
+//Where a sorted run is up to during the merge
+struct RunCursor {
+    struct LineReader reader;
+    const char *block;
+    size_t block_len;
+    struct SortLine line;
+    bool done;
+};
+
+static int run_cursor_advance(struct RunCursor *cursor, const struct SortOptions *options)
+{
+    if (cursor->block_len == 0) {
+        const char *block;
+        ssize_t len = line_reader_next(&cursor->reader, &block);
+        if (len < 0) {
+            perror("Error reading sorted run");
+            return -1;
+        }
+        if (len == 0) {
+            cursor->done = true;
+            return 0;
+        }
+        cursor->block = block;
+        cursor->block_len = (size_t)len;
+    }
+
+    // runs are written by us, so every line ends in a newline
+    const char *newline = $assert_nonnull(memchr(cursor->block, '\n', cursor->block_len));
+    size_t len = (size_t)(newline - cursor->block);
+    sort_line_init(&cursor->line, cursor->block, len, options);
+    cursor->block += len + 1;
+    cursor->block_len -= len + 1;
+    return 0;
+}
+
+//Whether run `a`'s current line goes out before run `b`'s. Earlier runs win ties, which keeps the merge stable
+static bool run_beats(const struct RunCursor *cursors, size_t a, size_t b, const struct SortOptions *options)
+{
+    if (cursors[a].done or cursors[b].done)
+        return not cursors[a].done;
+    int order = compare_sort_lines(&cursors[a].line, &cursors[b].line, options);
+    return order < 0 or (order == 0 and a < b);
+}
+
+//Plays the subtree under `node` out, leaving the loser of each match in the node and returning the winner
+static size_t loser_tree_build(size_t *tree, size_t node, size_t count, const struct RunCursor *cursors, const struct SortOptions *options)
+{
+    if (node >= count)
+        return node - count; // leaf
+
+    size_t left = loser_tree_build(tree, 2 * node, count, cursors, options),
+           right = loser_tree_build(tree, 2 * node + 1, count, cursors, options);
+    if (run_beats(cursors, left, right, options)) {
+        tree[node] = right;
+        return left;
+    }
+    tree[node] = left;
+    return right;
+}
+
+//k-way merge with a loser tree: each node remembers who lost there, so replacing the winner only means replaying
+//the matches on its way back up (log k comparisons, against one line each)
+static int merge_runs(int *run_fds, size_t runs, FILE *out, size_t memory, const struct SortOptions *options)
+{
+    struct RunCursor *cursors = $calloc(runs, sizeof(struct RunCursor));
+    size_t *tree = $calloc(runs, sizeof(size_t));
+    __block size_t initialised = 0;
+    defer {
+        for (size_t i = 0; i < initialised; i++) {
+            line_reader_free(&cursors[i].reader);
+        }
+        free(cursors);
+        free(tree);
+    };
+
+    size_t buffer_size = memory / runs > SORT_MERGE_BUFFER ? memory / runs : SORT_MERGE_BUFFER;
+    for (; initialised < runs; initialised++) {
+        if (lseek(run_fds[initialised], 0, SEEK_SET) < 0) {
+            perror("Error rewinding sorted run");
+            return -1;
+        }
+        line_reader_init_sized(&cursors[initialised].reader, run_fds[initialised], buffer_size);
+        if (run_cursor_advance(&cursors[initialised], options) != 0)
+            return -1;
+    }
+
+    tree[0] = loser_tree_build(tree, 1, runs, cursors, options);
+    while (not cursors[tree[0]].done) {
+        size_t winner = tree[0];
+        const struct SortLine *line = &cursors[winner].line;
+        if (fwrite(line->data, 1, line->len, out) != line->len or fputc('\n', out) == EOF) {
+            perror("Error writing sorted lines");
+            return -1;
+        }
+        if (run_cursor_advance(&cursors[winner], options) != 0)
+            return -1;
+
+        for (size_t node = (winner + runs) / 2; node > 0; node /= 2) {
+            if (run_beats(cursors, tree[node], winner, options)) {
+                size_t loser = winner;
+                winner = tree[node];
+                tree[node] = loser;
+            }
+        }
+        tree[0] = winner;
+    }
+    return 0;
+}
+
+int sort_file(int fd, FILE *out, const char *spill_path, size_t memory, const struct SortOptions *options, size_t threads, size_t *line_count)
+{
+    // mapping it all counts against the budget, and the line array is needed twice over (merge sort scratch)
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error checking file");
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+
+    if (size <= memory / 2) {
+        struct MappedFile file;
+        if (map_fd(fd, &file) != 0)
+            return -1;
+        defer { unmap_file(&file); };
+
+        size_t lines = count_newlines(file.data, file.size) + 1;
+        if (size + 2 * lines * sizeof(struct SortLine) <= memory) {
+            struct SortLine *sorted = $malloc(lines * sizeof(struct SortLine));
+            defer { free(sorted); };
+
+            size_t count;
+            collect_lines(file.data, file.size, true, sorted, lines, &count, options);
+            sort_lines(sorted, count, options, threads);
+            *line_count = count;
+            return write_lines(out, sorted, count);
+        }
+    }
+
+    // doesn't fit: fill half the budget with text and a quarter with lines (the other quarter is sort scratch),
+    // sort that, spill it, repeat, then merge all the spilled runs
+    __block int *nullable run_fds = nullptr;
+    __block size_t runs = 0;
+    defer {
+        for (size_t i = 0; i < runs; i++) {
+            if (run_fds[i] >= 0)
+                close(run_fds[i]);
+        }
+        free(run_fds);
+    };
+
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        perror("Error seeking file");
+        return -1;
+    }
+
+    size_t total = 0;
+    {
+        // only around while spilling, the merge gets the budget to itself
+        size_t arena_size = memory / 2 > 1 ? memory / 2 : 1,
+               max_lines = memory / 4 / sizeof(struct SortLine) > 0 ? memory / 4 / sizeof(struct SortLine) : 1;
+        __block char *arena = $malloc(arena_size);
+        struct SortLine *lines = $malloc(max_lines * sizeof(struct SortLine));
+        defer {
+            free(arena);
+            free(lines);
+        };
+
+        size_t used = 0;
+        bool eof = false;
+        while (not eof) {
+            ssize_t bytes = read(fd, &arena[used], arena_size - used);
+            if (bytes < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error reading file");
+                return -1;
+            }
+            eof = bytes == 0;
+            used += (size_t)bytes;
+            if (not eof and used < arena_size)
+                continue;
+
+            // whatever doesn't fit in the line budget goes into the next run
+            size_t count;
+            size_t consumed = collect_lines(arena, used, eof, lines, max_lines, &count, options);
+            if (count == 0 and not eof) {
+                // a single line bigger than the whole budget, nothing for it but to go over
+                arena_size *= 2;
+                arena = $realloc(arena, arena_size);
+                continue;
+            }
+
+            if (count > 0) {
+                sort_lines(lines, count, options, threads);
+
+                int run_fd = open_temp_file(spill_path);
+                if (run_fd < 0)
+                    return -1;
+                int *fds = $realloc(run_fds, (runs + 1) * sizeof(int));
+                fds[runs++] = run_fd;
+                run_fds = fds;
+
+                FILE *nullable run = fdopen(dup(run_fd), "wb");
+                if (run == nullptr) {
+                    perror("Error opening temporary file");
+                    return -1;
+                }
+                FILE *run_file = $assert_nonnull(run);
+                int result = write_lines(run_file, lines, count);
+                if (fclose(run_file) != 0 or result != 0) {
+                    perror("Error writing temporary file");
+                    return -1;
+                }
+                total += count;
+            }
+
+            memmove(arena, &arena[consumed], used - consumed);
+            used -= consumed;
+            eof = eof and used == 0;
+        }
+    }
+
+    *line_count = total;
+    if (runs == 0)
+        return 0;
+    int *fds = $assert_nonnull(run_fds);
+
+    // every run needs a read buffer, so with too many of them they get merged in groups first (into fewer, longer runs)
+    size_t fan_in = memory / 2 / SORT_MERGE_BUFFER > 2 ? memory / 2 / SORT_MERGE_BUFFER : 2;
+    while (runs > fan_in) {
+        size_t merged = 0;
+        for (size_t first = 0; first < runs; first += fan_in) {
+            size_t group = runs - first < fan_in ? runs - first : fan_in;
+            int merged_fd = fds[first];
+            if (group > 1) {
+                if ((merged_fd = open_temp_file(spill_path)) < 0)
+                    return -1;
+                FILE *nullable merged_run = fdopen(dup(merged_fd), "wb");
+                if (merged_run == nullptr) {
+                    perror("Error opening temporary file");
+                    close(merged_fd);
+                    return -1;
+                }
+                FILE *merged_file = $assert_nonnull(merged_run);
+                int result = merge_runs(&fds[first], group, merged_file, memory / 2, options);
+                if (fclose(merged_file) != 0 or result != 0) {
+                    perror("Error writing temporary file");
+                    close(merged_fd);
+                    return -1;
+                }
+                for (size_t i = first; i < first + group; i++) {
+                    close(fds[i]);
+                    fds[i] = -1;
+                }
+            }
+            fds[merged++] = merged_fd;
+        }
+        for (size_t i = merged; i < runs; i++) {
+            fds[i] = -1;
+        }
+        runs = merged;
+    }
+    return merge_runs(fds, runs, out, memory / 2, options);
+}
+
+#pragma clang assume_nonnull end
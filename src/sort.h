@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    SORT_DEFAULT_MEMORY = 256 << 20,
+};
+
+struct SortOptions {
+    size_t key;             // 1-based blank separated field to sort by, 0 for the whole line
+    bool numeric,
+         reverse,
+         stable;            // Equal keys keep their input order, instead of falling back to comparing whole lines
+};
+
+//A line of the input, and the part of it that's being sorted by
+struct SortLine {
+    const char *data;
+    size_t len;             // Without the newline
+    const char *key;
+    size_t key_len;
+    double number;          // `key` parsed, for `numeric`
+};
+
+void sort_line_init(struct SortLine *line, const char *data, size_t len, const struct SortOptions *options);
+int compare_sort_lines(const struct SortLine *a, const struct SortLine *b, const struct SortOptions *options);
+//Stable merge sort, split between `threads` threads
+void sort_lines(struct SortLine *lines, size_t count, const struct SortOptions *options, size_t threads);
+
+//Sorts everything from `fd` into `out` with about `memory` bytes to work with. Input that doesn't fit is sorted in
+//pieces that get spilled to temp files next to `spill_path`, and merged at the end. Every line comes out with a newline
+int sort_file(int fd, FILE *out, const char *spill_path, size_t memory, const struct SortOptions *options, size_t threads, size_t *line_count);
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,118 @@
+#include "stats.h"
+#include "simd.h"
+
+#pragma clang assume_nonnull begin
+
+static inline size_t bucket_of(size_t len)
+{
+    size_t bucket = len == 0 ? 0 : 64 - (size_t)__builtin_clzll(len);
+    return bucket < STATS_HISTOGRAM_BUCKETS ? bucket : STATS_HISTOGRAM_BUCKETS - 1;
+}
+
+static inline void record_line(struct TextStats *stats, size_t len)
+{
+    stats->histogram[bucket_of(len)]++;
+    if (len > stats->longest_line)
+        stats->longest_line = len;
+}
+
+size_t text_stats_bucket_min(size_t bucket)
+{ return bucket == 0 ? 0 : (size_t)1 << (bucket - 1); }
+
+void text_stats_chunk(const char *data, size_t len, bool after_space, struct ChunkStats *chunk)
+{
+    *chunk = (struct ChunkStats) { .stats.bytes = len };
+    struct TextStats *stats = &chunk->stats;
+
+    // everything in one pass, a vector at a time: newlines, whitespace and UTF-8 continuation bytes become bitmasks,
+    // and words are non-space bytes right after a space byte
+    size_t line_start = 0, i = 0;
+    bool seen_newline = false;
+    uint32_t previous_space = after_space;
+    for (; i + SIMD_WIDTH <= len; i += SIMD_WIDTH) {
+        simd_bytes v = simd_load(&data[i]);
+        uint32_t newlines = simd_mask(simd_eq(v, '\n')),
+                 spaces = simd_mask(simd_eq(v, ' ') | (simd_bytes)((simd_bytes)(v - simd_splat('\t')) < simd_splat(5))),
+                 continuations = simd_mask(simd_eq(v & simd_splat(0xC0), 0x80));
+
+        uint32_t word_starts = ~spaces & (spaces << 1 | previous_space);
+        previous_space = spaces >> (SIMD_WIDTH - 1);
+
+        stats->words += (size_t)__builtin_popcount(word_starts);
+        stats->chars += SIMD_WIDTH - (size_t)__builtin_popcount(continuations);
+        stats->lines += (size_t)__builtin_popcount(newlines);
+
+        for (; newlines; newlines &= newlines - 1) {
+            size_t at = i + (size_t)__builtin_ctz(newlines);
+            if (seen_newline) {
+                record_line(stats, at - line_start);
+            } else {
+                chunk->first_line = at;
+                seen_newline = true;
+            }
+            line_start = at + 1;
+        }
+    }
+
+    for (; i < len; i++) {
+        uint8_t c = (uint8_t)data[i];
+        bool space = is_space(c);
+        stats->words += not space and previous_space;
+        previous_space = space;
+        stats->chars += (c & 0xC0) != 0x80;
+
+        if (c == '\n') {
+            stats->lines++;
+            if (seen_newline) {
+                record_line(stats, i - line_start);
+            } else {
+                chunk->first_line = i;
+                seen_newline = true;
+            }
+            line_start = i + 1;
+        }
+    }
+
+    if (not seen_newline)
+        chunk->first_line = len;
+    chunk->last_line = len - line_start;
+}
+
+void text_stats_merge(struct TextStats *stats, const struct ChunkStats *chunks, size_t count)
+{
+    *stats = (struct TextStats) {0};
+
+    size_t carry = 0; // length of the line that's still running into the next chunk
+    for (size_t i = 0; i < count; i++) {
+        const struct ChunkStats *chunk = &chunks[i];
+        text_stats_add(stats, &chunk->stats);
+
+        if (chunk->stats.lines == 0) {
+            carry += chunk->first_line;
+        } else {
+            record_line(stats, carry + chunk->first_line);
+            carry = chunk->last_line;
+        }
+    }
+
+    // an unterminated last line is still a line
+    if (carry > 0) {
+        stats->lines++;
+        record_line(stats, carry);
+    }
+}
+
+void text_stats_add(struct TextStats *total, const struct TextStats *stats)
+{
+    total->lines += stats->lines;
+    total->words += stats->words;
+    total->bytes += stats->bytes;
+    total->chars += stats->chars;
+    if (stats->longest_line > total->longest_line)
+        total->longest_line = stats->longest_line;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        total->histogram[i] += stats->histogram[i];
+    }
+}
+
+#pragma clang assume_nonnull end
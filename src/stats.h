@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+enum {
+    STATS_HISTOGRAM_BUCKETS = 32,
+    STATS_CHUNK_SIZE = 8 << 20,     // Big enough that handing chunks to threads costs nothing, small enough to balance out
+};
+
+struct TextStats {
+    size_t lines,               // Like `line-count`, an unterminated last line counts
+           words,               // Runs of non-whitespace, like `wc -w`
+           bytes,
+           chars,               // UTF-8 code points, bad bytes count as one each
+           longest_line;        // In bytes, without the newline
+    size_t histogram[STATS_HISTOGRAM_BUCKETS]; // [0] is empty lines, [n] lines of 2^(n-1) up to 2^n - 1 bytes
+};
+
+//What one slice of a file looks like. Lines cut in half by the slice edges can't be measured from inside it,
+//so the partial lengths on either side are kept for `text_stats_merge` to glue together
+struct ChunkStats {
+    struct TextStats stats;     // `lines` is newlines here, `longest_line` and `histogram` only cover lines entirely inside the chunk
+    size_t first_line,          // Bytes before the first newline (the whole chunk if there isn't one)
+           last_line;           // Bytes after the last newline
+};
+
+//`after_space` is whether the byte just before the chunk was whitespace (or there wasn't one), so a word running
+//across the edge is only counted by the chunk it starts in
+void text_stats_chunk(const char *data, size_t len, bool after_space, struct ChunkStats *chunk);
+//Folds a file's chunks, in order, into its totals
+void text_stats_merge(struct TextStats *stats, const struct ChunkStats *chunks, size_t count);
+//Adds one file's totals onto another (e.g. a grand total)
+void text_stats_add(struct TextStats *total, const struct TextStats *stats);
+//Lower bound of the lengths a histogram bucket counts
+size_t text_stats_bucket_min(size_t bucket);
+
+static inline bool is_space(uint8_t c)
+{ return c == ' ' or (uint8_t)(c - '\t') < 5; } // \t \n \v \f \r
+
+#pragma clang assume_nonnull end
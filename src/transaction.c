@@ -0,0 +1,194 @@
+#include "transaction.h"
+#include "fileio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#pragma clang assume_nonnull begin
+
+//`flock` locks belong to the open file description (what Linux calls OFD locks), so unlike `fcntl` ones they
+//aren't silently dropped when some other fd to the same file gets closed
+static int lock_fd(int fd)
+{
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+int transaction_begin(struct Transaction *tx, const char *filename, bool create)
+{
+    *tx = (struct Transaction) {
+        .filename = filename,
+        .fd = -1,
+    };
+
+    // the file's own lock is the writer mutex. Whoever held it before may have renamed a new file over it while we
+    // waited, and then that one is the file now, so the lock only counts once the path still leads to what got locked
+    for (;;) {
+        tx->fd = open(filename, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (tx->fd < 0) {
+            perror("Error opening file");
+            return -1;
+        }
+        if (lock_fd(tx->fd) != 0) {
+            perror("Error locking file");
+            close(tx->fd);
+            return -1;
+        }
+
+        struct stat locked, current;
+        if (fstat(tx->fd, &locked) != 0) {
+            perror("Error checking file");
+            close(tx->fd);
+            return -1;
+        }
+        if (stat(filename, &current) == 0 and current.st_ino == locked.st_ino and current.st_dev == locked.st_dev)
+            break;
+        close(tx->fd);
+    }
+
+    tx->open = true;
+    return 0;
+}
+
+FILE *transaction_output(struct Transaction *tx)
+{
+    if (tx->out)
+        return tx->out;
+
+    // same directory, otherwise `rename` could end up crossing filesystems
+    snprintf(tx->tmp_filename, sizeof(tx->tmp_filename), "%s.XXXXXX", tx->filename);
+    int tmp_fd = mkstemp(tx->tmp_filename);
+    if (tmp_fd < 0) {
+        perror("Error creating temporary file");
+        tx->tmp_filename[0] = '\0';
+        return nullptr;
+    }
+
+    // `mkstemp` always makes it 0600, keep whatever the original had
+    struct stat st;
+    if (fstat(tx->fd, &st) == 0)
+        fchmod(tmp_fd, st.st_mode & 07777);
+
+    tx->out = fdopen(tmp_fd, "wb");
+    if (tx->out == nullptr) {
+        perror("Error opening temporary file");
+        close(tmp_fd);
+        unlink(tx->tmp_filename);
+        tx->tmp_filename[0] = '\0';
+    }
+    return tx->out;
+}
+
+void log_change(struct Transaction *tx, const char *operation, size_t line_number, size_t total_lines)
+{
+    if (tx->entry_count >= tx->entry_capacity) {
+        tx->entry_capacity = tx->entry_capacity ? tx->entry_capacity * 2 : 4;
+        tx->entries = $realloc(tx->entries, tx->entry_capacity * sizeof(struct ChangelogEntry));
+    }
+
+    struct ChangelogEntry entry = {0};
+    strncpy(entry.operation, operation, sizeof(entry.operation) - 1);
+    entry.operation[sizeof(entry.operation) - 1] = '\0';
+    entry.timestamp = time(nullptr);
+    entry.line_number = line_number;
+    entry.total_lines = total_lines;
+
+    tx->entries[tx->entry_count++] = entry;
+}
+
+//Opened (and created) only when there's something to log, so failed and no-op edits don't leave one behind. Locked
+//until the entries are in, so the next writer (who can get in as soon as the new file is renamed into place) can't
+//log before us
+static int open_changelog(const char *filename)
+{
+    char changelog_filename[PATH_MAX];
+    get_changelog_filename(filename, changelog_filename, sizeof(changelog_filename));
+    int fd = open(changelog_filename, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Error opening changelog file");
+        return -1;
+    }
+    if (lock_fd(fd) != 0) {
+        perror("Error locking changelog file");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int transaction_commit(struct Transaction *tx)
+{
+    if (not tx->open) {
+        fprintf(stderr, "Transaction on '%s' is not open.\n", tx->filename);
+        return -1;
+    }
+
+    auto out = tx->out;
+    // the data has to be on disk before the rename, or a crash could leave us with an empty file
+    // a failed `fwrite` sticks in the error flag, even if the flush afterwards goes through
+    if (out and (ferror(out) or fflush(out) != 0 or fsync(fileno(out)) != 0)) {
+        perror("Error writing temporary file");
+        return -1;
+    }
+
+    int changelog_fd = tx->entry_count > 0 ? open_changelog(tx->filename) : -1;
+    if (tx->entry_count > 0 and changelog_fd < 0)
+        return -1;
+    defer {
+        if (changelog_fd >= 0)
+            close(changelog_fd);
+    };
+
+    if (out) {
+        if (rename(tx->tmp_filename, tx->filename) != 0) {
+            perror("Error replacing file");
+            return -1;
+        }
+        fclose(out);
+        tx->out = nullptr;
+        tx->tmp_filename[0] = '\0';
+    }
+
+    int result = 0;
+    if (tx->entry_count > 0) {
+        // one `write` on an O_APPEND fd, so the whole batch lands together
+        struct ChangelogEntry *entries = $assert_nonnull(tx->entries);
+        if (write_all(changelog_fd, entries, tx->entry_count * sizeof(struct ChangelogEntry)) != 0) {
+            perror("Error writing to changelog file");
+            result = -1;
+        }
+    }
+
+    transaction_end(tx);
+    return result;
+}
+
+void transaction_end(struct Transaction *tx)
+{
+    if (not tx->open)
+        return;
+
+    auto out = tx->out;
+    if (out) {
+        fclose(out);
+        unlink(tx->tmp_filename);
+        tx->out = nullptr;
+    }
+
+    // closing is what drops the lock
+    close(tx->fd);
+    free(tx->entries);
+    tx->entries = nullptr;
+    tx->entry_count = tx->entry_capacity = 0;
+    tx->open = false;
+}
+
+#pragma clang assume_nonnull end
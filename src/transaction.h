@@ -0,0 +1,38 @@
+#pragma once
+
+#include "commands.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+static inline void get_changelog_filename(const char *filename, char *changelog_filename, size_t size)
+{ snprintf(changelog_filename, size, "%s.changelog", filename); }
+
+//A single edit of a file. Holds an exclusive lock on the file from `transaction_begin` until
+//`transaction_commit`/`transaction_end`, so writers line up behind each other. New contents go to a temp file
+//that gets renamed over the original, so readers only ever see the old file or the new one, never half of each
+//(and never have to wait for a lock either).
+struct Transaction {
+    const char *filename;
+    int fd;                                 // The file being edited, opened read/write. Its lock is the writer mutex
+    FILE *nullable out;                     // Replacement contents, see `transaction_output`
+    char tmp_filename[PATH_MAX];
+    struct ChangelogEntry *nullable entries;// Written in one go on commit
+    size_t entry_count, entry_capacity;
+    bool open;
+};
+
+//Locks `filename` for writing. The file has to exist unless `create` is set
+int transaction_begin(struct Transaction *tx, const char *filename, bool create);
+//Temp file the new contents are written to, it replaces the original on commit. If this is never called the
+//transaction edits `tx->fd` in place (appends, same-length patches)
+FILE *nullable transaction_output(struct Transaction *tx);
+//Queues a changelog entry, they are all written when the transaction commits
+void log_change(struct Transaction *tx, const char *operation, size_t line_number, size_t total_lines);
+//Makes the new contents the file's and writes the changelog, -1 if either of them failed
+int transaction_commit(struct Transaction *tx);
+//Rolls back whatever wasn't committed and drops the locks, safe to call after a commit (meant for `defer`)
+void transaction_end(struct Transaction *tx);
+
+#pragma clang assume_nonnull end
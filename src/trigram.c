@@ -0,0 +1,497 @@
+#include "trigram.h"
+#include "parallel.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#   include <linux/limits.h>
+#else
+#   include <limits.h>
+#endif
+
+#pragma clang assume_nonnull begin
+
+static const char TRIGRAM_MAGIC[8] = "TXTRIGR1";
+
+//The sidecar is this, then the dense bitmap, the newline counts, the entries and the postings, all of them 8 byte aligned
+struct TrigramIndexHeader {
+    char magic[8];
+    struct FileStamp stamp;
+    uint64_t block_size, block_count, trigram_count, postings_size;
+};
+
+//Where a trigram's postings are: the blocks it's in, ascending, as LEB128 varints of the gap from the one before
+//(the first one from 0)
+struct TrigramEntry {
+    uint32_t trigram, count,
+             last,                  // Last block in the list, so appending doesn't have to decode it
+             reserved;
+    uint64_t offset, size;
+};
+
+static inline size_t bitmap_words(size_t bits)
+{ return (bits + 63) / 64; }
+
+static inline uint32_t fold(uint8_t c)
+{ return (uint8_t)(c - 'A') < 26 ? c | 0x20 : c; }
+
+static inline uint32_t trigram_at(const char *p)
+{ return fold((uint8_t)p[0]) << 16 | fold((uint8_t)p[1]) << 8 | fold((uint8_t)p[2]); }
+
+//The distinct trigrams starting in one block, in no particular order
+struct BlockTrigrams {
+    uint32_t *nullable trigrams;
+    size_t count;
+    bool dense;
+};
+
+static void collect_block(const struct MappedFile *file, size_t block, struct BlockTrigrams *out)
+{
+    *out = (struct BlockTrigrams) {0};
+    size_t start = block * TRIGRAM_BLOCK_SIZE, end = start + TRIGRAM_BLOCK_SIZE;
+    // the last two in a block run into the next one, there just have to be enough bytes left in the file
+    if (file->size < 3)
+        return;
+    end = end < file->size - 2 ? end : file->size - 2;
+
+    // small open addressing set (0 is empty, so everything is stored plus one), text has a lot of repeats
+    size_t capacity = 4096, count = 0;
+    uint32_t *set = $calloc(capacity, sizeof(uint32_t));
+    for (size_t pos = start; pos < end; pos++) {
+        uint32_t key = trigram_at(&file->data[pos]) + 1;
+        size_t slot = (key * 0x9E3779B1u) & (capacity - 1);
+        while (set[slot] != 0 and set[slot] != key) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (set[slot] == key)
+            continue;
+        set[slot] = key;
+
+        if (++count > TRIGRAM_DENSE_LIMIT) {
+            free(set);
+            out->dense = true;
+            return;
+        }
+        if (count * 2 > capacity) {
+            size_t new_capacity = capacity * 2;
+            uint32_t *grown = $calloc(new_capacity, sizeof(uint32_t));
+            for (size_t i = 0; i < capacity; i++) {
+                if (set[i] == 0)
+                    continue;
+                size_t to = (set[i] * 0x9E3779B1u) & (new_capacity - 1);
+                while (grown[to] != 0) {
+                    to = (to + 1) & (new_capacity - 1);
+                }
+                grown[to] = set[i];
+            }
+            free(set);
+            set = grown;
+            capacity = new_capacity;
+        }
+    }
+
+    // packed down in place, nothing is ever written past what's been read
+    for (size_t i = 0, packed = 0; i < capacity; i++) {
+        if (set[i] != 0)
+            set[packed++] = set[i] - 1;
+    }
+    out->trigrams = set;
+    out->count = count;
+}
+
+//Trigram in the top half, block in the bottom half. Sorting them by trigram (stable, so blocks stay ascending) lines
+//up every trigram's postings
+static void sort_pairs(uint64_t *pairs, size_t count)
+{
+    uint64_t *scratch = $malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    uint64_t *from = pairs, *to = scratch;
+    for (unsigned shift = 32; shift < 56; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            offsets[(from[i] >> shift) & 0xFF]++;
+        }
+        for (size_t digit = 0, total = 0; digit < 256; digit++) {
+            size_t digit_count = offsets[digit];
+            offsets[digit] = total;
+            total += digit_count;
+        }
+        for (size_t i = 0; i < count; i++) {
+            to[offsets[(from[i] >> shift) & 0xFF]++] = from[i];
+        }
+        uint64_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    // three passes, so the result is in the scratch buffer
+    memcpy(pairs, from, count * sizeof(uint64_t));
+    free(scratch);
+}
+
+//Indexes blocks [first, last) of `file`, marking dense ones in `dense`, and returns the (trigram, block) pairs sorted
+static uint64_t *collect_pairs(const struct MappedFile *file, size_t first, size_t last, size_t threads, uint64_t *dense, size_t *pair_count)
+{
+    size_t count = last - first;
+    struct BlockTrigrams *blocks = $calloc(count > 0 ? count : 1, sizeof(struct BlockTrigrams));
+    parallel_for(count, threads, ^(size_t i) { collect_block(file, first + i, &blocks[i]); });
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += blocks[i].count;
+    }
+    uint64_t *pairs = $malloc((total > 0 ? total : 1) * sizeof(uint64_t));
+    size_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t block = first + i;
+        if (blocks[i].dense) {
+            dense[block / 64] |= 1ull << (block % 64);
+            continue;
+        }
+        uint32_t *nullable trigrams = blocks[i].trigrams;
+        for (size_t j = 0; j < blocks[i].count; j++) {
+            pairs[at++] = (uint64_t)trigrams[j] << 32 | block;
+        }
+        free(trigrams);
+    }
+    free(blocks);
+
+    sort_pairs(pairs, total);
+    *pair_count = total;
+    return pairs;
+}
+
+struct ByteBuffer {
+    uint8_t *nullable data;
+    size_t len, capacity;
+};
+
+static void put_varint(struct ByteBuffer *buffer, uint64_t value)
+{
+    if (buffer->len + 10 > buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1 << 16;
+        buffer->data = $realloc(buffer->data, buffer->capacity);
+    }
+    uint8_t *data = $assert_nonnull(buffer->data);
+    do {
+        data[buffer->len++] = (uint8_t)(value & 0x7F) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+    } while (value > 0);
+}
+
+static void put_bytes(struct ByteBuffer *buffer, const void *bytes, size_t len)
+{
+    if (buffer->len + len > buffer->capacity) {
+        while (buffer->len + len > buffer->capacity) {
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1 << 16;
+        }
+        buffer->data = $realloc(buffer->data, buffer->capacity);
+    }
+    uint8_t *data = $assert_nonnull(buffer->data);
+    memcpy(&data[buffer->len], bytes, len);
+    buffer->len += len;
+}
+
+//What goes in a sidecar apart from the postings
+struct IndexParts {
+    struct FileStamp stamp;
+    size_t block_count;
+    const uint64_t *dense, *newlines_before;
+};
+
+//Writes the sidecar: everything in `old` (if there is one) with the new pairs added on the end of each trigram's
+//postings. Blocks `old` already has for a trigram are skipped
+static int write_index(const char *filename, const struct IndexParts *parts, const struct TrigramIndex *nullable old,
+                       const uint64_t *pairs, size_t pair_count, struct TrigramIndexInfo *nullable info)
+{
+    __block struct TrigramEntry *nullable entries = nullptr;
+    __block struct ByteBuffer postings = {0};
+    defer {
+        free(entries);
+        free(postings.data);
+    };
+    size_t entry_count = 0, entry_capacity = 0;
+
+    size_t old_count = old ? (size_t)old->header->trigram_count : 0;
+    for (size_t i = 0, j = 0; i < old_count or j < pair_count;) {
+        uint32_t trigram = i < old_count ? old->entries[i].trigram : UINT32_MAX;
+        if (j < pair_count and (uint32_t)(pairs[j] >> 32) < trigram)
+            trigram = (uint32_t)(pairs[j] >> 32);
+
+        struct TrigramEntry entry = { .trigram = trigram, .offset = postings.len };
+        bool any = false;
+        if (i < old_count and old->entries[i].trigram == trigram) {
+            const struct TrigramEntry *old_entry = &old->entries[i++];
+            put_bytes(&postings, &old->postings[old_entry->offset], old_entry->size);
+            entry.count = old_entry->count;
+            entry.last = old_entry->last;
+            any = true;
+        }
+        for (; j < pair_count and (uint32_t)(pairs[j] >> 32) == trigram; j++) {
+            uint32_t block = (uint32_t)pairs[j];
+            if (any and block <= entry.last)
+                continue;
+            put_varint(&postings, any ? block - entry.last : block);
+            entry.last = block;
+            entry.count++;
+            any = true;
+        }
+        entry.size = postings.len - entry.offset;
+
+        if (entry_count >= entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 4096;
+            entries = $realloc(entries, entry_capacity * sizeof(struct TrigramEntry));
+        }
+        struct TrigramEntry *all = $assert_nonnull(entries);
+        all[entry_count++] = entry;
+    }
+
+    size_t words = bitmap_words(parts->block_count);
+    struct TrigramIndexHeader header = {
+        .stamp = parts->stamp,
+        .block_size = TRIGRAM_BLOCK_SIZE,
+        .block_count = parts->block_count,
+        .trigram_count = entry_count,
+        .postings_size = postings.len,
+    };
+    memcpy(header.magic, TRIGRAM_MAGIC, sizeof(header.magic));
+
+    struct iovec sections[] = {
+        { &header, sizeof(header) },
+        { (void *)parts->dense, words * sizeof(uint64_t) },
+        { (void *)parts->newlines_before, (parts->block_count + 1) * sizeof(uint64_t) },
+        { entries, entry_count * sizeof(struct TrigramEntry) },
+        { postings.data, postings.len },
+    };
+    if (save_sidecar(filename, ".trigrams", sections, sizeof(sections) / sizeof(*sections)) != 0) {
+        perror("Error writing trigram index");
+        return -1;
+    }
+
+    if (info) {
+        size_t dense_blocks = 0;
+        for (size_t w = 0; w < words; w++) {
+            dense_blocks += (size_t)__builtin_popcountll(parts->dense[w]);
+        }
+        *info = (struct TrigramIndexInfo) {
+            .blocks = parts->block_count,
+            .dense_blocks = dense_blocks,
+            .trigrams = entry_count,
+            .size = sizeof(header) + (words + parts->block_count + 1) * sizeof(uint64_t) + entry_count * sizeof(struct TrigramEntry) + postings.len,
+        };
+    }
+    return 0;
+}
+
+//Newlines before every block from `first` on, the ones before it are left alone
+static void count_block_newlines(const struct MappedFile *file, size_t first, size_t block_count, size_t threads, uint64_t *newlines_before)
+{
+    parallel_for(block_count - first, threads, ^(size_t i) {
+        size_t offset = (first + i) * TRIGRAM_BLOCK_SIZE;
+        size_t len = file->size - offset < TRIGRAM_BLOCK_SIZE ? file->size - offset : TRIGRAM_BLOCK_SIZE;
+        newlines_before[first + i + 1] = count_newlines(&file->data[offset], len);
+    });
+    for (size_t block = first; block < block_count; block++) {
+        newlines_before[block + 1] += newlines_before[block];
+    }
+}
+
+int trigram_index_build(const char *filename, size_t threads, struct TrigramIndexInfo *info)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("Error opening file");
+        return -1;
+    }
+    defer { close(fd); };
+
+    // stamped first, if it changes while it's being read the index is stale from the start rather than quietly wrong
+    struct IndexParts parts;
+    __block struct MappedFile file;
+    if (file_stamp(fd, &parts.stamp) != 0 or map_fd(fd, &file) != 0)
+        return -1;
+    defer { unmap_file(&file); };
+
+    parts.block_count = (file.size + TRIGRAM_BLOCK_SIZE - 1) / TRIGRAM_BLOCK_SIZE;
+    uint64_t *dense = $calloc(bitmap_words(parts.block_count) + 1, sizeof(uint64_t));
+    uint64_t *newlines_before = $calloc(parts.block_count + 1, sizeof(uint64_t));
+    defer {
+        free(dense);
+        free(newlines_before);
+    };
+    count_block_newlines(&file, 0, parts.block_count, threads, newlines_before);
+
+    size_t pair_count;
+    uint64_t *pairs = collect_pairs(&file, 0, parts.block_count, threads, dense, &pair_count);
+    defer { free(pairs); };
+
+    parts.dense = dense;
+    parts.newlines_before = newlines_before;
+    return write_index(filename, &parts, nullptr, pairs, pair_count, info);
+}
+
+//Maps the sidecar and checks it hangs together, without looking at whether it's stale
+static int index_map(const char *filename, struct TrigramIndex *index)
+{
+    *index = (struct TrigramIndex) {0};
+
+    char index_filename[PATH_MAX];
+    get_trigram_index_filename(filename, index_filename, sizeof(index_filename));
+    int fd = open(index_filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1; // not having one is normal
+    defer { close(fd); };
+
+    struct MappedFile map;
+    if (map_fd(fd, &map) != 0)
+        return -1;
+
+    const struct TrigramIndexHeader *header = (const struct TrigramIndexHeader *)map.data;
+    if (map.size < sizeof(*header) or memcmp(header->magic, TRIGRAM_MAGIC, sizeof(header->magic)) != 0
+        or header->block_size != TRIGRAM_BLOCK_SIZE
+        or header->block_count != (header->stamp.size + TRIGRAM_BLOCK_SIZE - 1) / TRIGRAM_BLOCK_SIZE) {
+        unmap_file(&map);
+        return -1;
+    }
+    size_t words = bitmap_words(header->block_count);
+    size_t expected = sizeof(*header) + (words + header->block_count + 1) * sizeof(uint64_t)
+                    + header->trigram_count * sizeof(struct TrigramEntry) + header->postings_size;
+    if (map.size != expected) {
+        unmap_file(&map);
+        return -1;
+    }
+
+    const uint64_t *dense = (const uint64_t *)(header + 1);
+    *index = (struct TrigramIndex) {
+        .map = map,
+        .header = header,
+        .dense = dense,
+        .newlines_before = dense + words,
+        .entries = (const struct TrigramEntry *)(dense + words + header->block_count + 1),
+        .postings = (const uint8_t *)(dense + words + header->block_count + 1) + header->trigram_count * sizeof(struct TrigramEntry),
+    };
+    return 0;
+}
+
+int trigram_index_open(const char *filename, int fd, struct TrigramIndex *index)
+{
+    struct FileStamp stamp;
+    if (index_map(filename, index) != 0)
+        return -1;
+    if (file_stamp(fd, &stamp) != 0) {
+        trigram_index_close(index);
+        return -1;
+    }
+    if (not file_stamp_equal(index->header->stamp, stamp)) {
+        trigram_index_close(index);
+        return 1;
+    }
+    return 0;
+}
+
+void trigram_index_close(struct TrigramIndex *index)
+{
+    if (index->header)
+        unmap_file(&index->map);
+    *index = (struct TrigramIndex) {0};
+}
+
+int trigram_index_extend(const char *filename, int fd, struct FileStamp before)
+{
+    __block struct TrigramIndex old;
+    if (index_map(filename, &old) != 0)
+        return 0;
+    defer { trigram_index_close(&old); };
+    if (not file_stamp_equal(old.header->stamp, before))
+        return 0;
+
+    struct IndexParts parts;
+    __block struct MappedFile file;
+    if (file_stamp(fd, &parts.stamp) != 0 or map_fd(fd, &file) != 0)
+        return -1;
+    defer { unmap_file(&file); };
+    if (file.size < before.size)
+        return 0; // not an append, the index stays stale
+
+    parts.block_count = (file.size + TRIGRAM_BLOCK_SIZE - 1) / TRIGRAM_BLOCK_SIZE;
+    size_t old_blocks = old.header->block_count;
+    uint64_t *dense = $calloc(bitmap_words(parts.block_count) + 1, sizeof(uint64_t));
+    uint64_t *newlines_before = $calloc(parts.block_count + 1, sizeof(uint64_t));
+    defer {
+        free(dense);
+        free(newlines_before);
+    };
+    memcpy(dense, old.dense, bitmap_words(old_blocks) * sizeof(uint64_t));
+    memcpy(newlines_before, old.newlines_before, (old_blocks + 1) * sizeof(uint64_t));
+
+    // the block the old end was in has new trigrams too, including the two that used to stop at the end of the file
+    size_t first = before.size >= 2 ? (size_t)(before.size - 2) / TRIGRAM_BLOCK_SIZE : 0;
+    count_block_newlines(&file, first, parts.block_count, 1, newlines_before);
+
+    size_t pair_count;
+    uint64_t *pairs = collect_pairs(&file, first, parts.block_count, 1, dense, &pair_count);
+    defer { free(pairs); };
+
+    parts.dense = dense;
+    parts.newlines_before = newlines_before;
+    return write_index(filename, &parts, &old, pairs, pair_count, nullptr);
+}
+
+size_t trigram_index_block_count(const struct TrigramIndex *index)
+{ return index->header->block_count; }
+
+static const struct TrigramEntry *nullable find_entry(const struct TrigramIndex *index, uint32_t trigram)
+{
+    size_t low = 0, high = index->header->trigram_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (index->entries[middle].trigram < trigram)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < index->header->trigram_count and index->entries[low].trigram == trigram ? &index->entries[low] : nullptr;
+}
+
+uint64_t *trigram_index_candidates(const struct TrigramIndex *index, const char *needle, size_t len)
+{
+    if (len < 3)
+        return nullptr;
+
+    size_t block_count = index->header->block_count, words = bitmap_words(block_count);
+    uint64_t *candidates = $malloc((words + 1) * sizeof(uint64_t));
+    uint64_t *present = $malloc((words + 1) * sizeof(uint64_t));
+    defer { free(present); };
+    memset(candidates, 0xFF, (words + 1) * sizeof(uint64_t));
+    const uint64_t *dense = index->dense;
+
+    // a match starting in block b has every trigram of the needle in b or b + 1, as long as none of them start more
+    // than a block into the needle. A really long needle only gets its first block's worth looked up
+    size_t last = len - 3 < TRIGRAM_BLOCK_SIZE - 1 ? len - 3 : TRIGRAM_BLOCK_SIZE - 1;
+    for (size_t i = 0; i <= last; i++) {
+        memset(present, 0, (words + 1) * sizeof(uint64_t));
+        const struct TrigramEntry *entry = find_entry(index, trigram_at(&needle[i]));
+        if (entry) {
+            const uint8_t *p = &index->postings[entry->offset];
+            uint64_t block = 0;
+            for (uint32_t n = 0; n < entry->count; n++) {
+                uint64_t gap = 0;
+                for (unsigned shift = 0;; shift += 7) {
+                    gap |= (uint64_t)(*p & 0x7F) << shift;
+                    if (not (*p++ & 0x80))
+                        break;
+                }
+                block = n == 0 ? gap : block + gap;
+                present[block / 64] |= 1ull << (block % 64);
+            }
+        }
+        for (size_t w = 0; w < words; w++) {
+            uint64_t here = present[w] | dense[w],
+                     next = w + 1 < words ? present[w + 1] | dense[w + 1] : 0;
+            candidates[w] &= here | here >> 1 | next << 63;
+        }
+    }
+    return candidates;
+}
+
+#pragma clang assume_nonnull end
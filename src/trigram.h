@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+#include "fileio.h"
+
+#include <stdio.h>
+
+#pragma clang assume_nonnull begin
+
+enum {
+    TRIGRAM_BLOCK_SIZE = 64 << 10,
+    TRIGRAM_DENSE_LIMIT = 16 << 10,     // Blocks with more distinct trigrams than this (binary junk) aren't worth indexing, they're always searched
+};
+
+static inline void get_trigram_index_filename(const char *filename, char *index_filename, size_t size)
+{ snprintf(index_filename, size, "%s.trigrams", filename); }
+
+struct TrigramIndexHeader;
+struct TrigramEntry;
+
+//A ".trigrams" sidecar, mapped. For every trigram (ASCII case folded) it has the 64K blocks it starts in, so a `find`
+//only has to search the blocks that have every trigram of the needle
+struct TrigramIndex {
+    struct MappedFile map;
+    const struct TrigramIndexHeader *nullable header;
+    const uint64_t *dense,              // Bitmap of the blocks that weren't indexed
+                   *newlines_before;    // For every block, so the line numbers of a match can be worked out without reading up to it
+    const struct TrigramEntry *entries; // Sorted by trigram
+    const uint8_t *postings;
+};
+
+//What was indexed, for reporting
+struct TrigramIndexInfo {
+    size_t blocks, dense_blocks, trigrams, size;
+};
+
+//(Re)builds the sidecar of `filename` from scratch
+int trigram_index_build(const char *filename, size_t threads, struct TrigramIndexInfo *info);
+//Brings the sidecar up to date after bytes were appended to `fd`, if it was up to date with `before` (what the file
+//looked like before the append). Only the new bytes are read. Does nothing if there's no index or it was already stale
+int trigram_index_extend(const char *filename, int fd, struct FileStamp before);
+
+//0 if it's there and made from the file as it is now (`fd`), 1 if it's out of date, -1 if there isn't a usable one
+int trigram_index_open(const char *filename, int fd, struct TrigramIndex *index);
+void trigram_index_close(struct TrigramIndex *index);
+size_t trigram_index_block_count(const struct TrigramIndex *index);
+//Bitmap of the blocks a match of `needle` can start in (free it), or nullptr if the needle is too short to rule any out
+uint64_t *nullable trigram_index_candidates(const struct TrigramIndex *index, const char *needle, size_t len);
+
+#pragma clang assume_nonnull end
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "common.h"
+
+#pragma clang assume_nonnull begin
+
+enum {
+    UTF8_INVALID = 0x110000, // Decoded bad bytes come out as `UTF8_INVALID + byte`, which nothing valid ever equals
+};
+
+//Decodes one code point from `data` into `cp`, returns how many bytes it took (always at least 1)
+size_t utf8_decode(const char *data, size_t len, uint32_t *cp);
+//Returns the first byte that isn't part of valid UTF-8, or nullptr if it's all fine
+const char *nullable utf8_validate(const char *data, size_t len);
+//Number of code points, counting every bad byte as one
+size_t utf8_length(const char *data, size_t len);
+//Unicode simple case folding (the C and S entries of CaseFolding.txt), so 'A' -> 'a', 'Σ'/'ς' -> 'σ' and so on
+uint32_t unicode_fold(uint32_t cp);
+//Every code point that `unicode_fold` turns into `folded` (itself included, if it folds to itself), up to `max` of them.
+//Returns how many there are
+size_t unicode_fold_sources(uint32_t folded, uint32_t *sources, size_t max);
+
+#pragma clang assume_nonnull end
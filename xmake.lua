@@ -28,6 +28,7 @@ if not is_plat "macosx" then
 end
 
 set_languages("gnulatest")
+add_syslinks("pthread")
 
 if is_mode "debug" then
     set_policy("build.sanitizer.address", true)
@@ -37,7 +38,7 @@ end
 
 target("text-editor", function()
     set_kind("binary")
-    add_files("src/*.c|commands.test.c")
+    add_files("src/*.c|commands.test.c|commands.bench.c")
     add_cxflags {
         "-Wall",
         "-Wextra",
@@ -60,7 +61,30 @@ end)
 
 target("text-editor-tests", function()
     set_kind("binary")
-    add_files("src/*.c|commands.c|main.c") --commands.c is included by commands.test.c
+    add_files("src/*.c|commands.c|main.c|commands.bench.c") --commands.c is included by commands.test.c
+    add_cxflags {
+        "-Wall",
+        "-Wextra",
+        "-Werror",
+        
+        "-fblocks",
+        "-Wanon-enum-enum-conversion",
+        "-Wassign-enum",
+        "-Wenum-conversion",
+        "-Wenum-enum-conversion",
+        "-Wno-unused-function",
+        "-Wno-unused-parameter",
+        "-Wnull-dereference",
+        "-Wnull-conversion",
+        "-Wnullability-completeness",
+        "-Wnullable-to-nonnull-conversion",
+        "-Wno-missing-field-initializers",
+    }
+end)
+
+target("text-editor-bench", function()
+    set_kind("binary")
+    add_files("src/*.c|commands.c|main.c|commands.test.c") --same deal as the tests, commands.c is included by commands.bench.c
     add_cxflags {
         "-Wall",
         "-Wextra",